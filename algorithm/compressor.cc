@@ -15,7 +15,9 @@ void CompressorLZ4::ResetThreadLocalStorage() {
 Status CompressorLZ4::Compress(char *source,
                                uint64_t size_source,
                                char **dest,
-                               uint64_t *size_dest) {
+                               uint64_t *size_dest,
+                               char *buffer,
+                               uint64_t size_buffer) {
   /*
   if (size_source < 8) {
     *dest = nullptr;
@@ -25,11 +27,15 @@ Status CompressorLZ4::Compress(char *source,
   */
   uint32_t bound = LZ4_compressBound(size_source);
   *size_dest = 0;
-  *dest = new char[8 + bound];
+  if (buffer != nullptr && 8 + bound <= size_buffer) {
+    *dest = buffer;
+  } else {
+    *dest = new char[8 + bound];
+  }
 
   int ret = LZ4_compress_limitedOutput(source, (*dest) + 8, size_source, bound);
   if (ret <= 0) {
-    delete[] *dest;
+    if (*dest != buffer) delete[] *dest;
     return Status::IOError("LZ4_compress_limitedOutput() failed");
   }
   uint32_t size_compressed = ret + 8;
@@ -39,7 +45,7 @@ Status CompressorLZ4::Compress(char *source,
   // we just copy the original data.
   if ((uint64_t)ret > size_source) {
     if (size_source > 8 + bound) {
-      delete[] *dest;
+      if (*dest != buffer) delete[] *dest;
       *dest = new char[8 + size_source];
     }
     memcpy((*dest) + 8, source, size_source);
@@ -140,7 +146,67 @@ Status CompressorLZ4::Uncompress(char *source,
 Status CompressorLZ4::UncompressByteArray(ByteArray& value,
                                           bool do_checksum_verification,
                                           ByteArray* value_uncompressed) {
-  Status s;
+  *value_uncompressed = ByteArray::NewAllocatedMemoryByteArray(value.size());
+  value_uncompressed->set_size(value.size());
+  value_uncompressed->set_size_compressed(0);
+  return UncompressByteArrayToBuffer(value,
+                                     do_checksum_verification,
+                                     value_uncompressed->data());
+}
+
+
+Status CompressorLZ4::UncompressSingleFrame(ByteArray& value,
+                                            bool do_checksum_verification,
+                                            char* buffer,
+                                            bool* is_single_frame) {
+  *is_single_frame = false;
+  if (!value.is_compressed() || value.size_compressed() < size_frame_header()) {
+    return Status::OK();
+  }
+  uint32_t size_compressed, size_source;
+  GetFixed32(value.data(),     &size_compressed);
+  GetFixed32(value.data() + 4, &size_source);
+  // A frame with a size_compressed of 0 holds raw data, and a frame header
+  // made only of null bytes, i.e. compression disabled mid-flight, has a
+  // size_source of 0 as well
+  uint64_t size_frame = size_compressed > 0 ? size_compressed : size_uncompressed_frame(size_source);
+  if (   size_frame != value.size_compressed()
+      || size_source != value.size()
+      || (size_compressed == 0 && size_source == 0)) {
+    return Status::OK();
+  }
+  *is_single_frame = true;
+
+  if (do_checksum_verification) {
+    uint32_t checksum = crc32c::Extend(value.checksum_initial(), value.data(), size_frame);
+    if (checksum != value.checksum()) {
+      log::debug("CompressorLZ4::UncompressSingleFrame()", "Bad CRC32 - stored:0x%08" PRIx64 " computed:0x%08" PRIx32 "\n", value.checksum(), checksum);
+      return Status::IOError("Invalid checksum.");
+    }
+  }
+
+  char *data = value.data() + size_frame_header();
+  if (size_compressed == 0) {
+    memcpy(buffer, data, size_source);
+    return Status::OK();
+  }
+  int ret = LZ4_decompress_safe(data, buffer, size_compressed - size_frame_header(), size_source);
+  if (ret < 0 || (uint32_t)ret != size_source) {
+    return Status::IOError("LZ4_decompress_safe() failed");
+  }
+  return Status::OK();
+}
+
+
+Status CompressorLZ4::UncompressByteArrayToBuffer(ByteArray& value,
+                                                  bool do_checksum_verification,
+                                                  char* buffer) {
+  // Most values fit in a single frame, and can be uncompressed with a single
+  // call, without walking the frames and their thread-local offsets
+  bool is_single_frame;
+  Status s = UncompressSingleFrame(value, do_checksum_verification, buffer, &is_single_frame);
+  if (is_single_frame) return s;
+
   if (do_checksum_verification) {
     crc32_.ResetThreadLocalStorage();
     crc32_.put(value.checksum_initial()); 
@@ -151,10 +217,6 @@ Status CompressorLZ4::UncompressByteArray(ByteArray& value,
   uint64_t offset_out = 0;
   ResetThreadLocalStorage();
 
-  *value_uncompressed = ByteArray::NewAllocatedMemoryByteArray(value.size());
-  value_uncompressed->set_size(value.size());
-  value_uncompressed->set_size_compressed(0);
-
   while (true) {
 
     if (is_compressed && !is_compression_disabled) {
@@ -183,25 +245,22 @@ Status CompressorLZ4::UncompressByteArray(ByteArray& value,
         char *frame;
         uint64_t size_frame;
         uint64_t size_out;
-        char *buffer_out = value_uncompressed->data() + offset_out;
+        char *buffer_out = buffer + offset_out;
 
         log::trace("CompressorLZ4::UncompressByteArray()", "before uncompress");
-        Status s = Uncompress(value.data(),
-                              value.size_compressed(),
-                              &buffer_out,
-                              &size_out,
-                              &frame,
-                              &size_frame,
-                              false);
+        s = Uncompress(value.data(),
+                       value.size_compressed(),
+                       &buffer_out,
+                       &size_out,
+                       &frame,
+                       &size_frame,
+                       false);
         //chunk_ = NewShallowCopyByteArray(data_out, size_out);
 
+        // NOTE: Uncompress() has already added the frame to the checksum
         if (s.IsDone()) {
           return Status::OK();
-        } else if (s.IsOK()) {
-          if (do_checksum_verification) {
-            crc32_.stream(frame, size_frame);
-          }
-        } else {
+        } else if (!s.IsOK()) {
           return s;
         }
 
@@ -232,7 +291,7 @@ Status CompressorLZ4::UncompressByteArray(ByteArray& value,
         crc32_.stream(data_left, size_current);
       }
 
-      memcpy(value_uncompressed->data() + offset_out, data_left, size_current);
+      memcpy(buffer + offset_out, data_left, size_current);
 
       //chunk_ = value;
       //chunk_.increment_offset(offset);
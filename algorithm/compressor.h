@@ -118,10 +118,15 @@ class CompressorLZ4 {
 
   void ResetThreadLocalStorage();
 
+  // If 'buffer' is large enough for the frame, the frame is written into it
+  // and 'compressed_out' is set to 'buffer', otherwise the memory of the
+  // frame is allocated and must be released by the caller.
   Status Compress(char *raw_in,
                   uint64_t size_raw_in,
                   char **compressed_out,
-                  uint64_t *size_compressed_out
+                  uint64_t *size_compressed_out,
+                  char *buffer=nullptr,
+                  uint64_t size_buffer=0
                  );
 
   bool IsUncompressionDone(uint64_t size_source);
@@ -138,6 +143,12 @@ class CompressorLZ4 {
                              bool do_checksum_verification,
                              ByteArray* value_uncompressed);
 
+  // Uncompresses 'value' into 'buffer', which must be at least value.size()
+  // bytes large.
+  Status UncompressByteArrayToBuffer(ByteArray& value,
+                                     bool do_checksum_verification,
+                                     char* buffer);
+
   void DisableCompressionInFrameHeader(char* frame) {
     for (uint64_t i = 0; i < size_frame_header(); i++) frame[i] = 0;
   }
@@ -170,6 +181,11 @@ class CompressorLZ4 {
 
 
  private:
+  Status UncompressSingleFrame(ByteArray& value,
+                               bool do_checksum_verification,
+                               char* buffer,
+                               bool* is_single_frame);
+
   ThreadStorage ts_compress_;
   ThreadStorage ts_uncompress_;
   CRC32 crc32_;
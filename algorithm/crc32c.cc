@@ -14,11 +14,34 @@
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 //
 // A portable implementation of crc32c, optimized to handle
-// four bytes at a time.
+// four bytes at a time. When the CPU has instructions for crc32c, SSE4.2 on
+// x86-64 or the CRC extension on ARMv8, they are used instead, which is
+// detected once at runtime.
+//
+// The hardware implementations follow the ones by Mark Adler in
+// "crc32c.c -- compute CRC-32C using the Intel crc32 instruction"
+// Copyright (C) 2013 Mark Adler
 
 #include "algorithm/crc32c.h"
 
 #include <stdint.h>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define KINGDB_CRC32C_SSE42
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+#define KINGDB_CRC32C_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
 
 namespace kdb {
 namespace crc32c {
@@ -293,7 +316,7 @@ static inline uint32_t LE_LOAD32(const uint8_t *p) {
   return DecodeFixed32(reinterpret_cast<const char*>(p));
 }
 
-uint32_t Extend(uint32_t crc, const char* buf, size_t size) {
+static uint32_t ExtendSoftware(uint32_t crc, const char* buf, size_t size) {
   const uint8_t *p = reinterpret_cast<const uint8_t *>(buf);
   const uint8_t *e = p + size;
   uint32_t l = crc ^ 0xffffffffu;
@@ -340,7 +363,7 @@ uint32_t Extend(uint32_t crc, const char* buf, size_t size) {
 
 
 
-// For crc32_combine
+// Operators applying zeros to a crc, as 32x32 matrices over GF(2)
 ulong gf2_matrix_times (ulong *mat, ulong vec)
 {
     ulong sum = 0;
@@ -360,74 +383,312 @@ void gf2_matrix_square (ulong *square, ulong *mat)
         square[n] = gf2_matrix_times(mat, mat[n]);
 }
 
-ulong Combine(ulong crc1, ulong crc2, ulong len2)
-{
-    // WARNING:
-    // This method is *very* slow. It was used to combine the crc32 of the
-    // header and the crc32 of the content of an entry, and after doing some
-    // profiling, it turned out that Combine() was accountable for 40% of all
-    // the CPU usage in KingDB during write-intensive workloads. The data format
-    // was then changed appropriately so that the use of Combine() would no
-    // longer be needed. If Combine() needs to be used again, its usage must
-    // *absolutely* be carefully profiled and monitored, as it can have a
-    // dramatic impact on performance.
-    //
-    // NOTE: The original zlib code had a polynomial 'odd[0]' equal to
-    // 0xedb88320L, which is the value for the CRC32 checksum.
-    // I changed it for 0x82f63b78, which is the reversed polynomial for
-    // the CRC32C (Castagnoli) checksum, which is the one used in the
-    // code that I copied from LevelDB. The polynomial was found in:
-    // http://en.wikipedia.org/wiki/Cyclic_redundancy_check
-  
-    int n;
-    ulong row;
-    ulong even[GF2_DIM];    /* even-power-of-two zeros operator */
-    ulong odd[GF2_DIM];     /* odd-power-of-two zeros operator */
-
-    /* degenerate case */
-    if (len2 == 0)
-        return crc1;
-
-    /* put operator for one zero bit in odd */
-    odd[0] = 0x82f63b78;           /* CRC-32 polynomial */
-    row = 1;
-    for (n = 1; n < GF2_DIM; n++) {
-        odd[n] = row;
-        row <<= 1;
+// Combine() used to apply the zeros operators above, which required about
+// a hundred 32x32 matrix squarings per call. It now follows the approach of
+// zlib 1.2.12: the crc of A is multiplied by x^(8*len2) modulo the
+// polynomial, and the powers x^(2^n) are precomputed, thus combining two crcs
+// takes at most a few dozen polynomial multiplications, whatever len2 is.
+//
+// NOTE: The original zlib code had a polynomial equal to 0xedb88320L, which
+// is the value for the CRC32 checksum. It is 0x82f63b78 here, which is the
+// reversed polynomial for the CRC32C (Castagnoli) checksum, which is the one
+// used in the code that was copied from LevelDB.
+static const uint32_t kPolynomial = 0x82f63b78;
+
+// Returns a(x) * b(x) modulo p(x), the polynomials being reflected
+static uint32_t MultiplyModP(uint32_t a, uint32_t b) {
+  uint32_t m = (uint32_t)1 << 31;
+  uint32_t p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) break;
     }
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ kPolynomial : b >> 1;
+  }
+  return p;
+}
 
-    /* put operator for two zero bits in even */
-    gf2_matrix_square(even, odd);
+// x2n_[n] is x^(2^n) modulo p(x)
+struct PowersOfX {
+  PowersOfX() {
+    uint32_t p = (uint32_t)1 << 30; // x^1
+    x2n_[0] = p;
+    for (int n = 1; n < 32; n++) {
+      x2n_[n] = p = MultiplyModP(p, p);
+    }
+  }
+  uint32_t x2n_[32];
+};
+
+// Returns x^(n * 2^k) modulo p(x)
+static uint32_t PowerOfXModP(uint64_t n, unsigned k) {
+  static const PowersOfX powers;
+  uint32_t p = (uint32_t)1 << 31; // x^0 == 1
+  while (n) {
+    if (n & 1) p = MultiplyModP(powers.x2n_[k & 31], p);
+    n >>= 1;
+    k++;
+  }
+  return p;
+}
+
+uint32_t Combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+  return MultiplyModP(PowerOfXModP(len2, 3), crc1) ^ crc2;
+}
+
+
+
+// Hardware crc32c
+//
+// The crc32 instruction has a latency of three cycles but a throughput of
+// one per cycle, thus the large buffers are cut into three blocks whose
+// crcs are computed in parallel, and then combined: the crc of the first
+// block is shifted by the length of the second block, i.e. extended with
+// as many zeros, and xor-ed with the crc of the second block, and so on.
+// The shifts are done with tables computed once, for the two block sizes.
+
+static const size_t kSizeLongBlock = 8192;
+static const size_t kSizeShortBlock = 256;
+static uint32_t shift_long_[4][256];
+static uint32_t shift_short_[4][256];
+
+// Builds in 'even' the operator that applies 'len' zero bytes to a crc,
+// 'len' being a power of two
+static void ZerosOperator(ulong *even, size_t len) {
+  int n;
+  ulong row;
+  ulong odd[GF2_DIM];
+
+  // put operator for one zero bit in odd
+  odd[0] = 0x82f63b78;
+  row = 1;
+  for (n = 1; n < GF2_DIM; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+
+  // put operator for two zero bits in even
+  gf2_matrix_square(even, odd);
+
+  // put operator for four zero bits in odd
+  gf2_matrix_square(odd, even);
 
-    /* put operator for four zero bits in odd */
+  // first square will put the operator for one zero byte (eight zero bits)
+  // in even, and the next ones double the number of zero bytes
+  do {
+    gf2_matrix_square(even, odd);
+    len >>= 1;
+    if (len == 0) return;
     gf2_matrix_square(odd, even);
+    len >>= 1;
+  } while (len);
+
+  for (n = 0; n < GF2_DIM; n++) {
+    even[n] = odd[n];
+  }
+}
+
+// Turns the operator that applies 'len' zero bytes into four tables, one for
+// each byte of the crc
+static void ZerosTables(uint32_t zeros[][256], size_t len) {
+  ulong op[GF2_DIM];
+  ZerosOperator(op, len);
+  for (uint32_t n = 0; n < 256; n++) {
+    zeros[0][n] = gf2_matrix_times(op, n);
+    zeros[1][n] = gf2_matrix_times(op, n << 8);
+    zeros[2][n] = gf2_matrix_times(op, n << 16);
+    zeros[3][n] = gf2_matrix_times(op, n << 24);
+  }
+}
 
-    /* apply len2 zeros to crc1 (first square will put the operator for one
-       zero byte, eight zero bits, in even) */
+static inline uint32_t Shift(uint32_t zeros[][256], uint32_t crc) {
+  return   zeros[0][crc & 0xff]
+         ^ zeros[1][(crc >> 8) & 0xff]
+         ^ zeros[2][(crc >> 16) & 0xff]
+         ^ zeros[3][crc >> 24];
+}
+
+static inline uint64_t LE_LOAD64(const uint8_t *p) {
+  return DecodeFixed64(reinterpret_cast<const char*>(p));
+}
+
+#ifdef KINGDB_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t ExtendSSE42(uint32_t crc, const char* buf, size_t size) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(buf);
+  const uint8_t *e = p + size;
+  uint64_t crc0 = crc ^ 0xffffffffu;
+
+  // Process bytes until p is 8-byte aligned
+  while (p != e && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    crc0 = _mm_crc32_u8(crc0, *p++);
+  }
+
+  // Process three long blocks at a time, and then three short blocks
+  while (static_cast<size_t>(e - p) >= 3 * kSizeLongBlock) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const uint8_t *end = p + kSizeLongBlock;
     do {
-        /* apply zeros operator for this bit of len2 */
-        gf2_matrix_square(even, odd);
-        if (len2 & 1)
-            crc1 = gf2_matrix_times(even, crc1);
-        len2 >>= 1;
-
-        /* if no more bits set, then done */
-        if (len2 == 0)
-            break;
-
-        /* another iteration of the loop with odd and even swapped */
-        gf2_matrix_square(odd, even);
-        if (len2 & 1)
-            crc1 = gf2_matrix_times(odd, crc1);
-        len2 >>= 1;
-
-        /* if no more bits set, then done */
-    } while (len2 != 0);
-
-    /* return combined crc */
-    crc1 ^= crc2;
-    return crc1;
+      crc0 = _mm_crc32_u64(crc0, LE_LOAD64(p));
+      crc1 = _mm_crc32_u64(crc1, LE_LOAD64(p + kSizeLongBlock));
+      crc2 = _mm_crc32_u64(crc2, LE_LOAD64(p + 2 * kSizeLongBlock));
+      p += 8;
+    } while (p < end);
+    crc0 = Shift(shift_long_, crc0) ^ crc1;
+    crc0 = Shift(shift_long_, crc0) ^ crc2;
+    p += 2 * kSizeLongBlock;
+  }
+  while (static_cast<size_t>(e - p) >= 3 * kSizeShortBlock) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const uint8_t *end = p + kSizeShortBlock;
+    do {
+      crc0 = _mm_crc32_u64(crc0, LE_LOAD64(p));
+      crc1 = _mm_crc32_u64(crc1, LE_LOAD64(p + kSizeShortBlock));
+      crc2 = _mm_crc32_u64(crc2, LE_LOAD64(p + 2 * kSizeShortBlock));
+      p += 8;
+    } while (p < end);
+    crc0 = Shift(shift_short_, crc0) ^ crc1;
+    crc0 = Shift(shift_short_, crc0) ^ crc2;
+    p += 2 * kSizeShortBlock;
+  }
+
+  // Process bytes 8 at a time, and then the last few bytes
+  while (e - p >= 8) {
+    crc0 = _mm_crc32_u64(crc0, LE_LOAD64(p));
+    p += 8;
+  }
+  while (p != e) {
+    crc0 = _mm_crc32_u8(crc0, *p++);
+  }
+  return static_cast<uint32_t>(crc0) ^ 0xffffffffu;
+}
+
+static bool HasSSE42() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+  return (ecx & bit_SSE4_2) != 0;
 }
+#endif // KINGDB_CRC32C_SSE42
+
+#ifdef KINGDB_CRC32C_ARMV8
+__attribute__((target("+crc")))
+static uint32_t ExtendARMv8(uint32_t crc, const char* buf, size_t size) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(buf);
+  const uint8_t *e = p + size;
+  uint32_t crc0 = crc ^ 0xffffffffu;
+
+  // Process bytes until p is 8-byte aligned
+  while (p != e && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    crc0 = __crc32cb(crc0, *p++);
+  }
+
+  // Process three long blocks at a time, and then three short blocks
+  while (static_cast<size_t>(e - p) >= 3 * kSizeLongBlock) {
+    uint32_t crc1 = 0;
+    uint32_t crc2 = 0;
+    const uint8_t *end = p + kSizeLongBlock;
+    do {
+      crc0 = __crc32cd(crc0, LE_LOAD64(p));
+      crc1 = __crc32cd(crc1, LE_LOAD64(p + kSizeLongBlock));
+      crc2 = __crc32cd(crc2, LE_LOAD64(p + 2 * kSizeLongBlock));
+      p += 8;
+    } while (p < end);
+    crc0 = Shift(shift_long_, crc0) ^ crc1;
+    crc0 = Shift(shift_long_, crc0) ^ crc2;
+    p += 2 * kSizeLongBlock;
+  }
+  while (static_cast<size_t>(e - p) >= 3 * kSizeShortBlock) {
+    uint32_t crc1 = 0;
+    uint32_t crc2 = 0;
+    const uint8_t *end = p + kSizeShortBlock;
+    do {
+      crc0 = __crc32cd(crc0, LE_LOAD64(p));
+      crc1 = __crc32cd(crc1, LE_LOAD64(p + kSizeShortBlock));
+      crc2 = __crc32cd(crc2, LE_LOAD64(p + 2 * kSizeShortBlock));
+      p += 8;
+    } while (p < end);
+    crc0 = Shift(shift_short_, crc0) ^ crc1;
+    crc0 = Shift(shift_short_, crc0) ^ crc2;
+    p += 2 * kSizeShortBlock;
+  }
+
+  // Process bytes 8 at a time, and then the last few bytes
+  while (e - p >= 8) {
+    crc0 = __crc32cd(crc0, LE_LOAD64(p));
+    p += 8;
+  }
+  while (p != e) {
+    crc0 = __crc32cb(crc0, *p++);
+  }
+  return crc0 ^ 0xffffffffu;
+}
+
+static bool HasARMv8CRC() {
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif // KINGDB_CRC32C_ARMV8
+
+typedef uint32_t (*ExtendFunction)(uint32_t crc, const char* buf, size_t size);
+
+// Picks the implementation of Extend() for the CPU the first time it is
+// called. Being a function-local static, it is safely initialized even if
+// Extend() is called concurrently or from static initializers.
+struct ExtendDispatcher {
+  ExtendDispatcher() {
+    extend = ExtendSoftware;
+#ifdef KINGDB_CRC32C_SSE42
+    if (HasSSE42()) {
+      ZerosTables(shift_long_, kSizeLongBlock);
+      ZerosTables(shift_short_, kSizeShortBlock);
+      extend = ExtendSSE42;
+    }
+#endif
+#ifdef KINGDB_CRC32C_ARMV8
+    if (HasARMv8CRC()) {
+      ZerosTables(shift_long_, kSizeLongBlock);
+      ZerosTables(shift_short_, kSizeShortBlock);
+      extend = ExtendARMv8;
+    }
+#endif
+  }
+  ExtendFunction extend;
+};
+
+static const ExtendDispatcher& GetExtendDispatcher() {
+  static const ExtendDispatcher dispatcher;
+  return dispatcher;
+}
+
+uint32_t Extend(uint32_t crc, const char* buf, size_t size) {
+  return GetExtendDispatcher().extend(crc, buf, size);
+}
+
+uint32_t ExtendParallel(uint32_t crc, const char* buf, size_t size, uint32_t num_threads) {
+  if (num_threads <= 1 || size < num_threads) return Extend(crc, buf, size);
+  size_t size_slice = size / num_threads;
+  std::vector<uint32_t> crcs(num_threads, 0);
+  std::vector<std::thread> threads;
+  for (uint32_t i = 1; i < num_threads; i++) {
+    const char* data = buf + i * size_slice;
+    size_t size_current = (i == num_threads - 1) ? size - i * size_slice : size_slice;
+    threads.push_back(std::thread([&crcs, i, data, size_current]() {
+      crcs[i] = Value(data, size_current);
+    }));
+  }
+  // The first slice is done by the calling thread
+  crc = Extend(crc, buf, size_slice);
+  for (auto& t: threads) t.join();
+  for (uint32_t i = 1; i < num_threads; i++) {
+    size_t size_current = (i == num_threads - 1) ? size - i * size_slice : size_slice;
+    crc = Combine(crc, crcs[i], size_current);
+  }
+  return crc;
+}
+
 
 
 
@@ -58,10 +58,20 @@ inline uint32_t Unmask(uint32_t masked_crc) {
 }
 
 
-// For crc32_combine
+// Return the crc32c of concat(A, B) where crc1 is the crc32c of A, and
+// crc2 is the crc32c of B, which is len2 bytes long. This allows the
+// crc32c of different parts of some data to be computed independently,
+// for example on different threads, and then merged.
+uint32_t Combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+// Same as Extend(), except that if 'num_threads' is greater than 1, the data
+// is cut into as many slices, whose crc32c are computed in parallel by
+// temporary threads and then combined.
+uint32_t ExtendParallel(uint32_t init_crc, const char* data, size_t n, uint32_t num_threads);
+
+// For the operators applying zeros to a crc
 typedef uint32_t ulong;
 typedef int64_t I64;
-ulong Combine(ulong crc1, ulong crc2, ulong len2);
 #define GF2_DIM 32
 
 // 8-bit CRC
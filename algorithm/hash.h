@@ -18,28 +18,41 @@
 
 namespace kdb {
 
+// Hash computes the hashed keys of the storage engine, which does it for
+// every Get(), Put() and index operation. The hashing function is selected
+// at construction, and HashFunction() dispatches on it with a switch that
+// gets inlined at the call sites, instead of going through a virtual call.
+// HashFunction() has no state and can be called by concurrent threads.
 class Hash {
  public:
-  Hash() {}
-  virtual ~Hash() {}
-  virtual uint64_t HashFunction(const char *data, uint32_t len) = 0;
-  virtual uint64_t MaxInputSize() = 0;
-};
-
-class MurmurHash3: public Hash {
- public:
-  MurmurHash3() {}
-  virtual ~MurmurHash3() {}
-  virtual uint64_t HashFunction(const char *data, uint32_t len);
-  virtual uint64_t MaxInputSize() { return std::numeric_limits<int32_t>::max(); }
-};
-
-class xxHash: public Hash {
- public:
-  xxHash() {}
-  virtual ~xxHash() {}
-  virtual uint64_t HashFunction(const char *data, uint32_t len);
-  virtual uint64_t MaxInputSize() { return std::numeric_limits<int32_t>::max(); }
+  Hash(HashType ht) : type_(ht) {}
+  ~Hash() {}
+
+  uint64_t HashFunction(const char *data, uint32_t len) {
+    // NOTE: You may need to change the seed, which by default is 0
+    switch (type_) {
+      case kxxHash3_64:
+        return XXH3_64bits(data, len);
+      case kxxHash_64:
+        return XXH64(data, len, 0);
+      case kMurmurHash3_64:
+      default:
+        return MurmurHash3_64(data, len);
+    }
+  }
+
+  uint64_t MaxInputSize() { return std::numeric_limits<int32_t>::max(); }
+  HashType type() { return type_; }
+
+ private:
+  static uint64_t MurmurHash3_64(const char *data, uint32_t len) {
+    // NOTE: Beware, the len in MurmurHash3_x64_128 is an 'int', not a 'uint32_t'
+    uint64_t hash[2];
+    MurmurHash3_x64_128(data, len, 0, hash);
+    return hash[0];
+  }
+
+  HashType type_;
 };
 
 Hash* MakeHash(HashType ht);
@@ -830,3 +830,246 @@ unsigned long long XXH64_digest (void* state_in)
     return h64;
 }
 
+
+
+
+//****************************
+// XXH3 (64-bits)
+//****************************
+// Scalar version of XXH3_64bits() from xxHash 0.8, with the default secret
+// and a seed of 0. The short inputs, which are the common case for keys,
+// only take a few multiplications.
+
+#define XXH3_SECRET_SIZE   192
+#define XXH3_MIDSIZE_MAX   240
+#define XXH3_STRIPE_LEN    64
+#define XXH3_ACC_NB        8
+#define XXH3_SECRET_CONSUME_RATE 8
+#define XXH3_SECRET_LASTACC_START 7
+#define XXH3_SECRET_MERGEACCS_START 11
+#define XXH3_MIDSIZE_STARTOFFSET 3
+#define XXH3_MIDSIZE_LASTOFFSET 17
+#define XXH3_SECRET_SIZE_MIN 136
+
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+static const BYTE XXH3_kSecret[XXH3_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+FORCE_INLINE U32 XXH3_read32(const BYTE* ptr)
+{
+    U32 v;
+    memcpy(&v, ptr, sizeof(v));
+    return XXH_CPU_LITTLE_ENDIAN ? v : XXH_swap32(v);
+}
+
+FORCE_INLINE U64 XXH3_read64(const BYTE* ptr)
+{
+    U64 v;
+    memcpy(&v, ptr, sizeof(v));
+    return XXH_CPU_LITTLE_ENDIAN ? v : XXH_swap64(v);
+}
+
+// Multiplies two 64-bit integers into a 128-bit product, and folds it by
+// xor-ing its lower and upper halves
+FORCE_INLINE U64 XXH3_mul128_fold64(U64 lhs, U64 rhs)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t const product = (__uint128_t)lhs * (__uint128_t)rhs;
+    return (U64)product ^ (U64)(product >> 64);
+#else
+    U64 const lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+    U64 const hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+    U64 const lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+    U64 const hi_hi = (lhs >> 32) * (rhs >> 32);
+    U64 const cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    U64 const upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    U64 const lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+FORCE_INLINE U64 XXH64_avalanche(U64 h64)
+{
+    h64 ^= h64 >> 33;
+    h64 *= PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= PRIME64_3;
+    h64 ^= h64 >> 32;
+    return h64;
+}
+
+FORCE_INLINE U64 XXH3_avalanche(U64 h64)
+{
+    h64 ^= h64 >> 37;
+    h64 *= PRIME_MX1;
+    h64 ^= h64 >> 32;
+    return h64;
+}
+
+FORCE_INLINE U64 XXH3_rrmxmx(U64 h64, U64 len)
+{
+    h64 ^= XXH_rotl64(h64, 49) ^ XXH_rotl64(h64, 24);
+    h64 *= PRIME_MX2;
+    h64 ^= (h64 >> 35) + len;
+    h64 *= PRIME_MX2;
+    return h64 ^ (h64 >> 28);
+}
+
+FORCE_INLINE U64 XXH3_len_0to16(const BYTE* input, size_t len, const BYTE* secret)
+{
+    if (len > 8)
+    {
+        U64 const bitflip1 = XXH3_read64(secret+24) ^ XXH3_read64(secret+32);
+        U64 const bitflip2 = XXH3_read64(secret+40) ^ XXH3_read64(secret+48);
+        U64 const input_lo = XXH3_read64(input) ^ bitflip1;
+        U64 const input_hi = XXH3_read64(input + len - 8) ^ bitflip2;
+        U64 const acc = len + XXH_swap64(input_lo) + input_hi + XXH3_mul128_fold64(input_lo, input_hi);
+        return XXH3_avalanche(acc);
+    }
+    if (len >= 4)
+    {
+        U32 const input1 = XXH3_read32(input);
+        U32 const input2 = XXH3_read32(input + len - 4);
+        U64 const bitflip = XXH3_read64(secret+8) ^ XXH3_read64(secret+16);
+        U64 const input64 = input2 + (((U64)input1) << 32);
+        return XXH3_rrmxmx(input64 ^ bitflip, len);
+    }
+    if (len)
+    {
+        BYTE const c1 = input[0];
+        BYTE const c2 = input[len >> 1];
+        BYTE const c3 = input[len - 1];
+        U32 const combined = ((U32)c1 << 16) | ((U32)c2 << 24) | ((U32)c3 << 0) | ((U32)len << 8);
+        U64 const bitflip = XXH3_read32(secret) ^ XXH3_read32(secret+4);
+        return XXH64_avalanche((U64)combined ^ bitflip);
+    }
+    return XXH64_avalanche(XXH3_read64(secret+56) ^ XXH3_read64(secret+64));
+}
+
+FORCE_INLINE U64 XXH3_mix16B(const BYTE* input, const BYTE* secret)
+{
+    return XXH3_mul128_fold64(XXH3_read64(input) ^ XXH3_read64(secret),
+                              XXH3_read64(input+8) ^ XXH3_read64(secret+8));
+}
+
+FORCE_INLINE U64 XXH3_len_17to128(const BYTE* input, size_t len, const BYTE* secret)
+{
+    U64 acc = len * PRIME64_1;
+    if (len > 32)
+    {
+        if (len > 64)
+        {
+            if (len > 96)
+            {
+                acc += XXH3_mix16B(input+48, secret+96);
+                acc += XXH3_mix16B(input+len-64, secret+112);
+            }
+            acc += XXH3_mix16B(input+32, secret+64);
+            acc += XXH3_mix16B(input+len-48, secret+80);
+        }
+        acc += XXH3_mix16B(input+16, secret+32);
+        acc += XXH3_mix16B(input+len-32, secret+48);
+    }
+    acc += XXH3_mix16B(input+0, secret+0);
+    acc += XXH3_mix16B(input+len-16, secret+16);
+    return XXH3_avalanche(acc);
+}
+
+static U64 XXH3_len_129to240(const BYTE* input, size_t len, const BYTE* secret)
+{
+    U64 acc = len * PRIME64_1;
+    U64 acc_end;
+    unsigned int const nb_rounds = (unsigned int)len / 16;
+    unsigned int i;
+    for (i = 0; i < 8; i++)
+        acc += XXH3_mix16B(input+(16*i), secret+(16*i));
+    acc_end = XXH3_mix16B(input + len - 16, secret + XXH3_SECRET_SIZE_MIN - XXH3_MIDSIZE_LASTOFFSET);
+    acc = XXH3_avalanche(acc);
+    for (i = 8; i < nb_rounds; i++)
+        acc_end += XXH3_mix16B(input+(16*i), secret+(16*(i-8)) + XXH3_MIDSIZE_STARTOFFSET);
+    return XXH3_avalanche(acc + acc_end);
+}
+
+FORCE_INLINE void XXH3_accumulate_512(U64* acc, const BYTE* input, const BYTE* secret)
+{
+    size_t i;
+    for (i = 0; i < XXH3_ACC_NB; i++)
+    {
+        U64 const data_val = XXH3_read64(input + 8*i);
+        U64 const data_key = data_val ^ XXH3_read64(secret + 8*i);
+        acc[i ^ 1] += data_val;
+        acc[i] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+    }
+}
+
+FORCE_INLINE void XXH3_scramble_acc(U64* acc, const BYTE* secret)
+{
+    size_t i;
+    for (i = 0; i < XXH3_ACC_NB; i++)
+    {
+        U64 acc64 = acc[i];
+        acc64 ^= acc64 >> 47;
+        acc64 ^= XXH3_read64(secret + 8*i);
+        acc64 *= PRIME32_1;
+        acc[i] = acc64;
+    }
+}
+
+static U64 XXH3_hash_long(const BYTE* input, size_t len, const BYTE* secret)
+{
+    U64 acc[XXH3_ACC_NB] = { PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+                             PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1 };
+    size_t const nb_stripes_per_block = (XXH3_SECRET_SIZE - XXH3_STRIPE_LEN) / XXH3_SECRET_CONSUME_RATE;
+    size_t const block_len = XXH3_STRIPE_LEN * nb_stripes_per_block;
+    size_t const nb_blocks = (len - 1) / block_len;
+    size_t nb_stripes;
+    size_t n, s;
+    U64 result64;
+
+    for (n = 0; n < nb_blocks; n++)
+    {
+        for (s = 0; s < nb_stripes_per_block; s++)
+            XXH3_accumulate_512(acc, input + n*block_len + s*XXH3_STRIPE_LEN, secret + s*XXH3_SECRET_CONSUME_RATE);
+        XXH3_scramble_acc(acc, secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN);
+    }
+
+    // Last partial block, and last stripe
+    nb_stripes = ((len - 1) - (block_len * nb_blocks)) / XXH3_STRIPE_LEN;
+    for (s = 0; s < nb_stripes; s++)
+        XXH3_accumulate_512(acc, input + nb_blocks*block_len + s*XXH3_STRIPE_LEN, secret + s*XXH3_SECRET_CONSUME_RATE);
+    XXH3_accumulate_512(acc, input + len - XXH3_STRIPE_LEN, secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN - XXH3_SECRET_LASTACC_START);
+
+    // Merge the accumulators
+    result64 = len * PRIME64_1;
+    for (n = 0; n < 4; n++)
+    {
+        const BYTE* secret_merge = secret + XXH3_SECRET_MERGEACCS_START + 16*n;
+        result64 += XXH3_mul128_fold64(acc[2*n] ^ XXH3_read64(secret_merge),
+                                       acc[2*n+1] ^ XXH3_read64(secret_merge + 8));
+    }
+    return XXH3_avalanche(result64);
+}
+
+
+unsigned long long XXH3_64bits(const void* input, size_t len)
+{
+    const BYTE* p = (const BYTE*)input;
+    if (len <= 16) return XXH3_len_0to16(p, len, XXH3_kSecret);
+    if (len <= 128) return XXH3_len_17to128(p, len, XXH3_kSecret);
+    if (len <= XXH3_MIDSIZE_MAX) return XXH3_len_129to240(p, len, XXH3_kSecret);
+    return XXH3_hash_long(p, len, XXH3_kSecret);
+}
@@ -59,6 +59,8 @@ It depends on successfully passing SMHasher test set.
 
 #pragma once
 
+#include <stddef.h>
+
 #if defined (__cplusplus)
 extern "C" {
 #endif
@@ -77,6 +79,7 @@ typedef enum { XXH_OK=0, XXH_ERROR } XXH_errorcode;
 
 unsigned int       XXH32 (const void* input, unsigned int len, unsigned int seed);
 unsigned long long XXH64 (const void* input, unsigned int len, unsigned long long seed);
+unsigned long long XXH3_64bits (const void* input, size_t len);
 
 /*
 XXH32() :
@@ -89,6 +92,9 @@ XXH32() :
     If your data is larger, use the advanced functions below.
 XXH64() :
     Calculate the 64-bits hash of sequence of length "len" stored at memory address "input".
+XXH3_64bits() :
+    Calculate the 64-bits XXH3 hash, with a seed of 0, of sequence of length "len" stored at memory address "input".
+    XXH3 is much faster than XXH64 on short inputs, and its results are the same as the ones of xxHash 0.8.
 */
 
 
@@ -0,0 +1,124 @@
+// Copyright (c) 2014, Emmanuel Goossaert. All rights reserved.
+// Use of this source code is governed by the BSD 3-Clause License,
+// that can be found in the LICENSE file.
+
+#ifndef KINGDB_READ_CACHE_H_
+#define KINGDB_READ_CACHE_H_
+
+#include "util/debug.h"
+#include <cinttypes>
+#include <mutex>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+
+#include "util/logger.h"
+#include "util/byte_array.h"
+
+namespace kdb {
+
+// ReadCache keeps the uncompressed values of the entries that were read
+// recently, so that the values of hot entries do not have to be uncompressed
+// again at every read.
+//
+// The values are indexed by location. When an entry is overwritten, deleted,
+// or moved by the compaction, the index points to a new location, thus the
+// value cached for the old location is never served again and is evicted
+// over time. Fileids are never reused, and neither are locations, therefore
+// the cache never needs to be invalidated explicitly.
+//
+// The cache is split into shards, each with its own mutex and LRU list, and
+// the memory budget is divided evenly between the shards.
+class ReadCache {
+ public:
+  ReadCache(uint64_t size)
+      : num_hits_(0),
+        num_misses_(0) {
+    size_shard_maximum_ = size / kNumShards;
+  }
+
+  // Returns true and sets 'value_out' if the uncompressed value for the
+  // entry at 'location' is in the cache. If 'need_verified_checksum' is true,
+  // values that were cached without having their checksum verified are
+  // ignored.
+  bool Get(uint64_t location, bool need_verified_checksum, ByteArray* value_out) {
+    Shard& shard = shards_[GetShardId(location)];
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    auto it = shard.locations.find(location);
+    if (   it == shard.locations.end()
+        || (need_verified_checksum && !it->second->has_verified_checksum)) {
+      num_misses_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    // Move the entry to the front of the LRU list
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    *value_out = it->second->value;
+    num_hits_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  void Put(uint64_t location, bool has_verified_checksum, ByteArray& value) {
+    uint64_t size_entry = GetSizeEntry(value);
+    if (size_entry > size_shard_maximum_) return;
+    Shard& shard = shards_[GetShardId(location)];
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    auto it = shard.locations.find(location);
+    if (it != shard.locations.end()) {
+      // Another reader cached the value in the meantime
+      it->second->has_verified_checksum |= has_verified_checksum;
+      return;
+    }
+    shard.entries.push_front(Entry{location, has_verified_checksum, value});
+    shard.locations[location] = shard.entries.begin();
+    shard.size += size_entry;
+    while (shard.size > size_shard_maximum_) {
+      Entry& entry = shard.entries.back();
+      shard.size -= GetSizeEntry(entry.value);
+      shard.locations.erase(entry.location);
+      shard.entries.pop_back();
+    }
+  }
+
+  uint64_t GetNumHits() { return num_hits_.load(std::memory_order_relaxed); }
+  uint64_t GetNumMisses() { return num_misses_.load(std::memory_order_relaxed); }
+
+ private:
+  static const uint32_t kNumShards = 16;
+  static const uint32_t kNumBitsShards = 4;
+
+  // Approximation of the memory used by the list and map nodes of an entry
+  static const uint64_t kSizeOverheadPerEntry = 128;
+
+  struct Entry {
+    uint64_t location;
+    bool has_verified_checksum;
+    ByteArray value;
+  };
+
+  struct Shard {
+    Shard() : size(0) {}
+    std::mutex mutex;
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> locations;
+    uint64_t size;
+  };
+
+  uint32_t GetShardId(uint64_t location) {
+    // The offsets of the locations are not uniformly distributed, thus the
+    // location is mixed before taking the highest bits
+    return (location * 0x9E3779B97F4A7C15ULL) >> (64 - kNumBitsShards);
+  }
+
+  static uint64_t GetSizeEntry(ByteArray& value) {
+    return value.size() + kSizeOverheadPerEntry;
+  }
+
+  Shard shards_[kNumShards];
+  uint64_t size_shard_maximum_;
+  std::atomic<uint64_t> num_hits_;
+  std::atomic<uint64_t> num_misses_;
+};
+
+} // namespace kdb
+
+#endif // KINGDB_READ_CACHE_H_
@@ -7,117 +7,142 @@
 namespace kdb {
 
 void WriteBuffer::Flush() {
-  std::unique_lock<std::mutex> lock_flush(mutex_flush_level2_);
   if (IsStopRequestedAndBufferEmpty()) return;
-  // NOTE: Doing the flushing and waiting twice, in case the two buffers,
-  // 'live' and 'copy', have items. This is a quick hack and a better
-  // solution should be investigated.
-  for (auto i = 0; i < 2; i++) {
-    log::debug("LOCK", "2 lock");
-    cv_flush_.notify_one();
-    cv_flush_done_.wait_for(lock_flush, std::chrono::milliseconds(db_options_.internal__close_timeout));
-  }
+  // Waits until the generation that is live now is persisted, or the one
+  // before it if the live generation is empty: all the orders written before
+  // the call are then persisted, whichever generations they were in.
+  std::unique_lock<std::mutex> lock_flush(mutex_flush_);
+  mutex_readers_.lock();
+  uint64_t ticket = tickets_[im_live_];
+  if (sizes_[im_live_] == 0) ticket -= 1;
+  mutex_readers_.unlock();
+  cv_flush_.notify_one();
+  lock_flush.unlock();
+  WaitUntilDurable(ticket);
   log::trace("WriteBuffer::Flush()", "end");
 }
 
-Status WriteBuffer::Get(ReadOptions& read_options, ByteArray& key, ByteArray* value_out) {
-  // NOTE: The lookups is done by iterating over vectors, which is fine
-  //       as long as the buffer doesn't become too big. This may need to be
-  //       changed for something faster at some point.
+void WriteBuffer::GetOrdersForSnapshot(std::vector<Order>* orders_out) {
+  // Holding the readers mutex prevents the generations from being sealed or
+  // cleared, and holding the mutexes of all the segments blocks the writers:
+  // the generations are thus copied in a consistent state. The orders in the
+  // sealed generations are older than the ones in the live generation.
+  std::unique_lock<std::mutex> lock_readers(mutex_readers_);
+  int im_live = im_live_;
+  for (int im = 0; im < kNumGenerations; im++) {
+    for (auto& segment: segments_[im]) segment.mutex.lock();
+  }
+  orders_out->clear();
+  for (int age = num_sealed_; age >= 0; age--) {
+    int im = (im_live + kNumGenerations - age) % kNumGenerations;
+    for (auto& segment: segments_[im]) {
+      orders_out->insert(orders_out->end(), segment.orders.begin(), segment.orders.end());
+    }
+  }
+  for (int im = kNumGenerations - 1; im >= 0; im--) {
+    for (auto it = segments_[im].rbegin(); it != segments_[im].rend(); ++it) {
+      it->mutex.unlock();
+    }
+  }
+}
+
 
-  // TODO: make sure the live buffer doesn't need to be protected by a mutex in
-  //       order to be accessed -- right now I'm relying on timing, but that may
-  //       be too weak to guarantee proper access
+Status WriteBuffer::Get(ReadOptions& read_options, ByteArray& key, uint64_t hashed_key, ByteArray* value_out) {
   // TODO: for items being stored that are not small enough, only parts will
   //       be found in the buffers -- should the kv-store return "not found"
   //       or should it try to send the data from the disk and the partially
   //       available parts in the buffer?
   if (IsStopRequested()) return Status::IOError("Cannot handle request: WriteBuffer is closing");
 
-  // read the "live" buffer
-  mutex_live_write_level1_.lock();
-  log::debug("LOCK", "1 lock");
-  mutex_indices_level3_.lock();
-  log::debug("LOCK", "3 lock");
-  auto& buffer_live = buffers_[im_live_];
-  int num_items = buffer_live.size();
-  mutex_indices_level3_.unlock();
-  log::debug("LOCK", "3 unlock");
-  mutex_live_write_level1_.unlock();
-  log::debug("LOCK", "1 unlock");
-  bool found = false;
+  // Registering as a reader prevents the sealed generations from being
+  // cleared until the lookup is done. The generations are searched from the
+  // most recent one to the oldest one.
+  mutex_readers_.lock();
+  int im_live = im_live_;
+  int num_sealed = num_sealed_;
+  num_readers_ += 1;
+  mutex_readers_.unlock();
+
   Order order_found;
-  for (int i = 0; i < num_items; i++) {
-    auto& order = buffer_live[i];
-    if (order.key == key) {
-      found = true;
-      order_found = order;
-    }
-  }
-  if (found) {
-    log::debug("WriteBuffer::Get()", "found in buffer_live");
-    if (   order_found.type == OrderType::Put
-        && order_found.IsSelfContained()) {
-      *value_out = order_found.chunk;
-      (*value_out).set_size(order_found.size_value);
-      (*value_out).set_size_compressed(order_found.size_value_compressed);
-      return Status::OK();
-    } else if (order_found.type == OrderType::Delete) {
-      return Status::DeleteOrder();
-    } else {
-      return Status::NotFound("Unable to find entry");
+  bool found = false;
+  for (int age = 0; age <= num_sealed; age++) {
+    int im = (im_live + kNumGenerations - age) % kNumGenerations;
+    Segment& segment = GetSegment(im, hashed_key);
+    segment.mutex.lock();
+    found = FindOrder(segment, key, hashed_key, &order_found);
+    segment.mutex.unlock();
+    if (found) {
+      log::debug("WriteBuffer::Get()", "found in generation of age %d", age);
+      break;
     }
   }
 
-  // prepare to read the "copy" buffer
-  log::debug("LOCK", "4 lock");
-  mutex_copy_write_level4_.lock();
-  log::debug("LOCK", "5 lock");
-  mutex_copy_read_level5_.lock();
-  num_readers_ += 1;
-  mutex_copy_read_level5_.unlock();
-  log::debug("LOCK", "5 unlock");
-  mutex_copy_write_level4_.unlock();
-  log::debug("LOCK", "4 unlock");
-
-  // read from "copy" buffer
-  found = false;
-  log::debug("LOCK", "3 lock");
-  mutex_indices_level3_.lock();
-  auto& buffer_copy = buffers_[im_copy_];
-  mutex_indices_level3_.unlock();
-  log::debug("LOCK", "3 unlock");
-  for (auto& order: buffer_copy) {
-    if (order.key == key) {
-      found = true;
-      order_found = order;
-    }
-  }
+  mutex_readers_.lock();
+  num_readers_ -= 1;
+  mutex_readers_.unlock();
+  cv_read_.notify_one();
 
-  Status s;
-  if (found) log::debug("WriteBuffer::Get()", "found in buffer_copy");
   if (   found
       && order_found.type == OrderType::Put
       && order_found.IsSelfContained()) {
     *value_out = order_found.chunk;
     (*value_out).set_size(order_found.size_value);
     (*value_out).set_size_compressed(order_found.size_value_compressed);
+    if (read_options.verify_checksums) {
+      // Like for the entries read by the storage engine, the checksum of the
+      // order covers both the key and the value
+      (*value_out).set_checksum(order_found.crc32);
+      (*value_out).set_checksum_initial(crc32c::Value(order_found.key.data(), order_found.key.size()));
+    }
+    return Status::OK();
   } else if (   found
              && order_found.type == OrderType::Delete) {
-    s = Status::DeleteOrder();
-  } else {
-    s = Status::NotFound("Unable to find entry");
+    return Status::DeleteOrder();
   }
+  return Status::NotFound("Unable to find entry");
+}
 
-  // exit the "copy" buffer
-  log::debug("LOCK", "5 lock");
-  mutex_copy_read_level5_.lock();
-  num_readers_ -= 1;
-  mutex_copy_read_level5_.unlock();
-  log::debug("LOCK", "5 unlock");
-  cv_read_.notify_one();
 
-  return s;
+void WriteBuffer::IndexLastOrder(Segment& segment, uint64_t hashed_key) {
+  // Must be called with the mutex of the segment held
+  uint32_t position = segment.orders.size() - 1;
+  ByteArray& key = segment.orders[position].key;
+  auto range = segment.index.equal_range(hashed_key);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (segment.orders[it->second].key == key) {
+      it->second = position;
+      return;
+    }
+  }
+  segment.index.insert(std::pair<uint64_t, uint32_t>(hashed_key, position));
+}
+
+
+void WriteBuffer::CopyToArena(Segment& segment, Order& order) {
+  // Must be called with the mutex of the segment held. The callers may pass
+  // keys and chunks that point to memory they only own for the duration of
+  // the call, as long as they are not larger than the maximum size of an
+  // arena allocation.
+  if (order.key.size() <= Arena::kSizeMaximumAllocation) {
+    order.key = segment.arena.Copy(order.key);
+  }
+  if (order.chunk.size() <= Arena::kSizeMaximumAllocation) {
+    order.chunk = segment.arena.Copy(order.chunk);
+  }
+}
+
+
+bool WriteBuffer::FindOrder(Segment& segment, ByteArray& key, uint64_t hashed_key, Order* order_out) {
+  // Must be called with the mutex of the segment held
+  auto range = segment.index.equal_range(hashed_key);
+  for (auto it = range.first; it != range.second; ++it) {
+    Order& order = segment.orders[it->second];
+    if (order.key == key) {
+      *order_out = order;
+      return true;
+    }
+  }
+  return false;
 }
 
 
@@ -129,6 +154,7 @@ Status WriteBuffer::Put(WriteOptions& write_options, ByteArray& key, ByteArray&
 
 Status WriteBuffer::PutPart(WriteOptions& write_options,
                              ByteArray& key,
+                             uint64_t hashed_key,
                              ByteArray& chunk,
                              uint64_t offset_chunk,
                              uint64_t size_value,
@@ -137,6 +163,7 @@ Status WriteBuffer::PutPart(WriteOptions& write_options,
   return WritePart(write_options,
                     OrderType::Put,
                     key,
+                    hashed_key,
                     chunk,
                     offset_chunk,
                     size_value,
@@ -146,15 +173,16 @@ Status WriteBuffer::PutPart(WriteOptions& write_options,
 }
 
 
-Status WriteBuffer::Delete(WriteOptions& write_options, ByteArray& key) {
+Status WriteBuffer::Delete(WriteOptions& write_options, ByteArray& key, uint64_t hashed_key) {
   auto empty = ByteArray::NewEmptyByteArray();
-  return WritePart(write_options, OrderType::Delete, key, empty, 0, 0, 0, 0);
+  return WritePart(write_options, OrderType::Delete, key, hashed_key, empty, 0, 0, 0, 0);
 }
 
 
 Status WriteBuffer::WritePart(const WriteOptions& write_options,
                                const OrderType& op,
                                ByteArray& key,
+                               uint64_t hashed_key,
                                ByteArray& chunk,
                                uint64_t offset_chunk,
                                uint64_t size_value,
@@ -163,8 +191,8 @@ Status WriteBuffer::WritePart(const WriteOptions& write_options,
   if (IsStopRequested()) return Status::IOError("Cannot handle request: WriteBuffer is closing");
 
   log::trace("WriteBuffer::WritePart()",
-             "key:[%s] | size chunk:%" PRIu64 ", total size value:%" PRIu64 " offset_chunk:%" PRIu64 " sizeOfBuffer:%d",
-             key.ToString().c_str(), chunk.size(), size_value, offset_chunk, buffers_[im_live_].size());
+             "key:[%s] | size chunk:%" PRIu64 ", total size value:%" PRIu64 " offset_chunk:%" PRIu64 " size_buffer_live:%" PRIu64,
+             key.ToString().c_str(), chunk.size(), size_value, offset_chunk, sizes_[im_live_].load());
 
   bool is_first_part = (offset_chunk == 0);
   bool is_large = key.size() + size_value > db_options_.storage__hstable_size;
@@ -175,146 +203,300 @@ Status WriteBuffer::WritePart(const WriteOptions& write_options,
 
   if (UseRateLimiter()) rate_limiter_.Tick(bytes_arriving);
 
-  // TODO: here the buffer index im_live_ is called outside of the level 2 and 3 mutexes is this really safe?
-  log::debug("LOCK", "1 lock");
-  std::unique_lock<std::mutex> lock_live(mutex_live_write_level1_);
-  mutex_indices_level3_.lock();
-  buffers_[im_live_].push_back(Order{std::this_thread::get_id(),
-                                     write_options,
-                                     op,
-                                     key,
-                                     chunk,
-                                     offset_chunk,
-                                     size_value,
-                                     size_value_compressed,
-                                     crc32,
-                                     is_large});
-  sizes_[im_live_] += bytes_arriving;
-  uint64_t size_buffer_live = sizes_[im_live_];
-  mutex_indices_level3_.unlock();
-
-  /*
-  if (buffers_[im_live_].size()) {
-    for(auto &p: buffers_[im_live_]) {   
-      log::trace("WriteBuffer::WritePart()",
-                "Write() ITEM key_ptr:[%p] key:[%s] | size chunk:%d, total size value:%d offset_chunk:%" PRIu64 " sizeOfBuffer:%d sizes_[im_live_]:%d",
-                p.key, p.key->ToString().c_str(), p.chunk->size(), p.size_value, p.offset_chunk, buffers_[im_live_].size(), sizes_[im_live_]);
+  // If the generation was sealed between the moment it was read and the
+  // moment its segment was locked, the order goes to the new live generation
+  uint64_t size_buffer_live;
+  uint64_t ticket;
+  while (true) {
+    int im_live = im_live_;
+    Segment& segment = GetSegment(im_live, hashed_key);
+    std::unique_lock<std::mutex> lock_segment(segment.mutex);
+    if (im_live != im_live_) continue;
+    segment.orders.push_back(Order{std::this_thread::get_id(),
+                                   write_options,
+                                   op,
+                                   key,
+                                   hashed_key,
+                                   chunk,
+                                   offset_chunk,
+                                   size_value,
+                                   size_value_compressed,
+                                   crc32,
+                                   is_large});
+    CopyToArena(segment, segment.orders.back());
+    IndexLastOrder(segment, hashed_key);
+    size_buffer_live = sizes_[im_live].fetch_add(bytes_arriving) + bytes_arriving;
+    ticket = tickets_[im_live];
+    if (write_options.sync) has_sync_writes_[im_live] = true;
+    break;
+  }
+
+  return FinishWrite(write_options, size_buffer_live, ticket);
+}
+
+
+Status WriteBuffer::Write(const WriteOptions& write_options, std::vector<Order>& orders) {
+  if (IsStopRequested()) return Status::IOError("Cannot handle request: WriteBuffer is closing");
+  log::trace("WriteBuffer::Write()", "batch of %zu orders", orders.size());
+
+  uint64_t bytes_arriving = 0;
+  for (auto& order: orders) {
+    bytes_arriving += order.key.size() + order.chunk.size();
+  }
+
+  if (UseRateLimiter()) rate_limiter_.Tick(bytes_arriving);
+
+  // Same as in WritePart(): if the generation was sealed before all its
+  // segments were locked, the batch goes to the new live generation
+  uint64_t size_buffer_live = 0;
+  uint64_t ticket = 0;
+  bool is_appended = false;
+  while (!is_appended) {
+    int im_live = im_live_;
+    auto& segments = segments_[im_live];
+    for (auto& segment: segments) segment.mutex.lock();
+    if (im_live == im_live_) {
+      is_appended = true;
+      Batch batch;
+      for (uint32_t i = 0; i < kNumSegments; i++) {
+        batch.begin[i] = segments[i].orders.size();
+      }
+      for (size_t i = 0; i < orders.size(); i++) {
+        Segment& segment = GetSegment(im_live, orders[i].hashed_key);
+        segment.orders.push_back(orders[i]);
+        CopyToArena(segment, segment.orders.back());
+        IndexLastOrder(segment, orders[i].hashed_key);
+      }
+      for (uint32_t i = 0; i < kNumSegments; i++) {
+        batch.end[i] = segments[i].orders.size();
+      }
+      batches_[im_live].push_back(batch);
+      size_buffer_live = sizes_[im_live].fetch_add(bytes_arriving) + bytes_arriving;
+      ticket = tickets_[im_live];
+      if (write_options.sync) has_sync_writes_[im_live] = true;
+    }
+    for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+      it->mutex.unlock();
     }
-  } else {
-    log::trace("WriteBuffer::WritePart()", "Write() ITEM no buffers_[im_live_]");
   }
-  */
 
-  if (size_buffer_live > buffer_size_) {
+  return FinishWrite(write_options, size_buffer_live, ticket);
+}
+
+
+Status WriteBuffer::FinishWrite(const WriteOptions& write_options,
+                                uint64_t size_buffer_live,
+                                uint64_t ticket) {
+  if (size_buffer_live > buffer_size_ || write_options.sync) {
+    // The flush mutex is held by the flush thread while it seals the live
+    // generation, which waits for a generation to be recycled when all of
+    // them are full, thus this blocks the writers until the oldest flush is
+    // done. The writes with the sync option also wake up the flush thread,
+    // so that they do not wait for the flush timeout.
     log::trace("WriteBuffer::WritePart()", "trying to swap");
-    mutex_flush_level2_.lock();
-    log::debug("LOCK", "2 lock");
-    log::debug("LOCK", "3 lock");
-    std::unique_lock<std::mutex> lock_swap(mutex_indices_level3_);
+    std::unique_lock<std::mutex> lock_flush(mutex_flush_);
     cv_flush_.notify_one();
-    log::debug("LOCK", "3 unlock");
-    mutex_flush_level2_.unlock();
-    log::debug("LOCK", "2 unlock");
-
   } else {
     log::trace("WriteBuffer::WritePart()", "will not swap");
   }
 
-  log::debug("LOCK", "1 unlock");
+  if (write_options.sync) return WaitUntilDurable(ticket);
   return Status::OK();
 }
 
 
-void WriteBuffer::ProcessingLoop() {
-  while(true) {
-    bool force_sync = false;
-    log::trace("WriteBuffer", "ProcessingLoop() - start");
-    log::debug("LOCK", "2 lock");
-    std::unique_lock<std::mutex> lock_flush(mutex_flush_level2_);
-    while (sizes_[im_live_] == 0) {
-      log::trace("WriteBuffer", "ProcessingLoop() - wait - %" PRIu64 " %" PRIu64, buffers_[im_copy_].size(), buffers_[im_live_].size());
-      std::cv_status status = cv_flush_.wait_for(lock_flush, std::chrono::milliseconds(db_options_.write_buffer__flush_timeout));
-      if (IsStopRequestedAndBufferEmpty()) return;
-      if (status == std::cv_status::no_timeout) {
-        force_sync = true; 
-      }
+Status WriteBuffer::WaitUntilDurable(uint64_t ticket) {
+  std::unique_lock<std::mutex> lock_durable(mutex_durable_);
+  while (ticket_durable_ < ticket) {
+    if (is_recycling_stopped_) {
+      return Status::IOError("WriteBuffer was closed before the order could be synced");
     }
+    log::trace("WriteBuffer::WaitUntilDurable()", "wait for ticket %" PRIu64, ticket);
+    cv_durable_.wait(lock_durable);
+  }
+  return Status::OK();
+}
 
-    mutex_indices_level3_.lock();
-    if (sizes_[im_copy_] == 0) {
-      std::swap(im_live_, im_copy_);
-    }
-    mutex_indices_level3_.unlock();
 
-    log::trace("WriteBuffer", "ProcessingLoop() - start swap - %" PRIu64 " %" PRIu64, buffers_[im_copy_].size(), buffers_[im_live_].size());
- 
-    // Notify the storage engine that the buffer can be flushed
-    log::trace("BM", "WAIT: Get()-flush_buffer");
+int WriteBuffer::SealLiveGeneration() {
+  // Must be called with the flush mutex held. The next generation of the
+  // ring is empty unless all the other generations are sealed, in which case
+  // this waits for the oldest one to be recycled.
+  std::unique_lock<std::mutex> lock_readers(mutex_readers_);
+  while (num_sealed_ == kNumGenerations - 1) {
+    log::debug("WriteBuffer::SealLiveGeneration()", "wait for a generation to be recycled");
+    cv_recycled_.wait(lock_readers);
+  }
+  int im_sealed = im_live_;
+  int im_next = (im_sealed + 1) % kNumGenerations;
+  tickets_[im_next] = tickets_[im_sealed] + 1;
+  has_sync_writes_[im_next] = false;
+  if (num_sealed_ == 0 && UseRateLimiter()) rate_limiter_.WriteStart();
+  num_sealed_ += 1;
+  im_live_ = im_next;
+  lock_readers.unlock();
+
+  // Waits for the writers that locked a segment of the sealed generation
+  // before it was sealed
+  for (auto& segment: segments_[im_sealed]) {
+    segment.mutex.lock();
+    segment.mutex.unlock();
+  }
+  return im_sealed;
+}
+
 
-    if (UseRateLimiter()) rate_limiter_.WriteStart(); 
-    if (force_sync && buffers_[im_copy_].size()) {
-      buffers_[im_copy_][0].write_options.sync = true;
+void WriteBuffer::CopyOrdersToFlush(int im_sealed, std::vector<Order>& orders_flush) {
+  // The segments of the sealed generation are no longer modified, thus
+  // they can be read without locking them.
+  // A batch is appended while all the segments are locked, thus in every
+  // segment, the orders before the batch were written before it, and the
+  // orders after the batch were written after it. The orders before the
+  // batch in all the segments can therefore be flushed first, then the
+  // orders of the batch, and then the rest, without changing the order in
+  // which the orders of any key were written.
+  auto& segments = segments_[im_sealed];
+  std::array<uint32_t, kNumSegments> positions;
+  positions.fill(0);
+  orders_flush.clear();
+  size_t num_orders = 0;
+  for (auto& segment: segments) num_orders += segment.orders.size();
+  orders_flush.reserve(num_orders);
+  for (auto& batch: batches_[im_sealed]) {
+    uint32_t num_batch_orders_left = 0;
+    for (uint32_t i = 0; i < kNumSegments; i++) {
+      auto& orders = segments[i].orders;
+      orders_flush.insert(orders_flush.end(), orders.begin() + positions[i], orders.begin() + batch.begin[i]);
+      num_batch_orders_left += batch.end[i] - batch.begin[i];
     }
-    event_manager_->flush_buffer.StartAndBlockUntilDone(buffers_[im_copy_]);
-
-    // Wait for the index to notify the buffer manager
-    log::trace("BM", "WAIT: Get()-clear_buffer");
-    event_manager_->clear_buffer.Wait();
-    event_manager_->clear_buffer.Done();
-    
-    // Wait for readers
-    // TODO: the cleaning of the flush buffer shouldn't be done in one go but
-    // in multiple iterations just like the transfer of indexes is being done,
-    // so that the readers are never blocked for too long.
-    log::debug("LOCK", "4 lock");
-    mutex_copy_write_level4_.lock();
-    while(true) {
-      log::debug("LOCK", "5 lock");
-      std::unique_lock<std::mutex> lock_read(mutex_copy_read_level5_);
-      if (num_readers_ == 0) break;
-      log::debug("WriteBuffer", "ProcessingLoop() - wait for lock_read");
-      cv_read_.wait(lock_read);
+    for (uint32_t i = 0; i < kNumSegments; i++) {
+      auto& orders = segments[i].orders;
+      for (uint32_t j = batch.begin[i]; j < batch.end[i]; j++) {
+        orders_flush.push_back(orders[j]);
+        orders_flush.back().num_batch_orders_left = num_batch_orders_left--;
+      }
     }
-    log::debug("LOCK", "5 unlock");
+    positions = batch.end;
+  }
+  for (uint32_t i = 0; i < kNumSegments; i++) {
+    auto& orders = segments[i].orders;
+    orders_flush.insert(orders_flush.end(), orders.begin() + positions[i], orders.end());
+  }
+}
 
-    if (UseRateLimiter()) rate_limiter_.WriteEnd(sizes_[im_copy_]); 
-    log::trace("WriteBuffer", "ProcessingLoop() bytes_in_buffer: %" PRIu64 " rate_writing: %" PRIu64, sizes_[im_copy_], rate_limiter_.GetWritingRate());
 
-    // Clear flush buffer
-    log::debug("WriteBuffer::ProcessingLoop()", "clear flush buffer");
+void WriteBuffer::ClearOldestGeneration() {
+  // Note: the small keys and chunks are in the arenas, which are released
+  // at once, but the calls to clear() still have to destroy every order,
+  // which may block the readers for a while: this may benefit from
+  // throttling (using db_options_.internal__num_iterations_per_lock)
+  std::unique_lock<std::mutex> lock_readers(mutex_readers_);
+  while (num_readers_ > 0) {
+    log::debug("WriteBuffer", "ClearOldestGeneration() - wait for readers");
+    cv_read_.wait(lock_readers);
+  }
+  int im_oldest = (im_live_ + kNumGenerations - num_sealed_) % kNumGenerations;
+  for (auto& segment: segments_[im_oldest]) {
+    std::unique_lock<std::mutex> lock_segment(segment.mutex);
+    segment.orders.clear();
+    segment.index.clear();
+    segment.arena.Clear();
+  }
+  batches_[im_oldest].clear();
+  uint64_t size_oldest = sizes_[im_oldest];
+  uint64_t ticket = tickets_[im_oldest];
+  sizes_[im_oldest] = 0;
+  num_sealed_ -= 1;
+
+  // The writing rate is measured over the time during which at least one
+  // sealed generation is in the pipeline
+  if (UseRateLimiter()) {
+    rate_limiter_.WriteEnd(size_oldest);
+    if (num_sealed_ > 0) rate_limiter_.WriteStart();
+  }
+  log::trace("WriteBuffer", "ClearOldestGeneration() bytes_in_buffer: %" PRIu64 " rate_writing: %" PRIu64, size_oldest, rate_limiter_.GetWritingRate());
+  lock_readers.unlock();
+  cv_recycled_.notify_one();
+
+  // The orders of the generation are now persisted and indexed
+  mutex_durable_.lock();
+  ticket_durable_ = ticket;
+  mutex_durable_.unlock();
+  cv_durable_.notify_all();
+}
 
-    /*
-    if (buffers_[im_copy_].size()) {
-      for(auto &p: buffers_[im_copy_]) {
-        log::trace("WriteBuffer", "ProcessingLoop() ITEM im_copy - key:[%s] | size chunk:%d, total size value:%d offset_chunk:%" PRIu64 " sizeOfBuffer:%d sizes_[im_copy_]:%d", p.key.ToString().c_str(), p.chunk.size(), p.size_value, p.offset_chunk, buffers_[im_copy_].size(), sizes_[im_copy_]);
-      }
-    } else {
-      log::trace("WriteBuffer", "ProcessingLoop() ITEM no buffers_[im_copy_]");
-    }
 
-    if (buffers_[im_live_].size()) {
-      for(auto &p: buffers_[im_live_]) {
-        log::trace("WriteBuffer", "ProcessingLoop() ITEM im_live - key:[%s] | size chunk:%d, total size value:%d offset_chunk:%" PRIu64 " sizeOfBuffer:%d sizes_[im_live_]:%d", p.key.ToString().c_str(), p.chunk.size(), p.size_value, p.offset_chunk, buffers_[im_live_].size(), sizes_[im_live_]);
+void WriteBuffer::RecyclingLoop() {
+  // The generations are handed over to the storage engine in the order in
+  // which they were sealed, and go through the pipeline in that order, thus
+  // each notification is for the oldest sealed generation
+  int temp;
+  while (event_manager_->clear_buffer.Pop(&temp)) {
+    log::debug("WriteBuffer::RecyclingLoop()", "clear flush buffer");
+    ClearOldestGeneration();
+  }
+  // Wakes up the writes with the sync option whose orders will never be
+  // flushed
+  std::unique_lock<std::mutex> lock_durable(mutex_durable_);
+  is_recycling_stopped_ = true;
+  cv_durable_.notify_all();
+}
+
+
+void WriteBuffer::WaitForMoreSyncWrites(std::unique_lock<std::mutex>& lock_flush) {
+  // Gives more writes with the sync option the chance to join the live
+  // generation, so that they share the sync of the next flush. Every
+  // incoming sync write wakes up the flush thread, thus the deadline is
+  // checked again each time. There is nothing to wait for if no write with
+  // the sync option is waiting on the live generation: the delay would
+  // only add latency to the asynchronous writes.
+  if (   db_options_.sync__max_delay_us == 0
+      || !has_sync_writes_[im_live_]) {
+    return;
+  }
+  auto deadline = std::chrono::steady_clock::now()
+                  + std::chrono::microseconds(db_options_.sync__max_delay_us);
+  while (   sizes_[im_live_] <= buffer_size_
+         && !IsStopRequested()) {
+    if (cv_flush_.wait_until(lock_flush, deadline) == std::cv_status::timeout) break;
+  }
+}
+
+
+void WriteBuffer::ProcessingLoop() {
+  std::vector<Order> orders_flush;
+  while(true) {
+    bool force_sync = false;
+    log::trace("WriteBuffer", "ProcessingLoop() - start");
+    std::unique_lock<std::mutex> lock_flush(mutex_flush_);
+    while (sizes_[im_live_] == 0) {
+      log::trace("WriteBuffer", "ProcessingLoop() - wait");
+      std::cv_status status = cv_flush_.wait_for(lock_flush, std::chrono::milliseconds(db_options_.write_buffer__flush_timeout));
+      if (IsStopRequested() && sizes_[im_live_] == 0) return;
+      if (status == std::cv_status::no_timeout) {
+        force_sync = true; 
       }
-    } else {
-      log::trace("WriteBuffer", "ProcessingLoop() ITEM no buffers_[im_live_]");
     }
-    */
 
-    // Note: the call to clear() can delete a lot of allocated memory at once,
-    // which may block all other operations for a while: this may benefit
-    // from throttling (using db_options_.internal__num_iterations_per_lock)
-    sizes_[im_copy_] = 0;
-    buffers_[im_copy_].clear();
-
-    log::trace("WriteBuffer", "ProcessingLoop() - end swap - %" PRIu64 " %" PRIu64, buffers_[im_copy_].size(), buffers_[im_live_].size());
+    WaitForMoreSyncWrites(lock_flush);
+    int im_sealed = SealLiveGeneration();
+    CopyOrdersToFlush(im_sealed, orders_flush);
+    log::trace("WriteBuffer", "ProcessingLoop() - sealed generation with %zu orders", orders_flush.size());
+ 
+    // Hands the orders over to the storage engine. The flush thread does not
+    // wait for them to be persisted: the next generation can be sealed as
+    // soon as it is full, and the sealed generation is cleared by the
+    // recycler thread once its orders are indexed.
+    if (force_sync && orders_flush.size()) {
+      orders_flush[0].write_options.sync = true;
+    }
+    event_manager_->flush_buffer.Push(std::move(orders_flush));
+    orders_flush.clear();
 
-    mutex_copy_write_level4_.unlock();
-    log::debug("LOCK", "4 unlock");
-    log::debug("LOCK", "2 unlock");
-    cv_flush_done_.notify_all();
+    log::trace("WriteBuffer", "ProcessingLoop() - end swap");
+    lock_flush.unlock();
 
-    if (IsStopRequestedAndBufferEmpty()) return;
+    if (IsStopRequested() && sizes_[im_live_] == 0) return;
   }
 }
 
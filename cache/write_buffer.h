@@ -8,21 +8,55 @@
 #include "util/debug.h"
 #include <cinttypes>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <map>
 #include <array>
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include <chrono>
 #include <ctime>
 
 #include "util/options.h"
 #include "util/byte_array.h"
+#include "util/arena.h"
 #include "util/order.h"
 #include "cache/rate_limiter.h"
+#include "algorithm/crc32c.h"
 #include "thread/event_manager.h"
 
 namespace kdb {
 
+// The orders are appended to segments, and each key always goes to the same
+// segment, chosen from the hash of the key, so that the orders for a key
+// stay in the order in which they were written. Each segment has its own
+// mutex, thus writers only contend when they write to the same segment.
+//
+// The generations of segments form a ring. Writers append to the "live"
+// generation. When the flush thread needs to flush the buffer, it seals the
+// live generation by making the next generation of the ring live, and by
+// then acquiring and releasing the mutex of each segment of the sealed
+// generation, to wait for the writers that were appending to it. A writer
+// that finds that the generation it locked was sealed in the meantime tries
+// again with the new live generation. The sealed generation is handed over
+// to the storage engine, and the flush thread can seal the next one without
+// waiting for it to be persisted: up to kNumGenerations - 1 sealed
+// generations can be in the pipeline of the event manager at once. The
+// recycler thread clears the sealed generations, oldest first, once their
+// orders are persisted and indexed.
+//
+// Each generation carries a ticket, which is the sequence number of the flush
+// that will persist it. The writes with the sync option wait until the flush
+// of their ticket is done: all the sync writes that arrived in the live
+// generation while the previous ones were being flushed are persisted by
+// the same flush, and thus share a single sync to secondary storage.
+//
+// The orders of a batch are appended while holding the mutexes of all the
+// segments of the live generation, and the positions of the batch in each
+// segment are recorded, so that the flush thread can write the orders of
+// the batch contiguously.
 class WriteBuffer {
  public:
   WriteBuffer(const DatabaseOptions& db_options,
@@ -32,12 +66,19 @@ class WriteBuffer {
         rate_limiter_(db_options.rate_limit_incoming) {
     stop_requested_ = false;
     im_live_ = 0;
-    im_copy_ = 1;
-    sizes_[im_live_] = 0;
-    sizes_[im_copy_] = 0;
+    num_sealed_ = 0;
+    for (int im = 0; im < kNumGenerations; im++) {
+      sizes_[im] = 0;
+      tickets_[im] = 0;
+      has_sync_writes_[im] = false;
+    }
+    tickets_[im_live_] = 1;
     num_readers_ = 0;
-    buffer_size_ = db_options_.write_buffer__size / 2;
+    ticket_durable_ = 0;
+    is_recycling_stopped_ = false;
+    buffer_size_ = db_options_.write_buffer__size / kNumGenerations;
     thread_buffer_handler_ = std::thread(&WriteBuffer::ProcessingLoop, this);
+    thread_recycler_ = std::thread(&WriteBuffer::RecyclingLoop, this);
     is_closed_ = false;
 
     log::debug("WriteBuffer::ctor()", "WriteBuffer::ctor() %" PRIu64 " - %s\n", db_options_.rate_limit_incoming, db_options_.write_buffer__mode_str.c_str());
@@ -49,18 +90,27 @@ class WriteBuffer {
 
   }
   ~WriteBuffer() { Close(); }
-  Status Get(ReadOptions& read_options, ByteArray& key, ByteArray* value_out);
+  Status Get(ReadOptions& read_options, ByteArray& key, uint64_t hashed_key, ByteArray* value_out);
   Status Put(WriteOptions& write_options, ByteArray& key, ByteArray& chunk);
   Status PutPart(WriteOptions& write_options,
                   ByteArray& key,
+                  uint64_t hashed_key,
                   ByteArray& chunk,
                   uint64_t offset_chunk,
                   uint64_t size_value,
                   uint64_t size_value_compressed,
                   uint32_t crc32);
-  Status Delete(WriteOptions& write_options, ByteArray& key);
+  Status Delete(WriteOptions& write_options, ByteArray& key, uint64_t hashed_key);
+
+  // Appends all the orders of a batch to the same generation, so that they
+  // are flushed together
+  Status Write(const WriteOptions& write_options, std::vector<Order>& orders);
   void Flush();
 
+  // Copies all the orders currently in the buffers, from the oldest to the
+  // most recent one for each key, without waiting for them to be flushed.
+  void GetOrdersForSnapshot(std::vector<Order>* orders_out);
+
   void Close () {
     std::unique_lock<std::mutex> lock(mutex_close_);
     if (is_closed_) return;
@@ -69,6 +119,8 @@ class WriteBuffer {
     Flush();
     cv_flush_.notify_one();
     thread_buffer_handler_.join();
+    event_manager_->clear_buffer.Close();
+    thread_recycler_.join();
   }
 
   bool UseRateLimiter() {
@@ -80,48 +132,106 @@ class WriteBuffer {
   }
 
   bool IsStopRequestedAndBufferEmpty() {
-    return (   IsStopRequested()
-            && buffers_[im_live_].empty()
-            && buffers_[im_copy_].empty());
+    if (!IsStopRequested()) return false;
+    for (auto& size: sizes_) {
+      if (size > 0) return false;
+    }
+    return true;
   }
   bool IsStopRequested() { return stop_requested_; }
   void Stop() { stop_requested_ = true; }
-  bool stop_requested_;
+  std::atomic<bool> stop_requested_;
 
  private:
   Status WritePart(const WriteOptions& write_options,
                     const OrderType& op,
                     ByteArray& key,
+                    uint64_t hashed_key,
                     ByteArray& chunk,
                     uint64_t offset_chunk,
                     uint64_t size_value,
                     uint64_t size_value_compressed,
                     uint32_t crc32);
+  Status FinishWrite(const WriteOptions& write_options,
+                     uint64_t size_buffer_live,
+                     uint64_t ticket);
+  Status WaitUntilDurable(uint64_t ticket);
   void ProcessingLoop();
+  void RecyclingLoop();
+  void WaitForMoreSyncWrites(std::unique_lock<std::mutex>& lock_flush);
+  int SealLiveGeneration();
+  void CopyOrdersToFlush(int im_sealed, std::vector<Order>& orders_flush);
+  void ClearOldestGeneration();
+
+  // Each segment has an index mapping the hashed keys to the position of the
+  // most recent order for each key, so that Get() does not have to scan the
+  // orders. The index of a segment is only modified under the mutex of the
+  // segment. The small keys and chunks of the orders are copied into the
+  // arena of the segment, which is released at once when the generation is
+  // cleared.
+  struct Segment {
+    std::mutex mutex;
+    std::vector<Order> orders;
+    std::unordered_multimap<uint64_t, uint32_t> index;
+    Arena arena;
+  };
+  static const uint32_t kNumSegments = 32;
+  static const int kNumGenerations = EventManager::kNumFlushesInFlight + 1;
+
+  // Positions of the orders of a batch in each segment of a generation,
+  // from 'begin' included to 'end' excluded
+  struct Batch {
+    std::array<uint32_t, kNumSegments> begin;
+    std::array<uint32_t, kNumSegments> end;
+  };
+
+  Segment& GetSegment(int im, uint64_t hashed_key) {
+    return segments_[im][hashed_key % kNumSegments];
+  }
+  void IndexLastOrder(Segment& segment, uint64_t hashed_key);
+  void CopyToArena(Segment& segment, Order& order);
+  bool FindOrder(Segment& segment, ByteArray& key, uint64_t hashed_key, Order* order_out);
 
   DatabaseOptions db_options_;
-  int im_live_;
-  int im_copy_;
+  // The sealed generations are the 'num_sealed_' generations that precede
+  // the live one in the ring, the oldest being the furthest from it.
+  std::atomic<int> im_live_;
+  int num_sealed_;
   uint64_t buffer_size_;
   int num_readers_;
-  std::array<std::vector<Order>, 2> buffers_;
-  std::array<int, 2> sizes_;
+  std::array<std::array<Segment, kNumSegments>, kNumGenerations> segments_;
+  std::array<std::vector<Batch>, kNumGenerations> batches_;
+  std::array<std::atomic<uint64_t>, kNumGenerations> sizes_;
+  std::array<uint64_t, kNumGenerations> tickets_;
+  // Whether a write with the sync option is waiting on each generation
+  std::array<std::atomic<bool>, kNumGenerations> has_sync_writes_;
   bool is_closed_;
   std::mutex mutex_close_;
 
   std::thread thread_buffer_handler_;
+  std::thread thread_recycler_;
   EventManager *event_manager_;
   RateLimiter rate_limiter_;
 
-  // Using a lock hierarchy to avoid deadlocks
-  std::mutex mutex_live_write_level1_;
-  std::mutex mutex_flush_level2_;
-  std::mutex mutex_indices_level3_;
-  std::mutex mutex_copy_write_level4_;
-  std::mutex mutex_copy_read_level5_;
+  // The flush mutex is held by the flush thread while it seals the live
+  // generation and hands it over to the storage engine, and the readers
+  // mutex protects the generation indices, the number of sealed generations
+  // and the number of readers. When several mutexes are needed, they are
+  // acquired in this order: flush, readers, segments (by increasing
+  // generation and segment id).
+  std::mutex mutex_flush_;
+  std::mutex mutex_readers_;
   std::condition_variable cv_flush_;
-  std::condition_variable cv_flush_done_;
   std::condition_variable cv_read_;
+  std::condition_variable cv_recycled_;
+
+  // The durable mutex protects the ticket of the last generation that was
+  // persisted and cleared, on which the writes with the sync option and
+  // Flush() are waiting.
+  std::mutex mutex_durable_;
+  std::condition_variable cv_durable_;
+  uint64_t ticket_durable_;
+  bool is_recycling_stopped_;
 };
 
 } // namespace kdb
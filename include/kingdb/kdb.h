@@ -13,5 +13,6 @@
 #include "interface/snapshot.h"
 #include "interface/iterator.h"
 #include "interface/multipart.h"
+#include "interface/write_batch.h"
 
 #endif // KINGDB_HEADERS_H_
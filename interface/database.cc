@@ -9,18 +9,24 @@ namespace kdb {
 Status Database::GetRaw(ReadOptions& read_options,
                         ByteArray& key,
                         ByteArray* value_out,
-                        bool want_raw_data) {
+                        bool want_raw_data,
+                        uint64_t* location_out) {
   if (is_closed_) return Status::IOError("The database is not open");
   log::trace("Database GetRaw()", "[%s]", key.ToString().c_str());
-  Status s = wb_->Get(read_options, key, value_out);
+  uint64_t location = 0;
+  uint64_t hashed_key = se_->HashKey(key);
+  Status s = wb_->Get(read_options, key, hashed_key, value_out);
   if (s.IsDeleteOrder()) {
     return Status::NotFound("Unable to find entry");
   } else if (s.IsNotFound()) {
     log::trace("Database GetRaw()", "not found in buffer");
-    s = se_->Get(read_options, key, value_out);
+    s = se_->Get(read_options, key, hashed_key, value_out, &location);
     if (s.IsNotFound()) {
       log::trace("Database GetRaw()", "not found in storage engine");
       return s;
+    } else if (s.IsDeleteOrder()) {
+      log::trace("Database GetRaw()", "deleted in storage engine");
+      return Status::NotFound("Unable to find entry");
     } else if (s.IsOK()) {
       log::trace("Database GetRaw()", "found in storage engine");
     } else {
@@ -57,28 +63,163 @@ Status Database::GetRaw(ReadOptions& read_options,
     *value_out = NewShallowCopyByteArray(buffer, value_out->size());
   }
   */
-  if (want_raw_data == false && value_out->is_compressed()) {
-    if (value_out->size() > db_options_.internal__size_multipart_required) {
-      return Status::MultipartRequired();
-    }
-    ByteArray value_out_uncompressed;
-    compressor_.ResetThreadLocalStorage();
-    s = compressor_.UncompressByteArray(*value_out,
-                                        read_options.verify_checksums,
-                                        &value_out_uncompressed);
-    //if (!s.IsOK()) {
-    //  fprintf(stderr, "Error in Get(): %s\n", s.ToString().c_str());
-    //}
-    *value_out = value_out_uncompressed;
+  if (location_out != nullptr) *location_out = location;
+  if (want_raw_data == false) {
+    s = UncompressValue(read_options, location, value_out);
+  }
+  return s;
+}
+
+
+Status Database::UncompressValue(ReadOptions& read_options,
+                                 uint64_t location,
+                                 ByteArray* value_out) {
+  if (!value_out->is_compressed()) return Status::OK();
+  if (value_out->size() > db_options_.internal__size_multipart_required) {
+    return Status::MultipartRequired();
+  }
+  // Only the entries read from the storage engine have a location, the
+  // entries found in the write buffer are not cached.
+  bool use_read_cache = (read_cache_ != nullptr && location != 0);
+  if (   use_read_cache
+      && read_cache_->Get(location, read_options.verify_checksums, value_out)) {
+    return Status::OK();
+  }
+  ByteArray value_out_uncompressed;
+  compressor_.ResetThreadLocalStorage();
+  Status s = compressor_.UncompressByteArray(*value_out,
+                                             read_options.verify_checksums,
+                                             &value_out_uncompressed);
+  //if (!s.IsOK()) {
+  //  fprintf(stderr, "Error in Get(): %s\n", s.ToString().c_str());
+  //}
+  *value_out = value_out_uncompressed;
+  if (use_read_cache && s.IsOK()) {
+    read_cache_->Put(location, read_options.verify_checksums, *value_out);
   }
   return s;
 }
 
+
+void Database::MultiGet(ReadOptions& read_options,
+                        std::vector<ByteArray>& keys,
+                        std::vector<ByteArray>* values_out,
+                        std::vector<Status>* statuses_out) {
+  values_out->assign(keys.size(), ByteArray());
+  if (is_closed_) {
+    statuses_out->assign(keys.size(), Status::IOError("The database is not open"));
+    return;
+  }
+  statuses_out->assign(keys.size(), Status::OK());
+
+  // The write buffer is checked first for every key, and only the keys that
+  // were not found in it are looked up in the storage engine as one batch.
+  std::vector<ByteArray> keys_storage;
+  std::vector<uint64_t> hashed_keys_storage;
+  std::vector<uint32_t> indexes_storage;
+  for (size_t i = 0; i < keys.size(); i++) {
+    uint64_t hashed_key = se_->HashKey(keys[i]);
+    Status s = wb_->Get(read_options, keys[i], hashed_key, &(*values_out)[i]);
+    if (s.IsNotFound()) {
+      keys_storage.push_back(keys[i]);
+      hashed_keys_storage.push_back(hashed_key);
+      indexes_storage.push_back(i);
+    } else if (s.IsDeleteOrder()) {
+      (*statuses_out)[i] = Status::NotFound("Unable to find entry");
+    } else {
+      (*statuses_out)[i] = UncompressValue(read_options, 0, &(*values_out)[i]);
+    }
+  }
+  if (keys_storage.empty()) return;
+
+  std::vector<ByteArray> values_storage;
+  std::vector<Status> statuses_storage;
+  std::vector<uint64_t> locations_storage;
+  se_->MultiGet(read_options, keys_storage, hashed_keys_storage, &values_storage, &statuses_storage, &locations_storage);
+  for (size_t j = 0; j < keys_storage.size(); j++) {
+    uint32_t i = indexes_storage[j];
+    Status s = statuses_storage[j];
+    if (s.IsDeleteOrder()) {
+      s = Status::NotFound("Unable to find entry");
+    } else if (s.IsOK()) {
+      (*values_out)[i] = values_storage[j];
+      s = UncompressValue(read_options, locations_storage[j], &(*values_out)[i]);
+    }
+    (*statuses_out)[i] = s;
+  }
+}
+
 Status Database::Get(ReadOptions& read_options, ByteArray& key, ByteArray* value_out) {
   return GetRaw(read_options, key, value_out, false);
 }
 
 
+Status Database::Get(ReadOptions& read_options, ByteArray& key, std::string* value_out) {
+  ByteArray value;
+  uint64_t location;
+  Status s = GetRaw(read_options, key, &value, true, &location);
+  if (!s.IsOK()) return s;
+  if (!value.is_compressed()) {
+    value_out->assign(value.data(), value.size());
+    return s;
+  }
+  // The size is checked before the string is resized, so that no memory is
+  // allocated for a value that has to be read with a MultipartReader
+  if (value.size() > db_options_.internal__size_multipart_required) {
+    return Status::MultipartRequired();
+  }
+  // resize() only allocates memory if the capacity of the string is too small
+  value_out->resize(value.size());
+  s = UncompressValueToBuffer(read_options, location, value, &(*value_out)[0]);
+  if (!s.IsOK()) value_out->clear();
+  return s;
+}
+
+
+Status Database::Get(ReadOptions& read_options,
+                     ByteArray& key,
+                     char* buffer,
+                     uint64_t size_buffer,
+                     uint64_t* size_value_out) {
+  ByteArray value;
+  uint64_t location;
+  Status s = GetRaw(read_options, key, &value, true, &location);
+  if (!s.IsOK()) return s;
+  *size_value_out = value.size();
+  if (value.size() > size_buffer) {
+    return Status::InvalidArgument("The buffer is too small for the value", "required size is " + std::to_string(value.size()) + " bytes");
+  }
+  if (!value.is_compressed()) {
+    memcpy(buffer, value.data(), value.size());
+    return s;
+  }
+  return UncompressValueToBuffer(read_options, location, value, buffer);
+}
+
+
+Status Database::UncompressValueToBuffer(ReadOptions& read_options,
+                                         uint64_t location,
+                                         ByteArray& value,
+                                         char* buffer) {
+  if (value.size() > db_options_.internal__size_multipart_required) {
+    return Status::MultipartRequired();
+  }
+  // The read cache is used if it already has the value, but values are not
+  // added to it here, as it would require allocating memory for them
+  ByteArray value_cached;
+  if (   read_cache_ != nullptr
+      && location != 0
+      && read_cache_->Get(location, read_options.verify_checksums, &value_cached)) {
+    memcpy(buffer, value_cached.data(), value_cached.size());
+    return Status::OK();
+  }
+  compressor_.ResetThreadLocalStorage();
+  return compressor_.UncompressByteArrayToBuffer(value,
+                                                 read_options.verify_checksums,
+                                                 buffer);
+}
+
+
 Status Database::Put(WriteOptions& write_options, ByteArray& key, ByteArray& chunk) {
   return PutPart(write_options, key, chunk, 0, chunk.size());
 }
@@ -95,8 +236,10 @@ Status Database::PutPart(WriteOptions& write_options,
     return Status::IOError("Attempted write beyond the total value size, aborting write.");
   }
 
+  // The parts into which the chunk is split all share the hashed key
+  uint64_t hashed_key = se_->HashKey(key);
   if (size_value <= db_options_.storage__maximum_part_size) {
-    return PutPartValidSize(write_options, key, chunk, offset_chunk, size_value);
+    return PutPartValidSize(write_options, key, hashed_key, chunk, offset_chunk, size_value);
   }
 
   // 'chunk' may be deleted by the call to PutPartValidSize()
@@ -117,7 +260,7 @@ Status Database::PutPart(WriteOptions& write_options,
       key_new = key;
     }
 
-    s = PutPartValidSize(write_options, key_new, chunk_new, offset_chunk + offset, size_value);
+    s = PutPartValidSize(write_options, key_new, hashed_key, chunk_new, offset_chunk + offset, size_value);
     if (!s.IsOK()) break;
   }
 
@@ -127,6 +270,7 @@ Status Database::PutPart(WriteOptions& write_options,
 
 Status Database::PutPartValidSize(WriteOptions& write_options,
                                  ByteArray& key,
+                                 uint64_t hashed_key,
                                  ByteArray& chunk,
                                  uint64_t offset_chunk,
                                  uint64_t size_value) {
@@ -134,7 +278,41 @@ Status Database::PutPartValidSize(WriteOptions& write_options,
   Status s;
   s = se_->FileSystemStatus();
   if (!s.IsOK()) return s;
-  log::trace("Database::PutPartValidSize()",
+
+  char buffer[Arena::kSizeMaximumAllocation];
+  ByteArray chunk_final;
+  uint64_t offset_chunk_compressed;
+  uint64_t size_value_compressed;
+  uint32_t crc32;
+  s = PreparePart(key, chunk, offset_chunk, size_value, buffer,
+                  &chunk_final, &offset_chunk_compressed, &size_value_compressed, &crc32);
+  if (!s.IsOK()) return s;
+
+  // (size_value_compressed != 0 && chunk->size() + offset_chunk == size_value_compressed));
+  return wb_->PutPart(write_options,
+                       key,
+                       hashed_key,
+                       chunk_final,
+                       offset_chunk_compressed,
+                       size_value,
+                       size_value_compressed,
+                       crc32);
+}
+
+
+Status Database::PreparePart(ByteArray& key,
+                             ByteArray& chunk,
+                             uint64_t offset_chunk,
+                             uint64_t size_value,
+                             char* buffer,
+                             ByteArray* chunk_out,
+                             uint64_t* offset_chunk_out,
+                             uint64_t* size_value_compressed_out,
+                             uint32_t* crc32_out) {
+  // Compresses the part and computes its checksum, updating the compression
+  // state of the current thread for the entry
+  Status s;
+  log::trace("Database::PreparePart()",
             "[%s] size_chunk:%" PRIu64 " offset_chunk:%" PRIu64,
             key.ToString().c_str(),
             chunk.size(),
@@ -147,7 +325,7 @@ Status Database::PutPartValidSize(WriteOptions& write_options,
 
   bool is_first_part = (offset_chunk == 0);
   bool is_last_part = (chunk.size() + offset_chunk == size_value);
-  log::trace("Database::PutPartValidSize()",
+  log::trace("Database::PreparePart()",
             "CompressionType:%d",
             db_options_.compression.type);
 
@@ -182,14 +360,17 @@ Status Database::PutPartValidSize(WriteOptions& write_options,
     offset_chunk_compressed = compressor_.size_compressed();
     uint64_t size_compressed;
     char *compressed;
+    uint64_t size_buffer = (buffer != nullptr) ? Arena::kSizeMaximumAllocation : 0;
     s = compressor_.Compress(chunk.data(),
                              chunk.size(),
                              &compressed,
-                             &size_compressed);
+                             &size_compressed,
+                             buffer,
+                             size_buffer);
     if (!s.IsOK()) return s;
     //std::chrono::high_resolution_clock::time_point step02 = std::chrono::high_resolution_clock::now();
 
-    log::trace("Database::PutPartValidSize()",
+    log::trace("Database::PreparePart()",
               "[%s] size_compressed:%" PRIu64,
               key.ToString().c_str(), compressor_.size_compressed());
 
@@ -198,8 +379,12 @@ Status Database::PutPartValidSize(WriteOptions& write_options,
     uint64_t space_left = size_value + EntryHeader::CalculatePaddingSize(size_value) - offset_chunk_compressed;
     if (  size_remaining - chunk.size() + compressor_.size_frame_header()
         > space_left - size_compressed) {
-      delete[] compressed;
-      compressed = new char[compressor_.size_uncompressed_frame(chunk.size())];
+      if (compressed != buffer) delete[] compressed;
+      if (compressor_.size_uncompressed_frame(chunk.size()) <= size_buffer) {
+        compressed = buffer;
+      } else {
+        compressed = new char[compressor_.size_uncompressed_frame(chunk.size())];
+      }
       compressor_.DisableCompressionInFrameHeader(compressed);
       memcpy(compressed + compressor_.size_frame_header(), chunk.data(), chunk.size());
       compressor_.AdjustCompressedSize(- size_compressed);
@@ -209,10 +394,15 @@ Status Database::PutPartValidSize(WriteOptions& write_options,
     }
     //std::chrono::high_resolution_clock::time_point step03 = std::chrono::high_resolution_clock::now();
 
-    ByteArray chunk_compressed = NewShallowCopyByteArray(compressed, size_compressed);
+    ByteArray chunk_compressed;
+    if (compressed == buffer) {
+      chunk_compressed = NewPointerByteArray(compressed, size_compressed);
+    } else {
+      chunk_compressed = NewShallowCopyByteArray(compressed, size_compressed);
+    }
     //std::chrono::high_resolution_clock::time_point step04 = std::chrono::high_resolution_clock::now();
 
-    log::trace("Database::PutPartValidSize()",
+    log::trace("Database::PreparePart()",
               "[%s] (%" PRIu64 ") compressed size %" PRIu64 " - offset_chunk_compressed %" PRIu64,
               key.ToString().c_str(),
               chunk.size(),
@@ -227,7 +417,7 @@ Status Database::PutPartValidSize(WriteOptions& write_options,
     uint64_t duration02 = std::chrono::duration_cast<std::chrono::microseconds>(step03 - step02).count();
     uint64_t duration03 = std::chrono::duration_cast<std::chrono::microseconds>(step04 - step03).count();
     uint64_t duration04 = std::chrono::duration_cast<std::chrono::microseconds>(step05 - step04).count();
-    log::info("Database::PutPartValidSize()",
+    log::info("Database::PreparePart()",
               "Durations: [%" PRIu64 "] [%" PRIu64 "] [%" PRIu64 "] [%" PRIu64 "] [%" PRIu64 "]",
               duration00, duration01, duration02, duration03, duration04
              );
@@ -256,23 +446,20 @@ Status Database::PutPartValidSize(WriteOptions& write_options,
   crc32_.stream(chunk_final.data(), chunk_final.size());
   if (is_last_part) crc32 = crc32_.get();
 
-  log::trace("Database PutPartValidSize()", "[%s] size_value_compressed:%" PRIu64 " crc32:0x%" PRIx64 " END", key.ToString().c_str(), size_value_compressed, crc32);
+  log::trace("Database PreparePart()", "[%s] size_value_compressed:%" PRIu64 " crc32:0x%" PRIx64 " END", key.ToString().c_str(), size_value_compressed, crc32);
 
   uint64_t size_padding = do_compression ? EntryHeader::CalculatePaddingSize(size_value) : 0;
   if (  offset_chunk_compressed + chunk_final.size()
       > size_value + size_padding) {
-    log::emerg("Database::PutPartValidSize()", "Error: write was attempted outside of the allocated memory.");
+    log::emerg("Database::PreparePart()", "Error: write was attempted outside of the allocated memory.");
     return Status::IOError("Prevented write to occur outside of the allocated memory.");
   }
 
-  // (size_value_compressed != 0 && chunk->size() + offset_chunk == size_value_compressed));
-  return wb_->PutPart(write_options,
-                       key,
-                       chunk_final,
-                       offset_chunk_compressed,
-                       size_value,
-                       size_value_compressed,
-                       crc32);
+  *chunk_out = chunk_final;
+  *offset_chunk_out = offset_chunk_compressed;
+  *size_value_compressed_out = size_value_compressed;
+  *crc32_out = crc32;
+  return Status::OK();
 }
 
 
@@ -282,7 +469,80 @@ Status Database::Delete(WriteOptions& write_options,
   log::trace("Database::Delete()", "[%s]", key.ToString().c_str());
   Status s = se_->FileSystemStatus();
   if (!s.IsOK()) return s;
-  return wb_->Delete(write_options, key);
+  return wb_->Delete(write_options, key, se_->HashKey(key));
+}
+
+
+Status Database::Write(WriteOptions& write_options, WriteBatch& batch) {
+  if (is_closed_) return Status::IOError("The database is not open");
+  if (batch.num_entries() == 0) return Status::OK();
+  Status s = se_->FileSystemStatus();
+  if (!s.IsOK()) return s;
+
+  // The encoded batch is copied once, and the keys and values of the orders
+  // all point into that copy
+  ByteArray arena = NewDeepCopyByteArray(batch.rep_.data(), batch.rep_.size());
+  std::vector<Order> orders;
+  orders.reserve(batch.num_entries());
+  uint64_t size_batch = 0;
+  uint64_t offset = 0;
+  while (offset < arena.size()) {
+    OrderType type;
+    uint64_t offset_key, size_key, size_value;
+    offset = WriteBatch::DecodeEntry(arena.data(), arena.size(), offset, &type, &offset_key, &size_key, &size_value);
+    if (offset == 0) return Status::IOError("Invalid WriteBatch encoding");
+
+    ByteArray key = arena;
+    key.set_offset(offset_key);
+    key.set_size(size_key);
+
+    // Each entry of the batch has to be self-contained, and all of the
+    // entries are written to the same HSTable
+    if (size_value > db_options_.storage__maximum_part_size) {
+      return Status::InvalidArgument("A value of the batch is larger than the maximum part size", key.ToString());
+    }
+    size_batch +=   EntryHeader::GetSizeMaximum() + size_key + size_value
+                  + EntryHeader::CalculatePaddingSize(size_value);
+    if (size_batch > db_options_.storage__hstable_size) {
+      return Status::InvalidArgument("The batch is too large", "the batch must fit in an HSTable");
+    }
+
+    if (type == OrderType::Delete) {
+      orders.push_back(Order{std::this_thread::get_id(),
+                             write_options,
+                             OrderType::Delete,
+                             key,
+                             se_->HashKey(key),
+                             ByteArray::NewEmptyByteArray(),
+                             0, 0, 0, 0,
+                             false});
+      continue;
+    }
+
+    ByteArray value = arena;
+    value.set_offset(offset_key + size_key);
+    value.set_size(size_value);
+    ByteArray chunk_final;
+    uint64_t offset_chunk_compressed;
+    uint64_t size_value_compressed;
+    uint32_t crc32;
+    s = PreparePart(key, value, 0, size_value, nullptr,
+                    &chunk_final, &offset_chunk_compressed, &size_value_compressed, &crc32);
+    if (!s.IsOK()) return s;
+    orders.push_back(Order{std::this_thread::get_id(),
+                           write_options,
+                           OrderType::Put,
+                           key,
+                           se_->HashKey(key),
+                           chunk_final,
+                           offset_chunk_compressed,
+                           size_value,
+                           size_value_compressed,
+                           crc32,
+                           false});
+  }
+
+  return wb_->Write(write_options, orders);
 }
 
 
@@ -298,24 +558,64 @@ void Database::Compact() {
 }
 
 
+void Database::LockIndexAndCopyOrdersForSnapshot(std::vector<Order>* orders_out) {
+  // The orders still in the write buffer are copied and the index is shared
+  // while the index updates are blocked: the orders indexed before are either
+  // in the index only, if their generation was recycled, or in both, and the
+  // snapshot gives priority to the copied orders. The orders written after
+  // the copy cannot reach the shared index, thus the snapshot is a consistent
+  // cut of the database.
+  se_->LockIndexUpdates();
+  wb_->GetOrdersForSnapshot(orders_out);
+
+  // Like in the write buffer, the parts of a multipart entry cannot be read
+  // from the copied orders, and the entry only becomes visible once it is
+  // indexed. If the last part of an entry was copied, the write buffer is
+  // flushed so that all the entries completed before the snapshot are in
+  // the index, and the orders are copied again. The multipart entries that
+  // are still being written do not need the flush.
+  bool has_last_part = false;
+  for (auto& order: *orders_out) {
+    if (   order.type == OrderType::Put
+        && order.IsMiddleOrLastPart()
+        && order.IsLastPart()) {
+      has_last_part = true;
+      break;
+    }
+  }
+  if (!has_last_part) return;
+  log::trace("Database::LockIndexAndCopyOrdersForSnapshot()", "flush for multipart entries");
+  se_->UnlockIndexUpdates();
+  wb_->Flush();
+  se_->LockIndexUpdates();
+  wb_->GetOrdersForSnapshot(orders_out);
+}
+
+
 Snapshot Database::NewSnapshot() {
   if (is_closed_) return Snapshot();
   log::trace("Database::NewSnapshot()", "start");
 
-  wb_->Flush();
-  uint32_t fileid_end = se_->FlushCurrentFileForSnapshot();
+  std::vector<Order> orders_buffered;
+  LockIndexAndCopyOrdersForSnapshot(&orders_buffered);
 
   std::set<uint32_t>* fileids_ignore;
   uint32_t snapshot_id;
   Status s = se_->GetNewSnapshotData(&snapshot_id, &fileids_ignore);
-  if (!s.IsOK()) return Snapshot();
+  if (!s.IsOK()) {
+    se_->UnlockIndexUpdates();
+    return Snapshot();
+  }
 
   StorageEngine *se_readonly = new StorageEngine(db_options_,
                                                  nullptr,
                                                  dbname_,
                                                  true,
                                                  fileids_ignore,
-                                                 fileid_end);
+                                                 0,
+                                                 se_);
+  se_->UnlockIndexUpdates();
+  se_readonly->SetBufferedOrdersForSnapshot(orders_buffered);
   std::vector<uint32_t> *fileids_iterator = se_readonly->GetFileidsIterator();
   Snapshot snapshot(db_options_,
                     dbname_,
@@ -331,20 +631,26 @@ KingDB* Database::NewSnapshotPointer() {
   if (is_closed_) return nullptr;
   log::trace("Database::NewSnapshotPointer()", "start");
 
-  wb_->Flush();
-  uint32_t fileid_end = se_->FlushCurrentFileForSnapshot();
+  std::vector<Order> orders_buffered;
+  LockIndexAndCopyOrdersForSnapshot(&orders_buffered);
 
   std::set<uint32_t>* fileids_ignore;
   uint32_t snapshot_id;
   Status s = se_->GetNewSnapshotData(&snapshot_id, &fileids_ignore);
-  if (!s.IsOK()) return nullptr;
+  if (!s.IsOK()) {
+    se_->UnlockIndexUpdates();
+    return nullptr;
+  }
 
   StorageEngine *se_readonly = new StorageEngine(db_options_,
                                                  nullptr,
                                                  dbname_,
                                                  true,
                                                  fileids_ignore,
-                                                 fileid_end);
+                                                 0,
+                                                 se_);
+  se_->UnlockIndexUpdates();
+  se_readonly->SetBufferedOrdersForSnapshot(orders_buffered);
   std::vector<uint32_t> *fileids_iterator = se_readonly->GetFileidsIterator();
   Snapshot *snapshot = new Snapshot(db_options_,
                                     dbname_,
@@ -18,11 +18,13 @@
 
 #include "interface/kingdb.h"
 #include "cache/write_buffer.h"
+#include "cache/read_cache.h"
 #include "storage/storage_engine.h"
 #include "storage/format.h"
 #include "util/status.h"
 #include "util/order.h"
 #include "util/byte_array.h"
+#include "util/arena.h"
 #include "util/options.h"
 #include "util/file.h"
 #include "interface/iterator.h"
@@ -41,6 +43,7 @@ class Database: public KingDB {
   Database(const DatabaseOptions& db_options, const std::string& dbname)
       : db_options_(db_options),
         dbname_(FixDatabaseName(dbname)),
+        read_cache_(nullptr),
         is_closed_(true)
   {
     // Word-swapped endianness is not supported
@@ -49,6 +52,7 @@ class Database: public KingDB {
 
   Database(const std::string& dbname)
       : dbname_(FixDatabaseName(dbname)),
+        read_cache_(nullptr),
         is_closed_(true)
   {
     // Word-swapped endianness is not supported
@@ -74,6 +78,8 @@ class Database: public KingDB {
     FileUtil::increase_limit_open_files();
 
     Status s;
+    // Only the options persisted in the db_options file are loaded from the
+    // database, all the other ones are the ones given by the caller
     struct stat info;
     bool db_exists = (stat(dbname_.c_str(), &info) == 0);
 
@@ -86,12 +92,25 @@ class Database: public KingDB {
       return Status::IOError("Could not create database directory", strerror(errno));
     }
 
+    // The storage paths are checked before anything is created
+    std::vector<std::string> dirpaths;
+    s = HSTableManager::ParseDirpaths(dbname_, db_options_.storage__paths, &dirpaths);
+    if (!s.IsOK()) return s;
+
     if (   !db_exists
         && db_options_.create_if_missing
         && mkdir(dbname_.c_str(), 0755) < 0) {
       return Status::IOError("Could not create database directory", strerror(errno));
     }
 
+    for (auto& dirpath: dirpaths) {
+      if (dirpath == dbname_) continue;
+      if (   stat(dirpath.c_str(), &info) != 0
+          && mkdir(dirpath.c_str(), 0755) < 0) {
+        return Status::IOError("Could not create HSTable directory", strerror(errno));
+      }
+    }
+
     std::string filepath_dboptions = DatabaseOptions::GetPath(dbname_);
     bool db_options_exists = (stat(filepath_dboptions.c_str(), &info) == 0);
     Status status_dboptions;
@@ -112,7 +131,7 @@ class Database: public KingDB {
       Mmap mmap(filepath_dboptions, info.st_size);
       if (!mmap.is_valid()) return Status::IOError("Mmap() constructor failed");
       status_dboptions = DatabaseOptionEncoder::DecodeFrom(mmap.datafile(), mmap.filesize(), &db_options_candidate);
-      if (status_dboptions.IsOK()) db_options_ = db_options_candidate;
+      if (status_dboptions.IsOK()) DatabaseOptionEncoder::CopyPersistedOptions(db_options_candidate, &db_options_);
     }
     
     if (db_exists && (!db_options_exists || !status_dboptions.IsOK())) {
@@ -121,10 +140,10 @@ class Database: public KingDB {
       // thus it needs to be recovered.
       DatabaseOptions db_options_candidate;
       std::string prefix_compaction = StorageEngine::GetCompactionFilePrefix();
-      Status s = HSTableManager::LoadDatabaseOptionsFromHSTables(dbname_,
+      Status s = HSTableManager::LoadDatabaseOptionsFromHSTables(dirpaths,
                                                                   &db_options_candidate,
                                                                   prefix_compaction);
-      if (s.IsOK()) db_options_ = db_options_candidate;
+      if (s.IsOK()) DatabaseOptionEncoder::CopyPersistedOptions(db_options_candidate, &db_options_);
     }
 
     if (!db_exists || !db_options_exists || !status_dboptions.IsOK()) {
@@ -168,6 +187,7 @@ class Database: public KingDB {
     em_ = new EventManager();
     wb_ = new WriteBuffer(db_options_, em_);
     se_ = new StorageEngine(db_options_, em_, dbname_);
+    if (db_options_.read_cache__size > 0) read_cache_ = new ReadCache(db_options_.read_cache__size);
     is_closed_ = false;
     return Status::OK(); 
   }
@@ -183,6 +203,31 @@ class Database: public KingDB {
     delete wb_;
     delete se_;
     delete em_;
+    if (read_cache_ != nullptr) {
+      log::info("Database::Close()", "Read cache - hits:%" PRIu64 " misses:%" PRIu64, read_cache_->GetNumHits(), read_cache_->GetNumMisses());
+      delete read_cache_;
+      read_cache_ = nullptr;
+    }
+  }
+
+  // Statistics of the read cache, which are both zero if it is disabled
+  uint64_t GetReadCacheNumHits() {
+    return (read_cache_ != nullptr) ? read_cache_->GetNumHits() : 0;
+  }
+
+  uint64_t GetReadCacheNumMisses() {
+    return (read_cache_ != nullptr) ? read_cache_->GetNumMisses() : 0;
+  }
+
+  // Statistics of the last opening of the database: number of HSTables whose
+  // locations were taken from the index checkpoint, and number of HSTables
+  // that had to be read
+  uint64_t GetNumFilesLoadedFromCheckpoint() {
+    return is_closed_ ? 0 : se_->GetNumFilesLoadedFromCheckpoint();
+  }
+
+  uint64_t GetNumFilesLoadedFromScan() {
+    return is_closed_ ? 0 : se_->GetNumFilesLoadedFromScan();
   }
 
   // TODO: make sure that if an entry cannot be returned because memory cannot
@@ -191,9 +236,8 @@ class Database: public KingDB {
 
   virtual Status Get(ReadOptions& read_options, ByteArray& key, ByteArray* value_out) override;
 
-  virtual Status Get(ReadOptions& read_options, ByteArray& key, std::string* value_out) {
-    return KingDB::Get(read_options, key, value_out);
-  }
+  // The values are uncompressed directly into the memory of 'value_out'
+  virtual Status Get(ReadOptions& read_options, ByteArray& key, std::string* value_out) override;
 
   virtual Status Get(ReadOptions& read_options, const std::string& key, ByteArray* value_out) {
     return KingDB::Get(read_options, key, value_out);
@@ -203,18 +247,34 @@ class Database: public KingDB {
     return KingDB::Get(read_options, key, value_out);
   }
 
+  // The values are uncompressed directly into 'buffer'
+  virtual Status Get(ReadOptions& read_options,
+                     ByteArray& key,
+                     char* buffer,
+                     uint64_t size_buffer,
+                     uint64_t* size_value_out) override;
+
+  virtual void MultiGet(ReadOptions& read_options,
+                        std::vector<ByteArray>& keys,
+                        std::vector<ByteArray>* values_out,
+                        std::vector<Status>* statuses_out) override;
+
   virtual Status Put(WriteOptions& write_options, ByteArray& key, ByteArray& value) override;
 
   virtual Status Put(WriteOptions& write_options, ByteArray& key, const std::string& chunk) {
-    return KingDB::Put(write_options, key, chunk);
+    ByteArray byte_array_chunk = NewByteArrayForWrite(chunk);
+    return Put(write_options, key, byte_array_chunk);
   }
 
   virtual Status Put(WriteOptions& write_options, const std::string& key, ByteArray& chunk) {
-    return KingDB::Put(write_options, key, chunk);
+    ByteArray byte_array_key = NewByteArrayForWrite(key);
+    return Put(write_options, byte_array_key, chunk);
   }
 
   virtual Status Put(WriteOptions& write_options, const std::string& key, const std::string& chunk) {
-    return KingDB::Put(write_options, key, chunk);
+    ByteArray byte_array_key = NewByteArrayForWrite(key);
+    ByteArray byte_array_chunk = NewByteArrayForWrite(chunk);
+    return Put(write_options, byte_array_key, byte_array_chunk);
   }
 
   virtual Status PutPart(WriteOptions& write_options,
@@ -223,6 +283,10 @@ class Database: public KingDB {
                           uint64_t offset_chunk, // TODO: could the offset be handled by the method itself?
                           uint64_t size_value) override;
   virtual Status Delete(WriteOptions& write_options, ByteArray& key) override;
+
+  // The batch must fit in an HSTable, and its values cannot be larger than
+  // the maximum part size
+  virtual Status Write(WriteOptions& write_options, WriteBatch& batch) override;
   virtual Snapshot NewSnapshot();
   virtual Iterator NewIterator(ReadOptions& read_options) override;
 
@@ -253,24 +317,66 @@ class Database: public KingDB {
   virtual void Flush();
   virtual void Compact();
 
+  // The options of the database once opened: the options persisted with the
+  // database override the ones given to the constructor
+  const DatabaseOptions& GetDatabaseOptions() { return db_options_; }
+
 
  private:
   KingDB* NewSnapshotPointer();
   Status GetRaw(ReadOptions& read_options,
                 ByteArray& key,
                 ByteArray* value_out,
-                bool want_raw_data);
+                bool want_raw_data,
+                uint64_t* location_out=nullptr);
+  Status UncompressValue(ReadOptions& read_options,
+                         uint64_t location,
+                         ByteArray* value_out);
+  Status UncompressValueToBuffer(ReadOptions& read_options,
+                                 uint64_t location,
+                                 ByteArray& value,
+                                 char* buffer);
 
   Status PutPartValidSize(WriteOptions& write_options,
                            ByteArray& key,
+                           uint64_t hashed_key,
                            ByteArray& chunk,
                            uint64_t offset_chunk,
                            uint64_t size_value);
 
+  // If 'buffer' is not null, it must be Arena::kSizeMaximumAllocation bytes
+  // large, and the compressed chunk is written into it when it fits:
+  // 'chunk_out' then points to 'buffer', which is only valid until the order
+  // is in the write buffer.
+  Status PreparePart(ByteArray& key,
+                     ByteArray& chunk,
+                     uint64_t offset_chunk,
+                     uint64_t size_value,
+                     char* buffer,
+                     ByteArray* chunk_out,
+                     uint64_t* offset_chunk_out,
+                     uint64_t* size_value_compressed_out,
+                     uint32_t* crc32_out);
+
+  // Blocks the index updates of the storage engine and copies the orders of
+  // the write buffer. The caller must call se_->UnlockIndexUpdates() once
+  // the index has been shared with the snapshot.
+  void LockIndexAndCopyOrdersForSnapshot(std::vector<Order>* orders_out);
+
+  // The write buffer copies the small keys and chunks into its arenas, thus
+  // small strings can be referenced instead of being copied
+  static ByteArray NewByteArrayForWrite(const std::string& str) {
+    if (str.size() <= Arena::kSizeMaximumAllocation) {
+      return NewPointerByteArray(str.c_str(), str.size());
+    }
+    return NewDeepCopyByteArray(str);
+  }
+
   kdb::DatabaseOptions db_options_;
   std::string dbname_;
   kdb::WriteBuffer *wb_;
   kdb::StorageEngine *se_;
+  kdb::ReadCache *read_cache_;
   kdb::EventManager *em_;
   kdb::CompressorLZ4 compressor_;
   kdb::CRC32 crc32_;
@@ -51,6 +51,7 @@ class RegularIterator: public IteratorResource {
       read_options_(read_options),
       snapshot_(nullptr),
       fileids_iterator_(fileids_iterator),
+      index_order_(0),
       status_(Status::OK()) {
     log::trace("RegularIterator::ctor()", "start");
     log::trace("RegularIterator::ctor()", "fileids_iterator_->size():%u", fileids_iterator_->size());
@@ -78,6 +79,7 @@ class RegularIterator: public IteratorResource {
     this->read_options_ = it.read_options_;
     this->snapshot_ = it.snapshot_;
     this->fileids_iterator_ = it.fileids_iterator_;
+    this->index_order_ = it.index_order_;
     this->is_closed_ = it.is_closed_;
     it.snapshot_ = nullptr;
   }
@@ -96,6 +98,7 @@ class RegularIterator: public IteratorResource {
     fileid_current_ = 0;
     has_file_ = false;
     index_fileid_ = 0;
+    index_order_ = 0;
     is_valid_ = true;
     mutex_.unlock();
     Next();
@@ -119,6 +122,20 @@ class RegularIterator: public IteratorResource {
     while (true) {
       log::trace("RegularIterator::Next()", "loop index_file:[%u] index_location:[%u]", index_fileid_, index_location_);
       if (index_fileid_ >= fileids_iterator_->size()) {
+        // Once all the files have been visited, the entries that were still
+        // in the write buffer when the snapshot was created are returned
+        if (index_order_ < se_readonly_->GetNumBufferedOrders()) {
+          ByteArray key, value;
+          bool is_valid_order = se_readonly_->GetBufferedOrder(index_order_, &key, &value);
+          index_order_ += 1;
+          if (!is_valid_order) continue;
+          key_ = key;
+          value_ = value;
+          if (value_.size() > se_readonly_->db_options_.internal__size_multipart_required) {
+            status_ = Status::MultipartRequired();
+          }
+          return true;
+        }
         log::trace("RegularIterator::Next()", "invalid index_fileid_:[%u] fileids_iterator_->size():[%u]", index_fileid_, fileids_iterator_->size());
         is_valid_ = false;
         break;
@@ -128,6 +145,15 @@ class RegularIterator: public IteratorResource {
         log::trace("RegularIterator::Next()", "initialize file");
         fileid_current_ = fileids_iterator_->at(index_fileid_);
         filepath_current_ = se_readonly_->GetFilepath(fileid_current_);
+        locations_current_.clear();
+        if (se_readonly_->GetLocationsInProgress(fileid_current_, &locations_current_)) {
+          // The file was still being written when the snapshot was created,
+          // thus its OffsetArray was not on disk
+          std::sort(locations_current_.begin(), locations_current_.end());
+          index_location_ = 0;
+          has_file_ = true;
+          continue;
+        }
         struct stat info;
         if (stat(filepath_current_.c_str(), &info) != 0) {
           index_fileid_ += 1;
@@ -137,7 +163,7 @@ class RegularIterator: public IteratorResource {
         if (!mmap.is_valid()) break;
         uint64_t dummy_filesize;
         bool dummy_is_file_large;
-        std::multimap<uint64_t, uint64_t> index_temp;
+        ShardedHashIndex index_temp;
         s = HSTableManager::LoadFile(mmap,
                                      fileid_current_,
                                      index_temp,
@@ -148,8 +174,8 @@ class RegularIterator: public IteratorResource {
           continue;
         }
         locations_current_.clear();
-        for (auto& p: index_temp) {
-          locations_current_.push_back(p.second);
+        for (auto& p: index_temp.shard(0)) {
+          locations_current_.push_back(p.location);
         }
         std::sort(locations_current_.begin(), locations_current_.end());
         index_location_ = 0;
@@ -166,27 +192,36 @@ class RegularIterator: public IteratorResource {
 
       // Get entry at the location
       ByteArray key, value;
+      uint64_t hashed_key;
       uint64_t location_current = locations_current_[index_location_];
-      Status s = se_readonly_->GetEntry(read_options_, location_current, &key, &value);
+      Status s = se_readonly_->GetEntry(read_options_, location_current, &key, &value, &hashed_key);
       if (!s.IsOK()) {
         log::trace("RegularIterator::Next()", "GetEntry() failed: %s", s.ToString().c_str());
         index_location_ += 1;
         continue;
       }
 
+      // The key was overwritten or deleted by an order that was still in the
+      // write buffer when the snapshot was created
+      if (se_readonly_->IsKeyInBufferedOrders(key, hashed_key)) {
+        index_location_ += 1;
+        continue;
+      }
+
       // Get entry for the key found at the location, and continue if the
       // location is a mismatch -- i.e. the current entry has been overwritten
       // by a later entry.
       
-      bool is_last = se_readonly_->IsLocationLastInIndex(location_current, key);
+      bool is_last = se_readonly_->IsLocationLastInIndex(location_current, hashed_key);
       if (!is_last) {
         //fprintf(stderr, "was not last, need to check\n");
         ByteArray value_alt;
         uint64_t location_out;
-        s = se_readonly_->Get(read_options_, key, &value_alt, &location_out);
+        s = se_readonly_->Get(read_options_, key, hashed_key, &value_alt, &location_out);
         if (!s.IsOK()) {
+          // The key was deleted: only this location has to be skipped
           log::trace("RegularIterator::Next()", "Get(): failed: %s", s.ToString().c_str());
-          index_fileid_ += 1;
+          index_location_ += 1;
           continue;
         }
           
@@ -263,6 +298,7 @@ class RegularIterator: public IteratorResource {
   uint32_t index_fileid_;
   std::vector<uint32_t>* fileids_iterator_;
   uint32_t index_location_;
+  uint32_t index_order_;
   std::vector<uint64_t> locations_current_;
   bool has_file_;
   bool is_valid_;
@@ -5,10 +5,15 @@
 #ifndef KINGDB_INTERFACE_H_
 #define KINGDB_INTERFACE_H_
 
+#include <string>
+#include <vector>
+#include <cstring>
+
 #include "util/options.h"
 #include "util/status.h"
 #include "util/order.h"
 #include "util/byte_array.h"
+#include "interface/write_batch.h"
 
 namespace kdb {
 
@@ -23,11 +28,13 @@ class KingDB {
   virtual ~KingDB() {}
   virtual Status Get(ReadOptions& read_options, ByteArray& key, ByteArray* value_out) = 0;
 
+  // The std::string versions of Get() reuse the memory already allocated by
+  // 'value_out' whenever it is large enough for the value.
   virtual Status Get(ReadOptions& read_options, ByteArray& key, std::string* value_out) {
     ByteArray value;
     Status s = Get(read_options, key, &value);
     if (!s.IsOK()) return s;
-    *value_out = value.ToString();
+    value_out->assign(value.data(), value.size());
     return s;
   }
 
@@ -39,13 +46,45 @@ class KingDB {
 
   virtual Status Get(ReadOptions& read_options, const std::string& key, std::string* value_out) {
     ByteArray byte_array_key = NewPointerByteArray(key.c_str(), key.size());
+    return Get(read_options, byte_array_key, value_out);
+  }
+
+  // Gets the value of 'key' into 'buffer', which is owned by the caller and
+  // is 'size_buffer' bytes large, and sets 'size_value_out' to the size of
+  // the value. If the buffer is too small, nothing is copied and
+  // InvalidArgument is returned, so that the call can be made again with a
+  // buffer of at least 'size_value_out' bytes.
+  virtual Status Get(ReadOptions& read_options,
+                     ByteArray& key,
+                     char* buffer,
+                     uint64_t size_buffer,
+                     uint64_t* size_value_out) {
     ByteArray value;
     Status s = Get(read_options, key, &value);
     if (!s.IsOK()) return s;
-    *value_out = value.ToString();
+    *size_value_out = value.size();
+    if (value.size() > size_buffer) {
+      return Status::InvalidArgument("The buffer is too small for the value", "required size is " + std::to_string(value.size()) + " bytes");
+    }
+    memcpy(buffer, value.data(), value.size());
     return s;
   }
 
+  // Gets the values of a batch of keys. After the call, 'values_out' and
+  // 'statuses_out' have the same size as 'keys', and the value of keys[i] is
+  // valid only if statuses_out[i] is OK. Implementations can be much faster
+  // than a loop over Get(), which is what this default implementation does.
+  virtual void MultiGet(ReadOptions& read_options,
+                        std::vector<ByteArray>& keys,
+                        std::vector<ByteArray>* values_out,
+                        std::vector<Status>* statuses_out) {
+    values_out->assign(keys.size(), ByteArray());
+    statuses_out->clear();
+    for (size_t i = 0; i < keys.size(); i++) {
+      statuses_out->push_back(Get(read_options, keys[i], &(*values_out)[i]));
+    }
+  }
+
   virtual Status Put(WriteOptions& write_options, ByteArray& key, ByteArray& chunk) = 0;
 
   virtual Status Put(WriteOptions& write_options, ByteArray& key, const std::string& chunk) {
@@ -66,6 +105,9 @@ class KingDB {
 
   virtual MultipartReader NewMultipartReader(ReadOptions& read_options, ByteArray& key) = 0;
   virtual Status Delete(WriteOptions& write_options, ByteArray& key) = 0;
+
+  // Applies all the puts and deletes of 'batch' atomically
+  virtual Status Write(WriteOptions& write_options, WriteBatch& batch) = 0;
   virtual Iterator NewIterator(ReadOptions& read_options) = 0;
   virtual Status Open() = 0;
   virtual void Close() = 0;
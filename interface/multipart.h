@@ -16,6 +16,8 @@
 #include <memory>
 #include <string>
 #include <string.h>
+#include <thread>
+#include <algorithm>
 
 #include "util/logger.h"
 #include "util/options.h"
@@ -37,9 +39,21 @@ class MultipartReader {
  
   virtual void Begin() {
     log::trace("MultipartReader::Next()", "Begin()");
+    is_checksum_done_ = false;
     if (read_options_.verify_checksums) {
       crc32_.ResetThreadLocalStorage();
       crc32_.put(value_.checksum_initial()); 
+      // The uncompressed values are stored as they are, thus the checksum of
+      // a large one does not need to follow the parts: it is computed at
+      // once, by several threads in parallel
+      uint64_t size_min = std::max(read_options_.verify_checksums__parallel_min_size, (uint64_t)1);
+      if (!is_compressed() && value_.size() >= size_min) {
+        uint64_t size_slice = std::max(size_min / 4, (uint64_t)1);
+        uint64_t num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+        num_threads = std::min(num_threads, value_.size() / size_slice);
+        crc32_.put(crc32c::ExtendParallel(value_.checksum_initial(), value_.data(), value_.size(), num_threads));
+        is_checksum_done_ = true;
+      }
     }
     is_valid_stream_ = true;
     is_compression_disabled_ = false;
@@ -130,7 +144,13 @@ class MultipartReader {
       if (offset_output_ == size_left) {
         log::trace("MultipartReader::Next()", "Has gotten all the data");
         is_valid_stream_ = false;
-        status_ = Status::OK();
+        if (   !read_options_.verify_checksums
+            || crc32_.get() == value_.checksum()) {
+          status_ = Status::OK();
+        } else {
+          log::debug("MultipartReader::Next()", "Bad CRC32 - stored:0x%08" PRIx64 " computed:0x%08" PRIx64 "\n", value_.checksum(), crc32_.get());
+          status_ = Status::IOError("Invalid checksum.");
+        }
         return true;
       }
 
@@ -138,7 +158,7 @@ class MultipartReader {
 
       size_t step = 1024*1024; // TODO: make this a parameter at some point?
       size_t size_current = offset_output_ + step < size_left ? step : size_left - offset_output_;
-      if (read_options_.verify_checksums) {
+      if (read_options_.verify_checksums && !is_checksum_done_) {
         crc32_.stream(data_left, size_current);
       }
 
@@ -163,6 +183,7 @@ class MultipartReader {
   CRC32 crc32_;
   uint64_t offset_output_;
   bool is_compression_disabled_;
+  bool is_checksum_done_;
  
   Status status_;
   ByteArray chunk_;
@@ -172,7 +193,8 @@ class MultipartReader {
     return value_.is_compressed();
   }
 
-  MultipartReader(const MultipartReader& r) {
+  MultipartReader(const MultipartReader& r)
+    : is_checksum_done_(false) {
     if(&r != this) {
       this->read_options_ = r.read_options_;
       this->value_ = r.value_;
@@ -184,10 +206,12 @@ class MultipartReader {
  private:
 
   MultipartReader(Status s)
-    : status_(s) {
+    : is_checksum_done_(false),
+      status_(s) {
   }
   MultipartReader(ReadOptions& read_options, ByteArray& value)
-    : status_(Status::OK()),
+    : is_checksum_done_(false),
+      status_(Status::OK()),
       read_options_(read_options),
       value_(value) {
   }
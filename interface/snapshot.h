@@ -76,10 +76,13 @@ class Snapshot: public KingDB {
   }
 
   virtual Status Get(ReadOptions& read_options, ByteArray& key, ByteArray* value_out) override {
-    Status s = se_readonly_->Get(read_options, key, value_out);
+    Status s = se_readonly_->Get(read_options, key, se_readonly_->HashKey(key), value_out);
     if (s.IsNotFound()) {
       log::trace("Snapshot::Get()", "not found in storage engine");
       return s;
+    } else if (s.IsDeleteOrder()) {
+      log::trace("Snapshot::Get()", "deleted in storage engine");
+      return Status::NotFound("Unable to find entry");
     } else if (s.IsOK()) {
       log::trace("Snapshot::Get()", "found in storage engine");
       return s;
@@ -91,6 +94,20 @@ class Snapshot: public KingDB {
     return s;
   }
 
+  virtual void MultiGet(ReadOptions& read_options,
+                        std::vector<ByteArray>& keys,
+                        std::vector<ByteArray>* values_out,
+                        std::vector<Status>* statuses_out) override {
+    std::vector<uint64_t> locations;
+    std::vector<uint64_t> hashed_keys;
+    hashed_keys.reserve(keys.size());
+    for (auto& key: keys) hashed_keys.push_back(se_readonly_->HashKey(key));
+    se_readonly_->MultiGet(read_options, keys, hashed_keys, values_out, statuses_out, &locations);
+    for (auto& s: *statuses_out) {
+      if (s.IsDeleteOrder()) s = Status::NotFound("Unable to find entry");
+    }
+  }
+
   virtual Status Put(WriteOptions& write_options, ByteArray& key, ByteArray& chunk) override {
     return Status::IOError("Not supported");
   }
@@ -107,10 +124,16 @@ class Snapshot: public KingDB {
     return Status::IOError("Not supported");
   }
 
+  virtual Status Write(WriteOptions& write_options, WriteBatch& batch) override {
+    return Status::IOError("Not supported");
+  }
+
   virtual Iterator NewIterator(ReadOptions& read_options) override {
     IteratorResource* ir = nullptr;
     uint64_t dbsize_uncompacted = se_readonly_->GetDbSizeUncompacted();
-    if (dbsize_uncompacted > 0) {
+    // The SequentialIterator cannot tell which entries of the files were
+    // overwritten by the orders that were in the write buffer
+    if (dbsize_uncompacted > 0 || se_readonly_->GetNumBufferedOrders() > 0) {
       ir = new RegularIterator(read_options, se_readonly_, fileids_iterator_);
     } else {
       ir = new SequentialIterator(read_options, se_readonly_, fileids_iterator_);
@@ -142,10 +165,13 @@ class Snapshot: public KingDB {
     // WARNING: code duplication with Database::GetRaw()
     if (is_closed_) return Status::IOError("The database is not open");
     log::trace("Database GetRaw()", "[%s]", key.ToString().c_str());
-    Status s = se_readonly_->Get(read_options, key, value_out);
+    Status s = se_readonly_->Get(read_options, key, se_readonly_->HashKey(key), value_out);
     if (s.IsNotFound()) {
       log::trace("Database GetRaw()", "not found in storage engine");
       return s;
+    } else if (s.IsDeleteOrder()) {
+      log::trace("Database GetRaw()", "deleted in storage engine");
+      return Status::NotFound("Unable to find entry");
     } else if (s.IsOK()) {
       log::trace("Database GetRaw()", "found in storage engine");
     } else {
@@ -0,0 +1,99 @@
+// Copyright (c) 2014, Emmanuel Goossaert. All rights reserved.
+// Use of this source code is governed by the BSD 3-Clause License,
+// that can be found in the LICENSE file.
+
+#ifndef KINGDB_WRITE_BATCH_H_
+#define KINGDB_WRITE_BATCH_H_
+
+#include "util/debug.h"
+#include <cinttypes>
+#include <string>
+
+#include "util/byte_array.h"
+#include "util/order.h"
+#include "algorithm/coding.h"
+
+namespace kdb {
+
+// WriteBatch holds a sequence of puts and deletes that are applied
+// atomically by Write(): after a crash, either all of them or none of them
+// are recovered. The keys and values are copied into one contiguous buffer
+// as they are added, thus the batch does not keep references to the memory
+// of the caller.
+//
+// Each entry is encoded as: type (1 byte), size of the key (varint64), size
+// of the value (varint64), key, value.
+class WriteBatch {
+ friend class Database;
+ public:
+  WriteBatch() : num_entries_(0) {}
+
+  void Put(ByteArray& key, ByteArray& value) {
+    Add(OrderType::Put, key.data(), key.size(), value.data(), value.size());
+  }
+
+  void Put(const std::string& key, const std::string& value) {
+    Add(OrderType::Put, key.c_str(), key.size(), value.c_str(), value.size());
+  }
+
+  void Delete(ByteArray& key) {
+    Add(OrderType::Delete, key.data(), key.size(), nullptr, 0);
+  }
+
+  void Delete(const std::string& key) {
+    Add(OrderType::Delete, key.c_str(), key.size(), nullptr, 0);
+  }
+
+  void Clear() {
+    rep_.clear();
+    num_entries_ = 0;
+  }
+
+  uint64_t num_entries() { return num_entries_; }
+  uint64_t size() { return rep_.size(); }
+
+ private:
+  void Add(OrderType type,
+           const char* key, uint64_t size_key,
+           const char* value, uint64_t size_value) {
+    rep_.push_back(type == OrderType::Put ? kTypePut : kTypeDelete);
+    PutVarint64(&rep_, size_key);
+    PutVarint64(&rep_, size_value);
+    rep_.append(key, size_key);
+    if (size_value > 0) rep_.append(value, size_value);
+    num_entries_ += 1;
+  }
+
+  // Decodes the entry at 'offset' in 'data', which holds a copy of the
+  // encoded batch, and returns the offset of the next entry, or 0 if the
+  // entry could not be decoded.
+  static uint64_t DecodeEntry(const char* data,
+                              uint64_t size,
+                              uint64_t offset,
+                              OrderType* type_out,
+                              uint64_t* offset_key_out,
+                              uint64_t* size_key_out,
+                              uint64_t* size_value_out) {
+    const char* limit = data + size;
+    const char* ptr = data + offset;
+    if (ptr >= limit) return 0;
+    *type_out = (*ptr == kTypePut) ? OrderType::Put : OrderType::Delete;
+    ptr = GetVarint64Ptr(ptr + 1, limit, size_key_out);
+    if (ptr == nullptr) return 0;
+    ptr = GetVarint64Ptr(ptr, limit, size_value_out);
+    if (ptr == nullptr) return 0;
+    if (*size_key_out + *size_value_out > static_cast<uint64_t>(limit - ptr)) return 0;
+    *offset_key_out = ptr - data;
+    return *offset_key_out + *size_key_out + *size_value_out;
+  }
+
+  static const char kTypePut = 0x1;
+  static const char kTypeDelete = 0x2;
+
+  std::string rep_;
+  uint64_t num_entries_;
+};
+
+} // namespace kdb
+
+#endif // KINGDB_WRITE_BATCH_H_
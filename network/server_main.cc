@@ -177,6 +177,8 @@ int main(int argc, char** argv) {
   kdb::HashType htype;
   if (db_options.storage__hashing_algorithm == "xxhash-64") {
     htype = kdb::kxxHash_64;
+  } else if (db_options.storage__hashing_algorithm == "xxhash3-64") {
+    htype = kdb::kxxHash3_64;
   } else if (db_options.storage__hashing_algorithm == "murmurhash3-64") {
     htype = kdb::kMurmurHash3_64;
   } else {
@@ -196,6 +198,17 @@ int main(int argc, char** argv) {
   }
   db_options.write_buffer__mode = wbm;
 
+  kdb::IOEngineType ioet;
+  if (db_options.storage__io_engine_str == "syscall") {
+    ioet = kdb::kIOEngineSyscall;
+  } else if (db_options.storage__io_engine_str == "io_uring") {
+    ioet = kdb::kIOEngineUring;
+  } else {
+    fprintf(stderr, "Unknown I/O engine: [%s]\n", db_options.storage__io_engine_str.c_str());
+    exit(-1);
+  }
+  db_options.storage__io_engine = ioet;
+
   kdb::FileUtil::increase_limit_open_files();
 
 #ifndef DEBUG
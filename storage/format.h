@@ -38,7 +38,9 @@ enum EntryHeaderFlag {
   kEntryFull     = 0x8,
   kEntryFirst    = 0x10,
   kEntryMiddle   = 0x20,
-  kEntryLast     = 0x40
+  kEntryLast     = 0x40,
+  kInBatch       = 0x80,
+  kLastInBatch   = 0x100
 };
 
 
@@ -60,6 +62,12 @@ struct EntryHeader {
     log::trace("EntryHeader::print()", "flags:%u checksum_content:0x%08" PRIx64 " size_key:%" PRIu64 " size_value:%" PRIu64 " size_value_compressed:%" PRIu64 " size_padding:%" PRIu64  " hash:0x%08" PRIx64, flags, checksum_content, size_key, size_value, size_value_compressed, size_padding, hash);
   }
 
+  static uint64_t GetSizeMaximum() {
+    // checksum_header + checksum_content + flags + size_key + size_value
+    // + size_value_compressed + size_padding + hash
+    return 1 + 4 + 5 + 10 + 10 + 8 + 10 + 8;
+  }
+
   static uint64_t CalculatePaddingSize(uint64_t size_value) {
     // NOTE: Here I picked an arbitrary frame size of 64KB, and do an estimate
     // of the padding necessary for the frame headers based on the current size
@@ -125,6 +133,22 @@ struct EntryHeader {
     return (flags & kEntryFull); 
   }
 
+  // The entries of a batch are stored contiguously in the same HSTable, and
+  // the last one is flagged so that the recovery process can tell if the
+  // batch was written entirely.
+  void SetInBatch(bool is_last) {
+    flags |= kInBatch;
+    if (is_last) flags |= kLastInBatch;
+  }
+
+  bool IsInBatch() {
+    return (flags & kInBatch);
+  }
+
+  bool IsLastInBatch() {
+    return (flags & kLastInBatch);
+  }
+
   bool IsCompressed() {
     return (size_value_compressed > 0); 
   }
@@ -293,6 +317,8 @@ struct DatabaseOptionEncoder {
       output->hash = kMurmurHash3_64;
     } else if (hash == 0x1) {
       output->hash = kxxHash_64;
+    } else if (hash == 0x2) {
+      output->hash = kxxHash3_64;
     } else {
       return Status::IOError("Unknown hash type");
     }
@@ -334,6 +360,16 @@ struct DatabaseOptionEncoder {
     return 48; // in bytes
   }
 
+  // Copies the options that are persisted with the database, and thus cannot
+  // change after it has been created, from 'from' into 'to'. All the other
+  // options are instance options, which can be different at each Open().
+  static void CopyPersistedOptions(const struct DatabaseOptions& from, struct DatabaseOptions* to) {
+    to->storage__hstable_size = from.storage__hstable_size;
+    to->hash = from.hash;
+    to->compression.type = from.compression.type;
+    to->checksum = from.checksum;
+  }
+
 };
 
 
@@ -529,6 +565,82 @@ struct OffsetArrayRow {
 };
 
 
+// The index checkpoint is a copy of the in-memory index written when the
+// database is closed, so that the next opening can load the index with one
+// sequential read instead of going through the OffsetArrays of all the
+// HSTables. Its layout is:
+//  - IndexCheckpointHeader
+//  - One IndexCheckpointFileRow for each HSTable covered by the checkpoint
+//  - One <hashed_key, location> pair of fixed 64-bit integers for each
+//    entry in the index, in the same order as they were in the index
+//  - The CRC32 of everything that precedes it
+struct IndexCheckpointHeader {
+  uint64_t magic_number;
+  uint32_t version;
+  uint32_t fileid_max;
+  uint64_t timestamp_max;
+  uint64_t num_files;
+  uint64_t num_entries;
+
+  static Status DecodeFrom(const char* buffer_in,
+                           uint64_t num_bytes_max,
+                           struct IndexCheckpointHeader *output) {
+    if (num_bytes_max < GetFixedSize()) return Status::IOError("Decoding error");
+    GetFixed64(buffer_in,      &(output->magic_number));
+    GetFixed32(buffer_in +  8, &(output->version));
+    GetFixed32(buffer_in + 12, &(output->fileid_max));
+    GetFixed64(buffer_in + 16, &(output->timestamp_max));
+    GetFixed64(buffer_in + 24, &(output->num_files));
+    GetFixed64(buffer_in + 32, &(output->num_entries));
+    if (output->magic_number != get_magic_number()) return Status::IOError("Invalid magic number");
+    if (output->version != kVersion) return Status::IOError("Index checkpoint version not supported");
+    return Status::OK();
+  }
+
+  static uint32_t EncodeTo(const struct IndexCheckpointHeader *input, char* buffer) {
+    EncodeFixed64(buffer,      get_magic_number());
+    EncodeFixed32(buffer +  8, kVersion);
+    EncodeFixed32(buffer + 12, input->fileid_max);
+    EncodeFixed64(buffer + 16, input->timestamp_max);
+    EncodeFixed64(buffer + 24, input->num_files);
+    EncodeFixed64(buffer + 32, input->num_entries);
+    return GetFixedSize();
+  }
+
+  static uint32_t GetFixedSize() {
+    return 40; // in bytes
+  }
+
+  static uint64_t get_magic_number() { return 0x4b444249434b5054; }
+
+  static const uint32_t kVersion = 1;
+};
+
+struct IndexCheckpointFileRow {
+  uint32_t fileid;
+  uint32_t filetype;
+  uint64_t filesize;
+
+  static void DecodeFrom(const char* buffer_in,
+                         struct IndexCheckpointFileRow *output) {
+    GetFixed32(buffer_in,     &(output->fileid));
+    GetFixed32(buffer_in + 4, &(output->filetype));
+    GetFixed64(buffer_in + 8, &(output->filesize));
+  }
+
+  static uint32_t EncodeTo(const struct IndexCheckpointFileRow *input, char* buffer) {
+    EncodeFixed32(buffer,     input->fileid);
+    EncodeFixed32(buffer + 4, input->filetype);
+    EncodeFixed64(buffer + 8, input->filesize);
+    return GetFixedSize();
+  }
+
+  static uint32_t GetFixedSize() {
+    return 16; // in bytes
+  }
+};
+
+
 } // namespace kdb
 
 #endif // KINGDB_FORMAT_H_
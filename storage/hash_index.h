@@ -0,0 +1,532 @@
+// Copyright (c) 2014, Emmanuel Goossaert. All rights reserved.
+// Use of this source code is governed by the BSD 3-Clause License,
+// that can be found in the LICENSE file.
+
+#ifndef KINGDB_HASH_INDEX_H_
+#define KINGDB_HASH_INDEX_H_
+
+#include "util/debug.h"
+#include <cstdint>
+#include <cinttypes>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#include "util/logger.h"
+
+namespace kdb {
+
+struct HashIndexSlot {
+  uint64_t hashed_key;
+  uint64_t location;
+};
+
+// HashIndexTable is an array of slots split into pages. The copies of a table
+// share its pages, which are reference-counted, and a page is only copied when
+// one of the tables sharing it modifies it. The pages have kNumSlotsPerPage
+// slots, or less if the whole table is smaller than that.
+class HashIndexTable {
+ public:
+  HashIndexTable()
+      : capacity_(0),
+        shift_(0),
+        mask_(0) {
+  }
+
+  // Creates a table of 'capacity' empty slots, which must be a power of two
+  explicit HashIndexTable(uint64_t capacity)
+      : capacity_(capacity),
+        shift_(0) {
+    uint64_t num_slots_per_page = (capacity < kNumSlotsPerPage) ? capacity : kNumSlotsPerPage;
+    while ((1ULL << shift_) < num_slots_per_page) shift_ += 1;
+    mask_ = num_slots_per_page - 1;
+    pages_.reserve(capacity / num_slots_per_page);
+    for (uint64_t i = 0; i < capacity / num_slots_per_page; i++) {
+      pages_.push_back(NewPage(num_slots_per_page, nullptr));
+    }
+  }
+
+  uint64_t capacity() const { return capacity_; }
+
+  const struct HashIndexSlot& operator[](uint64_t i) const {
+    return pages_[i >> shift_].get()[i & mask_];
+  }
+
+  // Returns slot 'i' for writing, after copying its page if it is shared with
+  // another table.
+  struct HashIndexSlot& GetWritableSlot(uint64_t i) {
+    std::shared_ptr<struct HashIndexSlot>& page = pages_[i >> shift_];
+    if (page.use_count() > 1) {
+      page = NewPage(mask_ + 1, page.get());
+    } else {
+      // The other owners may have released the page right before, and the
+      // page is about to be written: their last reads must happen before.
+      std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return page.get()[i & mask_];
+  }
+
+ private:
+  static const uint64_t kNumSlotsPerPage = 1024;
+
+  static std::shared_ptr<struct HashIndexSlot> NewPage(uint64_t num_slots, const struct HashIndexSlot* slots) {
+    // Value-initialization sets all the slots to kLocationEmpty
+    std::shared_ptr<struct HashIndexSlot> page(new struct HashIndexSlot[num_slots](),
+                                               std::default_delete<struct HashIndexSlot[]>());
+    if (slots != nullptr) std::copy(slots, slots + num_slots, page.get());
+    return page;
+  }
+
+  std::vector< std::shared_ptr<struct HashIndexSlot> > pages_;
+  uint64_t capacity_;
+  uint32_t shift_;
+  uint64_t mask_;
+};
+
+
+// HashIndex maps hashed keys to locations in HSTables. It is an open-addressing
+// hash table with linear probing, in which each slot is a flat 16-byte pair
+// <hashed_key, location>. It replaces the std::multimap that was used before,
+// which was costing about 48 bytes of tree node per entry and a pointer chase
+// per tree level on every lookup.
+//
+// Several locations can be stored for the same hashed key, either because
+// a key was overwritten, or because two keys have colliding hashes. Like
+// with the multimap, the relative ordering of the locations of a hashed key is
+// the insertion order, and the most recent location is the last one. This
+// ordering is guaranteed by the following invariants:
+//  - An insertion always goes to the first *empty* slot of the probe sequence,
+//    and never reuses deleted slots: thus along any probe sequence, the
+//    locations of a hashed key appear in insertion order.
+//  - When the table is resized, the slots are migrated starting from a slot
+//    which is empty, i.e. from the beginning of a cluster, so that the
+//    relative ordering of locations within clusters is preserved.
+//
+// The resize is incremental: when the load factor goes over the limit, a new
+// table is allocated and every subsequent call to Insert() migrates a small
+// number of slots from the old table to the new one. Thus no single insertion
+// pays for a full rehash, and the readers, which have to wait for the write
+// lock to be released, are never stalled for long. During a resize:
+//  - Before a hashed key is inserted, all its locations in the old table are
+//    migrated, so that new locations are always after older ones.
+//  - For any hashed key, the locations in the new table are older than the
+//    ones still in the old table, thus lookups read the new table first.
+//
+// The copies of a HashIndex share the pages of its tables, see HashIndexTable.
+//
+// HashIndex is not thread-safe: concurrent readers are fine, but writers must
+// be serialized with readers by the caller.
+class HashIndex {
+ public:
+  HashIndex(uint64_t capacity_initial=kCapacityMinimum)
+      : num_used_old_(0),
+        cursor_old_(0),
+        start_old_(0) {
+    uint64_t capacity = kCapacityMinimum;
+    while (capacity < capacity_initial) capacity <<= 1;
+    table_ = HashIndexTable(capacity);
+    num_used_ = 0;
+    num_deleted_ = 0;
+  }
+
+  // The copy has the tables as they are, including the state of an
+  // incremental resize, so that it returns the locations in the same order.
+  // Only the pointers to the pages are copied.
+  HashIndex(const HashIndex& other) = default;
+
+  void Insert(uint64_t hashed_key, uint64_t location) {
+    if (IsResizing()) {
+      MigrateHashedKey(hashed_key);
+      MigrateSlots(kNumSlotsMigratedPerInsert);
+    } else if ((num_used_ + num_deleted_ + 1) * 4 > table_.capacity() * 3) {
+      StartResize();
+      MigrateHashedKey(hashed_key);
+      MigrateSlots(kNumSlotsMigratedPerInsert);
+    }
+    InsertInTable(table_, hashed_key, location);
+    num_used_ += 1;
+  }
+
+  // Appends to 'locations_out' all the locations stored for 'hashed_key', from
+  // the oldest to the most recent one.
+  void GetLocations(uint64_t hashed_key, std::vector<uint64_t>* locations_out) const {
+    GetLocationsInTable(table_, hashed_key, locations_out);
+    if (IsResizing()) {
+      GetLocationsInTable(table_old_, hashed_key, locations_out);
+    }
+  }
+
+  // Returns true and sets 'location_out' to the most recent location stored
+  // for 'hashed_key' if there is any, returns false otherwise.
+  bool GetLastLocation(uint64_t hashed_key, uint64_t* location_out) const {
+    if (   IsResizing()
+        && GetLastLocationInTable(table_old_, hashed_key, location_out)) {
+      return true;
+    }
+    return GetLastLocationInTable(table_, hashed_key, location_out);
+  }
+
+  bool Contains(uint64_t hashed_key) const {
+    uint64_t location;
+    return GetLastLocation(hashed_key, &location);
+  }
+
+  // Removes all the locations stored for 'hashed_key'
+  void Erase(uint64_t hashed_key) {
+    uint64_t num_erased = EraseInTable(table_, hashed_key);
+    num_used_ -= num_erased;
+    num_deleted_ += num_erased;
+    if (IsResizing()) {
+      num_used_old_ -= EraseInTable(table_old_, hashed_key);
+    }
+  }
+
+  void clear() {
+    table_old_ = HashIndexTable();
+    num_used_old_ = 0;
+    if (num_used_ + num_deleted_ > 0) {
+      table_ = HashIndexTable(kCapacityMinimum);
+    }
+    num_used_ = 0;
+    num_deleted_ = 0;
+  }
+
+  uint64_t size() const { return num_used_ + num_used_old_; }
+  bool empty() const { return size() == 0; }
+
+  // Size of the memory allocated for the slots, in bytes
+  uint64_t memory_usage() const {
+    return (table_.capacity() + table_old_.capacity()) * sizeof(struct HashIndexSlot);
+  }
+
+  // Forward iterator over all the slots in use. For any given hashed key, the
+  // locations are visited in insertion order, but there is no ordering
+  // across different hashed keys.
+  class ConstIterator {
+   public:
+    ConstIterator(const HashIndex* index, bool is_end)
+        : index_(index),
+          is_old_(false),
+          position_(0) {
+      if (is_end) {
+        is_old_ = true;
+        position_ = index_->table_old_.capacity();
+        return;
+      }
+      start_ = FindEmptySlot(index_->table_);
+      SkipUnusedSlots();
+    }
+
+    const struct HashIndexSlot& operator*() const { return *slot(); }
+    const struct HashIndexSlot* operator->() const { return slot(); }
+
+    ConstIterator& operator++() {
+      position_ += 1;
+      SkipUnusedSlots();
+      return *this;
+    }
+
+    bool operator==(const ConstIterator& right) const {
+      return (is_old_ == right.is_old_ && position_ == right.position_);
+    }
+
+    bool operator!=(const ConstIterator& right) const {
+      return !(*this == right);
+    }
+
+   private:
+    const struct HashIndexSlot* slot() const {
+      const HashIndexTable& table = is_old_ ? index_->table_old_ : index_->table_;
+      return &table[(start_ + position_) & (table.capacity() - 1)];
+    }
+
+    void SkipUnusedSlots() {
+      while (true) {
+        uint64_t capacity = is_old_ ? index_->table_old_.capacity() : index_->table_.capacity();
+        if (position_ >= capacity) {
+          if (is_old_) return;
+          is_old_ = true;
+          position_ = 0;
+          if (index_->table_old_.capacity() == 0) return;
+          start_ = FindEmptySlot(index_->table_old_);
+          continue;
+        }
+        if (IsSlotUsed(*slot())) return;
+        position_ += 1;
+      }
+    }
+
+    const HashIndex* index_;
+    bool is_old_;
+    uint64_t start_;
+    uint64_t position_;
+  };
+
+  ConstIterator begin() const { return ConstIterator(this, false); }
+  ConstIterator end() const { return ConstIterator(this, true); }
+
+ private:
+  // A location is the concatenation of a fileid and an offset, and no entry
+  // can ever be at offset 0 or 1 of a HSTable since the HSTable header is
+  // there, thus these two values can be used to mark slots as empty or deleted.
+  static const uint64_t kLocationEmpty = 0;
+  static const uint64_t kLocationDeleted = 1;
+  static const uint64_t kCapacityMinimum = 64;
+  static const uint64_t kNumSlotsMigratedPerInsert = 16;
+
+  HashIndex& operator=(const HashIndex&);
+
+  static bool IsSlotUsed(const struct HashIndexSlot& slot) {
+    return (slot.location != kLocationEmpty && slot.location != kLocationDeleted);
+  }
+
+  static uint64_t FindEmptySlot(const HashIndexTable& table) {
+    // The load factor is kept under 1, thus there is always an empty slot
+    for (uint64_t i = 0; i < table.capacity(); i++) {
+      if (table[i].location == kLocationEmpty) return i;
+    }
+    return 0;
+  }
+
+  static void InsertInTable(HashIndexTable& table,
+                            uint64_t hashed_key,
+                            uint64_t location) {
+    uint64_t mask = table.capacity() - 1;
+    uint64_t i = hashed_key & mask;
+    while (table[i].location != kLocationEmpty) {
+      i = (i + 1) & mask;
+    }
+    struct HashIndexSlot& slot = table.GetWritableSlot(i);
+    slot.hashed_key = hashed_key;
+    slot.location = location;
+  }
+
+  static void GetLocationsInTable(const HashIndexTable& table,
+                                  uint64_t hashed_key,
+                                  std::vector<uint64_t>* locations_out) {
+    uint64_t mask = table.capacity() - 1;
+    uint64_t i = hashed_key & mask;
+    while (table[i].location != kLocationEmpty) {
+      if (table[i].hashed_key == hashed_key && table[i].location != kLocationDeleted) {
+        locations_out->push_back(table[i].location);
+      }
+      i = (i + 1) & mask;
+    }
+  }
+
+  static bool GetLastLocationInTable(const HashIndexTable& table,
+                                     uint64_t hashed_key,
+                                     uint64_t* location_out) {
+    uint64_t mask = table.capacity() - 1;
+    uint64_t i = hashed_key & mask;
+    bool found = false;
+    while (table[i].location != kLocationEmpty) {
+      if (table[i].hashed_key == hashed_key && table[i].location != kLocationDeleted) {
+        *location_out = table[i].location;
+        found = true;
+      }
+      i = (i + 1) & mask;
+    }
+    return found;
+  }
+
+  static uint64_t EraseInTable(HashIndexTable& table,
+                               uint64_t hashed_key) {
+    uint64_t mask = table.capacity() - 1;
+    uint64_t i = hashed_key & mask;
+    uint64_t num_erased = 0;
+    while (table[i].location != kLocationEmpty) {
+      if (table[i].hashed_key == hashed_key && table[i].location != kLocationDeleted) {
+        table.GetWritableSlot(i).location = kLocationDeleted;
+        num_erased += 1;
+      }
+      i = (i + 1) & mask;
+    }
+    return num_erased;
+  }
+
+  bool IsResizing() const {
+    return (table_old_.capacity() > 0);
+  }
+
+  void StartResize() {
+    // If most of the slots are deleted ones, the table is rebuilt with the
+    // same capacity, otherwise the capacity is doubled.
+    uint64_t capacity = table_.capacity();
+    uint64_t capacity_new = capacity;
+    if (num_used_ * 2 > capacity) capacity_new = capacity * 2;
+    log::trace("HashIndex::StartResize()", "capacity:%" PRIu64 " capacity_new:%" PRIu64 " num_used:%" PRIu64 " num_deleted:%" PRIu64, capacity, capacity_new, num_used_, num_deleted_);
+    table_old_ = table_;
+    num_used_old_ = num_used_;
+    start_old_ = FindEmptySlot(table_old_);
+    cursor_old_ = 0;
+    table_ = HashIndexTable(capacity_new);
+    num_used_ = 0;
+    num_deleted_ = 0;
+  }
+
+  void MigrateHashedKey(uint64_t hashed_key) {
+    uint64_t mask = table_old_.capacity() - 1;
+    uint64_t i = hashed_key & mask;
+    while (table_old_[i].location != kLocationEmpty) {
+      if (table_old_[i].hashed_key == hashed_key && table_old_[i].location != kLocationDeleted) {
+        MigrateSlot(i);
+      }
+      i = (i + 1) & mask;
+    }
+  }
+
+  void MigrateSlots(uint64_t num_slots) {
+    uint64_t capacity_old = table_old_.capacity();
+    uint64_t mask = capacity_old - 1;
+    for (uint64_t n = 0; n < num_slots && cursor_old_ < capacity_old; n++) {
+      uint64_t i = (start_old_ + cursor_old_) & mask;
+      if (IsSlotUsed(table_old_[i])) MigrateSlot(i);
+      cursor_old_ += 1;
+    }
+    if (cursor_old_ >= capacity_old) {
+      table_old_ = HashIndexTable();
+      num_used_old_ = 0;
+    }
+  }
+
+  void MigrateSlot(uint64_t i) {
+    // The slot is marked as deleted and not as empty in the old table, so
+    // that the probe sequences going through it remain valid.
+    InsertInTable(table_, table_old_[i].hashed_key, table_old_[i].location);
+    table_old_.GetWritableSlot(i).location = kLocationDeleted;
+    num_used_ += 1;
+    num_used_old_ -= 1;
+  }
+
+  HashIndexTable table_;
+  uint64_t num_used_;
+  uint64_t num_deleted_;
+
+  // Incremental resize
+  HashIndexTable table_old_;
+  uint64_t num_used_old_;
+  uint64_t cursor_old_;
+  uint64_t start_old_;
+};
+
+
+// ShardedHashIndex splits the index into a power-of-two number of HashIndex
+// shards, selected by the highest bits of the hashed keys -- the lowest bits
+// are used by each shard to find the home slots. All the locations for a
+// given hashed key are in the same shard, and the shards are ordered by
+// hashed keys: iterating over sorted hashed keys visits the shards one after
+// the other.
+//
+// The shards are copy-on-write: ShareShard() makes two indexes point to the
+// same shard, and the first of them to modify it gets its own copy. This is
+// what allows snapshots to be created without reloading the HSTables: they
+// share all the shards of the live index. The copy of a shard only copies the
+// pointers to the pages of its tables, one per 1024 slots, and the copies
+// then share the pages until they modify them. Thus the first flush after a
+// snapshot is created copies at most one 16 KB page per index update, and
+// the memory used by a snapshot only grows with the pages that are modified
+// while it exists.
+//
+// ShardedHashIndex does no locking: it only provides the shard ids, so that
+// the caller can protect each shard independently. A shard can be shared, or
+// unshared by a write, only while the caller holds the lock of that shard.
+class ShardedHashIndex {
+ public:
+  ShardedHashIndex(uint32_t num_shards=1) {
+    num_shards_ = 1;
+    shift_ = 64;
+    while (num_shards_ < num_shards && num_shards_ < kNumShardsMaximum) {
+      num_shards_ <<= 1;
+      shift_ -= 1;
+    }
+    shards_.reserve(num_shards_);
+    for (uint32_t i = 0; i < num_shards_; i++) {
+      shards_.push_back(std::make_shared<HashIndex>());
+    }
+  }
+
+  uint32_t num_shards() const { return num_shards_; }
+
+  uint32_t GetShardId(uint64_t hashed_key) const {
+    // Shifting a 64-bit integer by 64 is undefined behavior
+    if (num_shards_ == 1) return 0;
+    return hashed_key >> shift_;
+  }
+
+  const HashIndex& shard(uint32_t shardid) const { return *shards_[shardid]; }
+
+  // Makes shard 'shardid' of this index the same as the one of 'index', which
+  // must have the same number of shards.
+  void ShareShard(const ShardedHashIndex& index, uint32_t shardid) {
+    shards_[shardid] = index.shards_[shardid];
+  }
+
+  void Insert(uint64_t hashed_key, uint64_t location) {
+    GetWritableShard(GetShardId(hashed_key))->Insert(hashed_key, location);
+  }
+
+  void GetLocations(uint64_t hashed_key, std::vector<uint64_t>* locations_out) const {
+    shards_[GetShardId(hashed_key)]->GetLocations(hashed_key, locations_out);
+  }
+
+  bool GetLastLocation(uint64_t hashed_key, uint64_t* location_out) const {
+    return shards_[GetShardId(hashed_key)]->GetLastLocation(hashed_key, location_out);
+  }
+
+  void Erase(uint64_t hashed_key) {
+    GetWritableShard(GetShardId(hashed_key))->Erase(hashed_key);
+  }
+
+  void ClearShard(uint32_t shardid) {
+    if (IsShardShared(shardid)) {
+      // No need to copy data that is about to be dropped
+      shards_[shardid] = std::make_shared<HashIndex>();
+    } else {
+      shards_[shardid]->clear();
+    }
+  }
+
+  void clear() {
+    for (uint32_t i = 0; i < num_shards_; i++) ClearShard(i);
+  }
+
+  uint64_t size() const {
+    uint64_t size = 0;
+    for (uint32_t i = 0; i < num_shards_; i++) size += shards_[i]->size();
+    return size;
+  }
+
+  bool empty() const { return size() == 0; }
+
+ private:
+  static const uint32_t kNumShardsMaximum = 65536;
+
+  ShardedHashIndex(const ShardedHashIndex&);
+  ShardedHashIndex& operator=(const ShardedHashIndex&);
+
+  bool IsShardShared(uint32_t shardid) const {
+    if (shards_[shardid].use_count() > 1) return true;
+    // The other owners may have released the shard right before, and the
+    // shard is about to be written: their last reads must happen before.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return false;
+  }
+
+  HashIndex* GetWritableShard(uint32_t shardid) {
+    if (IsShardShared(shardid)) {
+      log::trace("ShardedHashIndex::GetWritableShard()", "copy of shard %u", shardid);
+      shards_[shardid] = std::make_shared<HashIndex>(*shards_[shardid]);
+    }
+    return shards_[shardid].get();
+  }
+
+  std::vector< std::shared_ptr<HashIndex> > shards_;
+  uint32_t num_shards_;
+  uint32_t shift_;
+};
+
+} // namespace kdb
+
+#endif // KINGDB_HASH_INDEX_H_
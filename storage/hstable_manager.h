@@ -8,6 +8,7 @@
 #include "util/debug.h"
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <chrono>
 #include <vector>
 #include <map>
@@ -28,9 +29,10 @@
 #include "util/order.h"
 #include "util/byte_array.h"
 #include "util/file.h"
+#include "util/io_engine.h"
 #include "algorithm/crc32c.h"
-#include "algorithm/hash.h"
 #include "storage/format.h"
+#include "storage/hash_index.h"
 #include "storage/resource_manager.h"
 
 
@@ -42,14 +44,27 @@ namespace kdb {
 // that entry, and the offset where the entry can be found in the file.
 // The Offset Array can be used to quickly build a hash table in memory,
 // mapping hashed keys to locations in HSTables.
+//
+// An HSTableManager created with a parent is a writer lane: it has its own
+// current HSTable and write buffers, so that it can write in parallel with
+// the other lanes, but it shares the file resources and the file id and
+// timestamp sequences of its parent.
 class HSTableManager {
  public:
-  HSTableManager() {
+  HSTableManager()
+      : hstable_manager_parent_(nullptr),
+        file_resource_manager(file_resource_manager_own_) {
     is_closed_ = true;
     is_read_only_ = true;
     has_file_ = false;
     buffer_has_items_ = false;
     has_sync_option_ = false;
+    fd_direct_ = -1;
+    io_engine_ = nullptr;
+    ticket_last_write_ = 0;
+    dirid_fixed_ = -1;
+    num_files_loaded_checkpoint_ = 0;
+    num_files_loaded_scan_ = 0;
   }
 
   HSTableManager(DatabaseOptions& db_options,
@@ -58,7 +73,8 @@ class HSTableManager {
                  std::string prefix_compaction,
                  std::string dirpath_locks,
                  FileType filetype_default,
-                 bool read_only=false)
+                 bool read_only=false,
+                 HSTableManager* hstable_manager_parent=nullptr)
       : db_options_(db_options),
         is_read_only_(read_only),
         filetype_default_(filetype_default),
@@ -68,23 +84,44 @@ class HSTableManager {
         prefix_(prefix),
         prefix_compaction_(prefix_compaction),
         dirpath_locks_(dirpath_locks),
-        wait_until_can_open_new_files_(false) {
+        wait_until_can_open_new_files_(false),
+        hstable_manager_parent_(hstable_manager_parent),
+        file_resource_manager(hstable_manager_parent != nullptr ? hstable_manager_parent->file_resource_manager : file_resource_manager_own_) {
+    fd_direct_ = -1;
+    io_engine_ = nullptr;
+    ticket_last_write_ = 0;
     log::trace("HSTableManager::HSTableManager()", "dbname:%s prefix:%s", dbname.c_str(), prefix.c_str());
     dbname_ = dbname;
-    hash_ = MakeHash(db_options.hash);
+    // The paths are validated by Database::Open() before the storage engine
+    // is created
+    if (!ParseDirpaths(dbname, db_options.storage__paths, &dirpaths_).IsOK()) {
+      log::emerg("HSTableManager::HSTableManager()", "Invalid storage paths [%s]", db_options.storage__paths.c_str());
+      dirpaths_.assign(1, dbname);
+    }
+    dirid_fixed_ = -1;
+    num_files_loaded_checkpoint_ = 0;
+    num_files_loaded_scan_ = 0;
     Reset();
     if (!is_read_only_) {
-      buffer_raw_ = new char[size_block_*2];
+      // The buffer is aligned so that it can be used for direct I/O
+      if (posix_memalign(reinterpret_cast<void**>(&buffer_raw_), kSizeDirectIOAlignment, size_block_*2) != 0) {
+        buffer_raw_ = nullptr;
+        log::emerg("HSTableManager::HSTableManager()", "Could not allocate the write buffer");
+      }
       buffer_index_ = new char[size_block_*2];
+      io_engine_ = MakeIOEngine(db_options_.storage__io_engine);
     }
   }
 
   ~HSTableManager() {
     Close();
+    // The engine is kept until the end, as the index updates may still wait
+    // for writes while the manager is being closed
+    delete io_engine_;
   }
 
   void Reset() {
-    file_resource_manager.Reset();
+    if (hstable_manager_parent_ == nullptr) file_resource_manager.Reset();
     sequence_fileid_ = 0;
     sequence_timestamp_ = 0;
     size_block_ = db_options_.storage__hstable_size;
@@ -102,9 +139,8 @@ class HSTableManager {
     is_closed_ = true;
     FlushCurrentFile();
     CloseCurrentFile();
-    delete hash_;
     if (!is_read_only_) {
-      delete[] buffer_raw_;
+      free(buffer_raw_);
       delete[] buffer_index_;
     }
   }
@@ -114,7 +150,76 @@ class HSTableManager {
   }
 
   std::string GetFilepath(uint32_t fileid) {
-    return dbname_ + "/" + prefix_ + HSTableManager::num_to_hex(fileid); // TODO: optimize here
+    return dirpaths_[GetDirectoryId(fileid)] + "/" + prefix_ + HSTableManager::num_to_hex(fileid); // TODO: optimize here
+  }
+
+  // The HSTables are spread over the directories in a round-robin fashion
+  // based on their file ids. The files found in another directory when the
+  // database is loaded, and the files moved there by a compaction, have their
+  // directory stored in the file resource manager.
+  uint32_t GetDirectoryId(uint32_t fileid) {
+    if (dirpaths_.size() == 1) return 0;
+    if (dirid_fixed_ >= 0) return dirid_fixed_;
+    return file_resource_manager.GetFileDirectory(fileid, fileid % dirpaths_.size());
+  }
+
+  // Makes all the files of this manager go to the same directory, which the
+  // compaction uses so that its files can be renamed in place
+  void SetFixedDirectory(int32_t dirid) {
+    dirid_fixed_ = dirid;
+  }
+
+  // Number of HSTables whose locations were taken from the index checkpoint,
+  // and number of HSTables that were read, by the last call to LoadDatabase()
+  uint64_t GetNumFilesLoadedFromCheckpoint() { return num_files_loaded_checkpoint_; }
+  uint64_t GetNumFilesLoadedFromScan() { return num_files_loaded_scan_; }
+
+  const std::vector<std::string>& GetDirpaths() {
+    return dirpaths_;
+  }
+
+  // Parses 'paths', a comma-separated list of directories, into
+  // 'dirpaths_out', or uses the database directory if 'paths' is empty. The
+  // whitespace around each directory and its trailing slashes are removed,
+  // except for the root directory. An empty entry, or a directory listed
+  // more than once, is an error.
+  static Status ParseDirpaths(const std::string& dbname,
+                              const std::string& paths,
+                              std::vector<std::string>* dirpaths_out) {
+    dirpaths_out->clear();
+    if (paths.find_first_not_of(" \t") == std::string::npos) {
+      dirpaths_out->push_back(dbname);
+      return Status::OK();
+    }
+    size_t start = 0;
+    while (start <= paths.size()) {
+      size_t end = paths.find(',', start);
+      if (end == std::string::npos) end = paths.size();
+      size_t first = start;
+      size_t last = end;
+      while (first < last && (paths[first] == ' ' || paths[first] == '\t')) first++;
+      while (last > first && (paths[last - 1] == ' ' || paths[last - 1] == '\t')) last--;
+      while (last > first + 1 && paths[last - 1] == '/') last--;
+      if (first == last) {
+        return Status::InvalidArgument("Invalid storage paths", "empty directory in [" + paths + "]");
+      }
+      std::string dirpath = paths.substr(first, last - first);
+      if (std::find(dirpaths_out->begin(), dirpaths_out->end(), dirpath) != dirpaths_out->end()) {
+        return Status::InvalidArgument("Invalid storage paths", "directory [" + dirpath + "] is listed more than once");
+      }
+      dirpaths_out->push_back(dirpath);
+      start = end + 1;
+    }
+    return Status::OK();
+  }
+
+  // Removes the files starting with 'prefix' from all the directories
+  Status RemoveFilesWithPrefix(const std::string& prefix) {
+    for (auto& dirpath: dirpaths_) {
+      Status s = FileUtil::remove_files_with_prefix(dirpath.c_str(), prefix);
+      if (!s.IsOK()) return s;
+    }
+    return Status::OK();
   }
 
   std::string GetLockFilepath(uint32_t fileid) {
@@ -128,14 +233,25 @@ class HSTableManager {
     log::trace("HSTableManager::SetSequenceFileId", "seq:%u", seq);
   }
 
+  // Returns the lowest file id that this manager may still write to: the one
+  // of the current file, or the next one in the sequence.
   uint32_t GetSequenceFileIdForStableId() {
-    std::unique_lock<std::mutex> lock(mutex_sequence_fileid_);
-    uint64_t fileid = sequence_fileid_;
-    if (!has_file_) fileid += 1;
-    return fileid;
+    if (has_file_) return fileid_;
+    return GetSequenceFileId() + 1;
+  }
+
+  bool HasFile() {
+    return has_file_;
+  }
+
+  // Returns the id of the current file, or of the last file written to if
+  // there is no current file
+  uint32_t GetFileId() {
+    return fileid_;
   }
 
   uint32_t GetSequenceFileId() {
+    if (hstable_manager_parent_ != nullptr) return hstable_manager_parent_->GetSequenceFileId();
     std::unique_lock<std::mutex> lock(mutex_sequence_fileid_);
     return sequence_fileid_;
   }
@@ -171,6 +287,19 @@ class HSTableManager {
     sequence_timestamp_ = seq;
   }
 
+  // Increments the file id and timestamp sequences at once for a new file, so
+  // that the files opened concurrently by the writer lanes have timestamps in
+  // the same order as their file ids. Returns the file id.
+  uint32_t IncrementSequences(uint64_t* timestamp_out) {
+    if (hstable_manager_parent_ != nullptr) return hstable_manager_parent_->IncrementSequences(timestamp_out);
+    std::unique_lock<std::mutex> lock_fileid(mutex_sequence_fileid_);
+    std::unique_lock<std::mutex> lock_timestamp(mutex_sequence_timestamp_);
+    sequence_fileid_ += 1;
+    if (!is_locked_sequence_timestamp_) sequence_timestamp_ += 1;
+    *timestamp_out = sequence_timestamp_;
+    return sequence_fileid_;
+  }
+
 
   static std::string num_to_hex(uint64_t num) {
     char buffer[20];
@@ -184,12 +313,13 @@ class HSTableManager {
     return num;
   }
 
-  uint32_t GetHighestStableFileId(uint32_t fileid_start) {
+  // 'fileid_max' is the lowest file id that may still be written to, by any
+  // of the writer lanes
+  uint32_t GetHighestStableFileId(uint32_t fileid_start, uint32_t fileid_max) {
     // TODO: Extract the HSTable repair logic out of this method. This method
     // should only be computing the highest stable file id, and not do anything
     // else than that. I took this implementation shortcut to get the first beta
     // version out asap, this needs to be cleaned up at some point.
-    uint32_t fileid_max = GetSequenceFileIdForStableId(); //GetSequenceFileId();
     uint32_t fileid_stable = 0;
     uint32_t fileid_candidate = fileid_start;
     uint64_t epoch_now = file_resource_manager.GetEpochNow();
@@ -259,10 +389,10 @@ class HSTableManager {
 
   void OpenNewFile() {
     log::trace("HSTableManager::OpenNewFile()", "Opening file (before) [%s]: %u", filepath_.c_str(), GetSequenceFileId());
-    IncrementSequenceFileId(1);
-    IncrementSequenceTimestamp(1);
-    filepath_ = GetFilepath(GetSequenceFileId());
-    log::trace("HSTableManager::OpenNewFile()", "Opening file [%s]: %u", filepath_.c_str(), GetSequenceFileId());
+    uint64_t timestamp;
+    uint32_t fileid = IncrementSequences(&timestamp);
+    filepath_ = GetFilepath(fileid);
+    log::trace("HSTableManager::OpenNewFile()", "Opening file [%s]: %u", filepath_.c_str(), fileid);
     while (true) {
       if ((fd_ = open(filepath_.c_str(), O_WRONLY|O_CREAT, 0644)) < 0) {
         log::emerg("HSTableManager::OpenNewFile()", "Could not open file [%s]: %s", filepath_.c_str(), strerror(errno));
@@ -273,10 +403,11 @@ class HSTableManager {
       wait_until_can_open_new_files_ = false;
       break;
     }
+    if (db_options_.storage__direct_io) OpenDirectFile();
 
+    fileid_ = fileid;
+    timestamp_ = timestamp;
     has_file_ = true;
-    fileid_ = GetSequenceFileId();
-    timestamp_ = GetSequenceTimestamp();
 
     // Reserving space for header
     offset_start_ = 0;
@@ -287,6 +418,96 @@ class HSTableManager {
     hstheader.filetype  = filetype_default_;
     hstheader.timestamp = timestamp_;
     HSTableHeader::EncodeTo(&hstheader, &db_options_, buffer_raw_);
+    iovecs_.clear();
+    AppendBuffered(0, offset_end_);
+  }
+
+  void OpenDirectFile() {
+#ifdef O_DIRECT
+    if ((fd_direct_ = open(filepath_.c_str(), O_WRONLY|O_DIRECT)) < 0) {
+      log::warn("HSTableManager::OpenDirectFile()", "Could not open file [%s] with O_DIRECT, using regular writes: %s", filepath_.c_str(), strerror(errno));
+    }
+#else
+    log::warn("HSTableManager::OpenDirectFile()", "Direct I/O is not supported on this platform, using regular writes");
+#endif // O_DIRECT
+  }
+
+  // Writes the bytes of buffer_raw_ from offset_start_ to offset_end_. The
+  // whole blocks are written with direct I/O, and the partial blocks at both
+  // ends are written through the page cache, because the rest of these blocks
+  // is written by other writes: the previous and the next flushes, or the
+  // parts of a multipart entry. Unlike the regular writes, this requires all
+  // the bytes to be in buffer_raw_.
+  int WriteDirect() {
+    uint64_t begin = offset_start_;
+    uint64_t end = offset_end_;
+    uint64_t begin_aligned = (begin + kSizeDirectIOAlignment - 1) / kSizeDirectIOAlignment * kSizeDirectIOAlignment;
+    uint64_t end_aligned = end / kSizeDirectIOAlignment * kSizeDirectIOAlignment;
+    if (begin_aligned >= end_aligned) return WriteBufferRaw(fd_, begin, end);
+    if (   WriteBufferRaw(fd_, begin, begin_aligned) < 0
+        || WriteBufferRaw(fd_, end_aligned, end) < 0) {
+      return -1;
+    }
+    if (WriteBufferRaw(fd_direct_, begin_aligned, end_aligned) < 0) {
+      if (errno != EINVAL) return -1;
+      // The file system accepted O_DIRECT when opening the file, but not for
+      // writing: regular writes are used for the rest of the file
+      log::warn("HSTableManager::WriteDirect()", "Error pwritev() with O_DIRECT, using regular writes: %s", strerror(errno));
+      close(fd_direct_);
+      fd_direct_ = -1;
+      return WriteBufferRaw(fd_, begin_aligned, end_aligned);
+    }
+    return 0;
+  }
+
+  int WriteBufferRaw(int fd, uint64_t begin, uint64_t end) {
+    if (begin == end) return 0;
+    struct iovec iov = { buffer_raw_ + begin, end - begin };
+    return io_engine_->Write(fd, &iov, 1, begin, false);
+  }
+
+  // Adds the 'size' bytes at 'offset' in buffer_raw_ to the next write. The
+  // bytes are at the same offset in buffer_raw_ as in the file, thus
+  // consecutive bytes are merged into a single iovec.
+  void AppendBuffered(uint64_t offset, uint64_t size) {
+    char* data = buffer_raw_ + offset;
+    if (   !iovecs_.empty()
+        && static_cast<char*>(iovecs_.back().iov_base) + iovecs_.back().iov_len == data) {
+      iovecs_.back().iov_len += size;
+      return;
+    }
+    struct iovec iov = { data, size };
+    iovecs_.push_back(iov);
+  }
+
+  // Adds 'data' to the next write, at 'offset' in the file. Small arrays are
+  // copied into buffer_raw_ so that the small entries are written with few
+  // iovecs, and the larger ones are written from where they are, without
+  // being copied: their memory must stay valid until the write is done, see
+  // GetTicketLastWrite().
+  void Append(uint64_t offset, const char* data, uint64_t size) {
+    if (fd_direct_ < 0 && size >= kSizeMinimumZeroCopy) {
+      struct iovec iov = { const_cast<char*>(data), size };
+      iovecs_.push_back(iov);
+      return;
+    }
+    memcpy(buffer_raw_ + offset, data, size);
+    AppendBuffered(offset, size);
+  }
+
+  // The writes of the flushes may still be in flight when the flushes return:
+  // they are done once WaitForWrites() returns for the ticket of the last
+  // write. Until then, the memory of the orders must stay valid, and the
+  // entries must not be made visible.
+  uint64_t GetTicketLastWrite() {
+    return ticket_last_write_;
+  }
+
+  void WaitForWrites(uint64_t ticket) {
+    if (io_engine_ == nullptr) return;
+    if (io_engine_->WaitForWrites(ticket) < 0) {
+      log::emerg("HSTableManager::WaitForWrites()", "Error writing file: %s", strerror(errno));
+    }
   }
 
   bool CanOpenNewFiles() {
@@ -302,9 +523,15 @@ class HSTableManager {
     // be written so that the next database start-up can trigger a recovery process.
     // Same goes with files that had in-progress writes but timed out: their
     // offarray will not be written so that they will be recovered at start-up.
+    // The writes still in flight use fd_ and the memory of buffer_raw_, and
+    // the OffsetArray goes after them
+    WaitForWrites(ticket_last_write_);
     FlushOffsetArray();
 
     close(fd_);
+    if (fd_direct_ >= 0) close(fd_direct_);
+    fd_direct_ = -1;
+    iovecs_.clear();
     buffer_has_items_ = false;
     has_file_ = false;
   }
@@ -315,10 +542,21 @@ class HSTableManager {
     log::trace("HSTableManager::FlushCurrentFile()", "ENTER - fileid_:%d, has_file_:%d, buffer_has_items_:%d", fileid_, has_file_, buffer_has_items_);
     if (has_file_ && buffer_has_items_) {
       log::trace("HSTableManager::FlushCurrentFile()", "has_files && buffer_has_items_ - fileid_:%d", fileid_);
-      if (write(fd_, buffer_raw_ + offset_start_, offset_end_ - offset_start_) < 0) {
-        log::emerg("HSTableManager::FlushCurrentFile()", "Error write(): %s", strerror(errno));
+      // Unless there is something to do between the write and the sync, the
+      // sync is submitted along with the write
+      bool has_sync_with_write = has_sync_option_ && fd_direct_ < 0 && padding == 0;
+      int ret;
+      if (fd_direct_ >= 0) {
+        ret = WriteDirect();
+      } else {
+        ret = io_engine_->WriteAsync(fd_, iovecs_.data(), iovecs_.size(), offset_start_, has_sync_with_write, &ticket_last_write_);
+      }
+      iovecs_.clear();
+      if (ret < 0) {
+        log::emerg("HSTableManager::FlushCurrentFile()", "Error writing file: %s", strerror(errno));
         return 0;
       }
+      if (has_sync_with_write) has_sync_option_ = false;
       file_resource_manager.SetFileSize(fileid_, offset_end_);
       offset_start_ = offset_end_;
       buffer_has_items_ = false;
@@ -341,8 +579,8 @@ class HSTableManager {
 
     if (has_sync_option_) {
       has_sync_option_ = false;
-      if (FileUtil::sync_file(fd_) < 0) {
-        log::emerg("HSTableManager::FlushCurrentFile()", "Error sync_file(): %s", strerror(errno));
+      if (io_engine_->Sync(fd_) < 0) {
+        log::emerg("HSTableManager::FlushCurrentFile()", "Error syncing file: %s", strerror(errno));
       }
     }
 
@@ -436,8 +674,8 @@ class HSTableManager {
     // TODO-30: large files should be pre-allocated. The problem here is that
     // the streaming interface needs to work over a network, thus the
     // pre-allocation can't block or take too long.
-    uint64_t fileid_largefile = IncrementSequenceFileId(1);
-    uint64_t timestamp_largefile = IncrementSequenceTimestamp(1);
+    uint64_t timestamp_largefile;
+    uint64_t fileid_largefile = IncrementSequences(&timestamp_largefile);
     std::string filepath = GetFilepath(fileid_largefile);
     log::trace("HSTableManager::WriteFirstPartLargeOrder()", "filepath:[%s] key:[%s] tid:[0x%08" PRIx64 "]", filepath.c_str(), order.key.ToString().c_str(), order.tid);
     int fd = 0;
@@ -633,6 +871,9 @@ class HSTableManager {
 
     uint64_t location_out = 0;
     struct EntryHeader entry_header;
+    if (order.num_batch_orders_left > 0) {
+      entry_header.SetInBatch(order.num_batch_orders_left == 1);
+    }
 
     if (order.type == OrderType::Put) {
       entry_header.SetTypePut();
@@ -662,8 +903,9 @@ class HSTableManager {
       }
       */
 
-      memcpy(buffer_raw_ + offset_end_ + size_header, order.key.data(), order.key.size());
-      memcpy(buffer_raw_ + offset_end_ + size_header + order.key.size(), order.chunk.data(), order.chunk.size());
+      AppendBuffered(offset_end_, size_header);
+      Append(offset_end_ + size_header, order.key.data(), order.key.size());
+      Append(offset_end_ + size_header + order.key.size(), order.chunk.data(), order.chunk.size());
 
       //map_index[order.key] = fileid_ | offset_end_;
       uint64_t fileid_shifted = fileid_;
@@ -698,9 +940,12 @@ class HSTableManager {
       entry_header.size_key = order.key.size();
       entry_header.size_value = 0;
       entry_header.size_value_compressed = 0;
+      entry_header.size_padding = 0;
+      entry_header.hash = hashed_key;
       entry_header.checksum_content = order.crc32;
       uint32_t size_header = EntryHeader::EncodeTo(db_options_, &entry_header, buffer_raw_ + offset_end_);
-      memcpy(buffer_raw_ + offset_end_ + size_header, order.key.data(), order.key.size());
+      AppendBuffered(offset_end_, size_header);
+      Append(offset_end_ + size_header, order.key.data(), order.key.size());
 
       uint64_t fileid_shifted = fileid_;
       fileid_shifted <<= 32;
@@ -711,17 +956,37 @@ class HSTableManager {
     return location_out;
   }
 
-  void WriteOrdersAndFlushFile(std::vector<Order>& orders, std::multimap<uint64_t, uint64_t>& map_index_out) {
-    for (auto& order: orders) {
-
-      if (offset_end_ > size_block_) {
+  // Appends to 'map_index_out' the hashed key and the location of each entry
+  // completed by the orders, sorted by hashed key. The locations of a same
+  // hashed key stay in the order in which they were written.
+  void WriteOrdersAndFlushFile(std::vector<Order>& orders, std::vector<std::pair<uint64_t, uint64_t>>& map_index_out) {
+    size_t size_map_index_initial = map_index_out.size();
+    uint32_t num_batch_orders_left = 0;
+    for (size_t i = 0; i < orders.size(); i++) {
+      Order& order = orders[i];
+
+      if (num_batch_orders_left == 0 && order.num_batch_orders_left > 0) {
+        // All the entries of a batch go to the same HSTable, thus a new
+        // HSTable is started if the batch does not fit in the current one
+        num_batch_orders_left = order.num_batch_orders_left;
+        uint64_t size_batch = 0;
+        for (size_t j = i; j < i + num_batch_orders_left; j++) {
+          size_batch += EntryHeader::GetSizeMaximum() + orders[j].key.size() + orders[j].chunk.size();
+        }
+        if (   offset_end_ > db_options_.internal__hstable_header_size
+            && offset_end_ + size_batch > size_block_) {
+          log::trace("HSTableManager::WriteOrdersAndFlushFile()", "About to flush before batch - offset_end_: %" PRIu64 " | size_batch: %" PRIu64 " | size_block_: %" PRIu64, offset_end_, size_batch, size_block_);
+          FlushCurrentFile(true, 0);
+        }
+      } else if (num_batch_orders_left == 0 && offset_end_ > size_block_) {
         log::trace("HSTableManager::WriteOrdersAndFlushFile()", "About to flush - offset_end_: %" PRIu64 " | size_key: %d | size_value: %d | size_block_: %" PRIu64, offset_end_, order.key.size(), order.size_value, size_block_);
         FlushCurrentFile(true, 0);
       }
+      if (num_batch_orders_left > 0) num_batch_orders_left -= 1;
 
       if (!has_file_) OpenNewFile();
 
-      uint64_t hashed_key = hash_->HashFunction(order.key.data(), order.key.size());
+      uint64_t hashed_key = order.hashed_key;
       // TODO-13: if the item is self-contained (unique part), then no need to
       //       have size_value space, size_value_compressed is enough.
 
@@ -821,7 +1086,7 @@ class HSTableManager {
       if (order.IsSelfContained() || order.IsLastPart()) {
         log::trace("HSTableManager::WriteOrdersAndFlushFile()", "END OF ORDER key: [%s] size_chunk:%" PRIu64 " offset_chunk: %" PRIu64 " location:%" PRIu64, order.key.ToString().c_str(), order.chunk.size(), order.offset_chunk, location);
         if (location != 0) {
-          map_index_out.insert(std::pair<uint64_t, uint64_t>(hashed_key, location));
+          map_index_out.push_back(std::pair<uint64_t, uint64_t>(hashed_key, location));
         } else {
           log::emerg("HSTableManager", "Avoided catastrophic location error (post-processing last part)"); 
         }
@@ -844,10 +1109,16 @@ class HSTableManager {
     }
     log::trace("HSTableManager::WriteOrdersAndFlushFile()", "end flush");
     FlushCurrentFile(0, 0);
+
+    std::stable_sort(map_index_out.begin() + size_map_index_initial,
+                     map_index_out.end(),
+                     [](const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) {
+                       return a.first < b.first;
+                     });
   }
 
 
-  static Status LoadDatabaseOptionsFromHSTables(std::string& dbname,
+  static Status LoadDatabaseOptionsFromHSTables(const std::vector<std::string>& dirpaths,
                                                 DatabaseOptions* db_options_out,
                                                 std::string& prefix_compaction) {
     // Careful here, code duplication: all of the directory walking and
@@ -858,42 +1129,46 @@ class HSTableManager {
     DIR *directory;
     struct dirent *entry;
     struct stat info;
-    if ((directory = opendir(dbname.c_str())) == NULL) {
-      return Status::IOError("Could not open database directory", dbname.c_str());
-    }
-
     bool found_valid_db_options = false;
-    while ((entry = readdir(directory)) != NULL) {
-      if (strcmp(entry->d_name, DatabaseOptions::GetFilename().c_str()) == 0) continue;
-      if (strcmp(entry->d_name, prefix_compaction.c_str()) == 0) continue;
-      int ret = snprintf(filepath, FileUtil::maximum_path_size(), "%s/%s", dbname.c_str(), entry->d_name);
-      if (ret < 0 || ret >= FileUtil::maximum_path_size()) {
-        log::emerg("HSTableManager::LoadDatabaseOptionsFromHSTables()",
-                  "Filepath buffer is too small, could not build the filepath string for file [%s]", entry->d_name); 
-        continue;
-      }
-      if (stat(filepath, &info) != 0 || !(info.st_mode & S_IFREG)) continue;
-      // Yes, using the default internal__hstable_header_size value from the
-      // object this method is meant to return.
-      if (info.st_size <= (off_t)db_options_out->internal__hstable_header_size) {
-        log::trace("HSTableManager::LoadDatabaseOptionsFromHSTables()",
-                  "file: [%s] only has a header or less, skipping\n", entry->d_name);
-        continue;
+    for (auto& dirpath: dirpaths) {
+      if ((directory = opendir(dirpath.c_str())) == NULL) {
+        return Status::IOError("Could not open database directory", dirpath.c_str());
       }
+      while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, DatabaseOptions::GetFilename().c_str()) == 0) continue;
+        if (strcmp(entry->d_name, prefix_compaction.c_str()) == 0) continue;
+        if (IsIndexCheckpointFile(entry->d_name)) continue;
+        int ret = snprintf(filepath, FileUtil::maximum_path_size(), "%s/%s", dirpath.c_str(), entry->d_name);
+        if (ret < 0 || ret >= FileUtil::maximum_path_size()) {
+          log::emerg("HSTableManager::LoadDatabaseOptionsFromHSTables()",
+                    "Filepath buffer is too small, could not build the filepath string for file [%s]", entry->d_name); 
+          continue;
+        }
+        if (stat(filepath, &info) != 0 || !(info.st_mode & S_IFREG)) continue;
+        // Yes, using the default internal__hstable_header_size value from the
+        // object this method is meant to return.
+        if (info.st_size <= (off_t)db_options_out->internal__hstable_header_size) {
+          log::trace("HSTableManager::LoadDatabaseOptionsFromHSTables()",
+                    "file: [%s] only has a header or less, skipping\n", entry->d_name);
+          continue;
+        }
 
-      Mmap mmap(filepath, info.st_size);
-      if (!mmap.is_valid()) return Status::IOError("Mmap constructor failed");
-      struct HSTableHeader hstheader;
-      struct DatabaseOptions db_options;
-      Status s = HSTableHeader::DecodeFrom(mmap.datafile(), mmap.filesize(), &hstheader, &db_options);
-      if (s.IsOK()) {
-        *db_options_out = db_options;
-        found_valid_db_options = true;
-        break;
-      } else {
-        log::trace("HSTableManager::LoadDatabaseOptionsFromHSTables()",
-                   "file: [%s] has an invalid header, skipping\n", entry->d_name);
+        Mmap mmap(filepath, info.st_size);
+        if (!mmap.is_valid()) return Status::IOError("Mmap constructor failed");
+        struct HSTableHeader hstheader;
+        struct DatabaseOptions db_options;
+        Status s = HSTableHeader::DecodeFrom(mmap.datafile(), mmap.filesize(), &hstheader, &db_options);
+        if (s.IsOK()) {
+          *db_options_out = db_options;
+          found_valid_db_options = true;
+          break;
+        } else {
+          log::trace("HSTableManager::LoadDatabaseOptionsFromHSTables()",
+                     "file: [%s] has an invalid header, skipping\n", entry->d_name);
+        }
       }
+      closedir(directory);
+      if (found_valid_db_options) break;
     }
     if (found_valid_db_options) {
       return Status::OK();
@@ -904,7 +1179,7 @@ class HSTableManager {
 
 
   Status LoadDatabase(std::string& dbname,
-                      std::multimap<uint64_t, uint64_t>& index_se,
+                      ShardedHashIndex& index_se,
                       std::set<uint32_t>* fileids_ignore=nullptr,
                       uint32_t fileid_end=0,
                       std::vector<uint32_t>* fileids_iterator=nullptr) {
@@ -923,7 +1198,7 @@ class HSTableManager {
       }
       */
 
-      s = FileUtil::remove_files_with_prefix(dbname_.c_str(), prefix_compaction_);
+      s = RemoveFilesWithPrefix(prefix_compaction_);
       if (!s.IsOK()) return Status::IOError("Could not clean up previous compaction");
 
       s = DeleteAllLockedFiles(dbname_);
@@ -933,11 +1208,25 @@ class HSTableManager {
       if (!s.IsOK()) return Status::IOError("Could not clean up locks");
     }
 
+    // If there is a valid index checkpoint, the HSTables it covers do not need
+    // to be read: only the ones created after it was written are loaded.
+    // Snapshots only use a subset of the HSTables, thus they always go through
+    // all the files.
+    bool has_checkpoint = false;
+    Mmap mmap_checkpoint;
+    struct IndexCheckpointHeader checkpoint_header;
+    std::map<uint32_t, struct IndexCheckpointFileRow> checkpoint_files;
+    if (!is_read_only_ && fileids_ignore == nullptr && fileid_end == 0) {
+      s = ReadIndexCheckpoint(&mmap_checkpoint, &checkpoint_header, &checkpoint_files);
+      if (s.IsOK()) {
+        has_checkpoint = true;
+      } else {
+        log::trace("HSTableManager::LoadDatabase()", "No valid index checkpoint: %s", s.ToString().c_str());
+      }
+    }
+
     DIR *directory;
     struct dirent *entry;
-    if ((directory = opendir(dbname.c_str())) == NULL) {
-      return Status::IOError("Could not open database directory", dbname.c_str());
-    }
 
     // Sort the fileids by <timestamp, fileid>, so that puts and removes can be
     // applied in the right order.
@@ -956,99 +1245,490 @@ class HSTableManager {
     // file, the maximum timestamp is garanteed to be always increasing and no
     // overlapping will occur.
     std::map<std::string, uint32_t> timestamp_fileid_to_fileid;
+    std::map<uint32_t, std::string> fileids_checkpoint;
     char filepath[FileUtil::maximum_path_size()];
-    char buffer_key[64]; // buffer used to order HSTables when loading a database,
-                         // shouldn't need more than 33 bytes, but rounded up
     uint32_t fileid_max = 0;
     uint64_t timestamp_max = 0;
     uint32_t fileid = 0;
-    while ((entry = readdir(directory)) != NULL) {
-      if (strcmp(entry->d_name, DatabaseOptions::GetFilename().c_str()) == 0) continue;
-      if (strcmp(entry->d_name, prefix_compaction_.c_str()) == 0) continue;
-      int ret = snprintf(filepath, FileUtil::maximum_path_size(), "%s/%s", dbname.c_str(), entry->d_name);
-      if (ret < 0 || ret >= FileUtil::maximum_path_size()) {
-        log::emerg("HSTableManager::LoadDatabase()",
-                  "Filepath buffer is too small, could not build the filepath string for file [%s]", entry->d_name); 
-        continue;
+    for (uint32_t dirid = 0; dirid < dirpaths_.size(); dirid++) {
+      if ((directory = opendir(dirpaths_[dirid].c_str())) == NULL) {
+        return Status::IOError("Could not open database directory", dirpaths_[dirid].c_str());
       }
-      if (stat(filepath, &info) != 0 || !(info.st_mode & S_IFREG)) continue;
-      fileid = HSTableManager::hex_to_num(entry->d_name);
-      if (   fileids_ignore != nullptr
-          && fileids_ignore->find(fileid) != fileids_ignore->end()) {
-        log::trace("HSTableManager::LoadDatabase()",
-                  "Skipping file in fileids_ignore:: [%s] [%lld] [%u]\n",
-                  entry->d_name, info.st_size, fileid);
-        continue;
-      }
-      if (fileid_end != 0 && fileid > fileid_end) {
-        log::trace("HSTableManager::LoadDatabase()",
-                  "Skipping file with id larger than fileid_end (%u): [%s] [%lld] [%u]\n",
-                  fileid, entry->d_name, info.st_size, fileid);
-        continue;
-      }
-      log::trace("HSTableManager::LoadDatabase()",
-                "file: [%s] [%lld] [%u]\n", entry->d_name, info.st_size, fileid);
-      if (info.st_size <= (off_t)db_options_.internal__hstable_header_size) {
+      while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, DatabaseOptions::GetFilename().c_str()) == 0) continue;
+        if (strcmp(entry->d_name, prefix_compaction_.c_str()) == 0) continue;
+        if (IsIndexCheckpointFile(entry->d_name)) continue;
+        int ret = snprintf(filepath, FileUtil::maximum_path_size(), "%s/%s", dirpaths_[dirid].c_str(), entry->d_name);
+        if (ret < 0 || ret >= FileUtil::maximum_path_size()) {
+          log::emerg("HSTableManager::LoadDatabase()",
+                    "Filepath buffer is too small, could not build the filepath string for file [%s]", entry->d_name); 
+          continue;
+        }
+        if (stat(filepath, &info) != 0 || !(info.st_mode & S_IFREG)) continue;
+        fileid = HSTableManager::hex_to_num(entry->d_name);
+        if (   fileids_ignore != nullptr
+            && fileids_ignore->find(fileid) != fileids_ignore->end()) {
+          log::trace("HSTableManager::LoadDatabase()",
+                    "Skipping file in fileids_ignore:: [%s] [%lld] [%u]\n",
+                    entry->d_name, info.st_size, fileid);
+          continue;
+        }
+        if (fileid_end != 0 && fileid > fileid_end) {
+          log::trace("HSTableManager::LoadDatabase()",
+                    "Skipping file with id larger than fileid_end (%u): [%s] [%lld] [%u]\n",
+                    fileid, entry->d_name, info.st_size, fileid);
+          continue;
+        }
         log::trace("HSTableManager::LoadDatabase()",
-                  "file: [%s] only has a header or less, skipping\n", entry->d_name);
-        continue;
+                  "file: [%s] [%lld] [%u]\n", entry->d_name, info.st_size, fileid);
+        if (dirpaths_.size() > 1 && fileid % dirpaths_.size() != dirid) {
+          file_resource_manager.SetFileDirectory(fileid, dirid);
+        }
+        if (info.st_size <= (off_t)db_options_.internal__hstable_header_size) {
+          log::trace("HSTableManager::LoadDatabase()",
+                    "file: [%s] only has a header or less, skipping\n", entry->d_name);
+          continue;
+        }
+
+        if (has_checkpoint) {
+          // HSTables are never modified once they are closed, thus having the
+          // same size as at the time of the checkpoint is enough
+          auto it = checkpoint_files.find(fileid);
+          if (it != checkpoint_files.end() && it->second.filesize == (uint64_t)info.st_size) {
+            fileids_checkpoint[fileid] = filepath;
+            continue;
+          } else if (it != checkpoint_files.end()) {
+            log::trace("HSTableManager::LoadDatabase()", "file: [%s] has a different size than in the index checkpoint", entry->d_name);
+            has_checkpoint = false;
+          }
+        }
+
+        s = AddFileToLoad(filepath, info.st_size, fileid, &timestamp_fileid_to_fileid, &fileid_max, &timestamp_max);
+        if (!s.IsOK()) return s;
       }
+      closedir(directory);
+    }
 
-      Mmap mmap(filepath, info.st_size);
-      if (!mmap.is_valid()) return Status::IOError("Mmap constructor failed");
-      struct HSTableHeader hstheader;
-      Status s = HSTableHeader::DecodeFrom(mmap.datafile(), mmap.filesize(), &hstheader);
-      if (!s.IsOK()) {
-        log::trace("HSTableManager::LoadDatabase()",
-                  "file: [%s] has an invalid header, skipping\n", entry->d_name);
-        continue;
+    // The checkpoint can only be used if all the HSTables it covers are still
+    // there, and if all the other HSTables were created after it.
+    if (has_checkpoint && fileids_checkpoint.size() != checkpoint_files.size()) {
+      log::trace("HSTableManager::LoadDatabase()", "Some files in the index checkpoint are missing");
+      has_checkpoint = false;
+    }
+    if (has_checkpoint && timestamp_fileid_to_fileid.size() > 0) {
+      // The keys are sorted by timestamp first
+      std::string key_min = timestamp_fileid_to_fileid.begin()->first;
+      uint64_t timestamp_min = std::strtoull(key_min.substr(0, 16).c_str(), nullptr, 16);
+      if (timestamp_min <= checkpoint_header.timestamp_max) {
+        log::trace("HSTableManager::LoadDatabase()", "Some files are older than the index checkpoint");
+        has_checkpoint = false;
       }
+    }
 
-      sprintf(buffer_key, "%016" PRIx64 "-%016x", hstheader.timestamp, fileid);
-      std::string key(buffer_key);
-      timestamp_fileid_to_fileid[key] = fileid;
-      fileid_max = std::max(fileid_max, fileid);
-      timestamp_max = std::max(timestamp_max, hstheader.timestamp);
+    if (has_checkpoint) {
+      log::trace("HSTableManager::LoadDatabase()", "Loading index checkpoint: %" PRIu64 " files, %" PRIu64 " entries", checkpoint_header.num_files, checkpoint_header.num_entries);
+      LoadIndexCheckpoint(mmap_checkpoint, checkpoint_header, checkpoint_files, index_se);
+      num_files_loaded_checkpoint_ = fileids_checkpoint.size();
+      fileid_max = std::max(fileid_max, checkpoint_header.fileid_max);
+      timestamp_max = std::max(timestamp_max, checkpoint_header.timestamp_max);
+    } else {
+      for (auto& p: fileids_checkpoint) {
+        s = AddFileToLoad(p.second, checkpoint_files[p.first].filesize, p.first, &timestamp_fileid_to_fileid, &fileid_max, &timestamp_max);
+        if (!s.IsOK()) return s;
+      }
     }
+    mmap_checkpoint.Close();
+    checkpoint_files.clear();
 
+    std::vector<uint32_t> fileids_load;
     for (auto& p: timestamp_fileid_to_fileid) {
       uint32_t fileid = p.second;
       if (fileids_iterator != nullptr) fileids_iterator->push_back(fileid);
-      std::string filepath = GetFilepath(fileid);
-      log::trace("HSTableManager::LoadDatabase()", "Loading file:[%s] with key:[%s]", filepath.c_str(), p.first.c_str());
-      if (stat(filepath.c_str(), &info) != 0) continue;
+      fileids_load.push_back(fileid);
+    }
+    timestamp_fileid_to_fileid.clear();
+    num_files_loaded_scan_ = fileids_load.size();
+    s = LoadFiles(fileids_load, index_se);
+    if (!s.IsOK()) return s;
+
+    if (fileid_max > 0) {
+      SetSequenceFileId(fileid_max);
+      SetSequenceTimestamp(timestamp_max);
+    }
+    return Status::OK();
+  }
+
+  // The OffsetArrays of the HSTables are decoded, or the HSTables are
+  // recovered, by a pool of workers, each producing the locations for one
+  // HSTable at a time. The results are merged into the index by the calling
+  // thread, in the same order as 'fileids', so that the locations of a
+  // hashed key remain ordered from the oldest to the most recent one. The
+  // workers never get too far ahead of the merge, so that the memory used by
+  // the results waiting to be merged remains bounded.
+  Status LoadFiles(std::vector<uint32_t>& fileids, ShardedHashIndex& index_se) {
+    uint64_t num_workers = db_options_.open__parallelism;
+    if (num_workers == 0) num_workers = std::thread::hardware_concurrency();
+    if (num_workers == 0) num_workers = 1;
+    num_workers = std::min(num_workers, (uint64_t)fileids.size());
+
+    struct LoadFilesState state(fileids, num_workers * 4);
+    std::vector<std::thread> workers;
+    for (uint64_t i = 1; i < num_workers; i++) {
+      workers.push_back(std::thread(&HSTableManager::LoadFilesWorker, this, &state));
+    }
+
+    Status s;
+    for (size_t i = 0; i < fileids.size(); i++) {
+      std::unique_lock<std::mutex> lock(state.mutex);
+      while (!state.results[i].is_done) {
+        if (num_workers <= 1 || state.index_next == i) {
+          // No worker is handling this file yet, so the merging thread
+          // loads it itself
+          lock.unlock();
+          LoadFilesWorkerStep(&state);
+          lock.lock();
+        } else {
+          state.cv_merge.wait(lock);
+        }
+      }
+      lock.unlock();
+
+      struct LoadFileResult& result = state.results[i];
+      if (!result.status.IsOK()) {
+        s = result.status;
+        break;
+      }
+      for (auto& p: result.locations) {
+        index_se.Insert(p.hashed_key, p.location);
+      }
+      if (result.is_loaded) {
+        file_resource_manager.SetFileSize(fileids[i], result.filesize);
+        if (result.is_file_large) file_resource_manager.SetFileLarge(fileids[i]);
+        if (result.is_file_compacted) file_resource_manager.SetFileCompacted(fileids[i]);
+      }
+      std::vector<struct HashIndexSlot>().swap(result.locations);
+
+      lock.lock();
+      state.index_merged = i + 1;
+      state.cv_workers.notify_all();
+    }
+
+    state.mutex.lock();
+    state.is_stop_requested = true;
+    state.cv_workers.notify_all();
+    state.mutex.unlock();
+    for (auto& worker: workers) {
+      worker.join();
+    }
+    return s;
+  }
+
+  struct LoadFileResult {
+    LoadFileResult()
+        : is_done(false),
+          is_loaded(false),
+          filesize(0),
+          is_file_large(false),
+          is_file_compacted(false) {
+    }
+    bool is_done;
+    Status status;
+    bool is_loaded;
+    uint64_t filesize;
+    bool is_file_large;
+    bool is_file_compacted;
+    std::vector<struct HashIndexSlot> locations;
+  };
+
+  struct LoadFilesState {
+    LoadFilesState(std::vector<uint32_t>& fileids_in, size_t window_in)
+        : fileids(fileids_in),
+          results(fileids_in.size()),
+          index_next(0),
+          index_merged(0),
+          window(window_in),
+          is_stop_requested(false) {
+    }
+    std::vector<uint32_t>& fileids;
+    std::vector<struct LoadFileResult> results;
+    size_t index_next;
+    size_t index_merged;
+    size_t window;
+    bool is_stop_requested;
+    std::mutex mutex;
+    std::condition_variable cv_workers;
+    std::condition_variable cv_merge;
+  };
+
+  void LoadFilesWorker(struct LoadFilesState* state) {
+    while (true) {
+      std::unique_lock<std::mutex> lock(state->mutex);
+      while (   !state->is_stop_requested
+             && state->index_next < state->fileids.size()
+             && state->index_next >= state->index_merged + state->window) {
+        state->cv_workers.wait(lock);
+      }
+      if (state->is_stop_requested || state->index_next >= state->fileids.size()) return;
+      lock.unlock();
+      LoadFilesWorkerStep(state);
+    }
+  }
+
+  void LoadFilesWorkerStep(struct LoadFilesState* state) {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    if (state->index_next >= state->fileids.size()) return;
+    size_t i = state->index_next++;
+    lock.unlock();
+
+    uint32_t fileid = state->fileids[i];
+    struct LoadFileResult& result = state->results[i];
+    std::string filepath = GetFilepath(fileid);
+    log::trace("HSTableManager::LoadDatabase()", "Loading file:[%s]", filepath.c_str());
+    struct stat info;
+    if (stat(filepath.c_str(), &info) == 0) {
       Mmap mmap(filepath.c_str(), info.st_size);
-      if (!mmap.is_valid()) return Status::IOError("Mmap constructor failed");
-      uint64_t filesize;
-      bool is_file_large, is_file_compacted;
-      s = LoadFile(mmap, fileid, index_se, &filesize, &is_file_large, &is_file_compacted);
-      if (s.IsOK()) { 
-        file_resource_manager.SetFileSize(fileid, filesize);
-        if (is_file_large) file_resource_manager.SetFileLarge(fileid);
-        if (is_file_compacted) file_resource_manager.SetFileCompacted(fileid);
-      } else if (!s.IsOK() && !is_read_only_) {
-        log::warn("HSTableManager::LoadDatabase()", "Could not load index in file [%s], entering recovery mode", filepath.c_str());
-        s = RecoverFile(mmap, fileid, index_se);
-        if (!s.IsOK()) {
-          log::warn("HSTableManager::LoadDatabase()", "Recovery failed for file [%s]", filepath.c_str());
-          mmap.Close();
-          if (std::remove(filepath.c_str()) != 0) {
-            log::emerg("HSTableManager::LoadDatabase()", "Could not remove file [%s]", filepath.c_str());
+      if (!mmap.is_valid()) {
+        result.status = Status::IOError("Mmap constructor failed");
+      } else {
+        Status s = LoadFile(mmap, fileid, &result.locations, &result.filesize, &result.is_file_large, &result.is_file_compacted);
+        if (s.IsOK()) {
+          result.is_loaded = true;
+        } else if (!is_read_only_) {
+          log::warn("HSTableManager::LoadDatabase()", "Could not load index in file [%s], entering recovery mode", filepath.c_str());
+          result.locations.clear();
+          s = RecoverFile(mmap, fileid, &result.locations);
+          if (!s.IsOK()) {
+            log::warn("HSTableManager::LoadDatabase()", "Recovery failed for file [%s]", filepath.c_str());
+            result.locations.clear();
+            mmap.Close();
+            if (std::remove(filepath.c_str()) != 0) {
+              log::emerg("HSTableManager::LoadDatabase()", "Could not remove file [%s]", filepath.c_str());
+            }
           }
         }
       }
     }
-    if (fileid_max > 0) {
-      SetSequenceFileId(fileid_max);
-      SetSequenceTimestamp(timestamp_max);
+
+    lock.lock();
+    result.is_done = true;
+    state->cv_merge.notify_one();
+  }
+
+  Status AddFileToLoad(const std::string& filepath,
+                       uint64_t filesize,
+                       uint32_t fileid,
+                       std::map<std::string, uint32_t>* timestamp_fileid_to_fileid,
+                       uint32_t *fileid_max,
+                       uint64_t *timestamp_max) {
+    char buffer_key[64]; // buffer used to order HSTables when loading a database,
+                         // shouldn't need more than 33 bytes, but rounded up
+    Mmap mmap(filepath, filesize);
+    if (!mmap.is_valid()) return Status::IOError("Mmap constructor failed");
+    struct HSTableHeader hstheader;
+    Status s = HSTableHeader::DecodeFrom(mmap.datafile(), mmap.filesize(), &hstheader);
+    if (!s.IsOK()) {
+      log::trace("HSTableManager::LoadDatabase()",
+                "file: [%s] has an invalid header, skipping\n", filepath.c_str());
+      return Status::OK();
+    }
+
+    sprintf(buffer_key, "%016" PRIx64 "-%016x", hstheader.timestamp, fileid);
+    std::string key(buffer_key);
+    (*timestamp_fileid_to_fileid)[key] = fileid;
+    *fileid_max = std::max(*fileid_max, fileid);
+    *timestamp_max = std::max(*timestamp_max, hstheader.timestamp);
+    return Status::OK();
+  }
+
+
+  static std::string GetIndexCheckpointFilename() {
+    return "index_checkpoint";
+  }
+
+  static bool IsIndexCheckpointFile(const char* filename) {
+    // Also matches the temporary file used while the checkpoint is written
+    std::string filename_checkpoint = GetIndexCheckpointFilename();
+    return (strncmp(filename, filename_checkpoint.c_str(), filename_checkpoint.size()) == 0);
+  }
+
+  Status WriteIndexCheckpoint(const ShardedHashIndex& index_se) {
+    if (is_read_only_) return Status::IOError("Cannot write index checkpoint in read-only mode");
+
+    // HSTables with writes in progress may need a recovery at the next
+    // opening, which can only be done by going through all the files.
+    std::map<uint32_t, uint64_t> filesizes = file_resource_manager.GetFileSizes();
+    for (auto& p: filesizes) {
+      if (file_resource_manager.GetNumWritesInProgress(p.first) > 0) {
+        return Status::IOError("Some HSTables have writes in progress");
+      }
+    }
+
+    std::string filepath = dbname_ + "/" + GetIndexCheckpointFilename();
+    std::string filepath_temp = filepath + ".tmp";
+    int fd = 0;
+    if ((fd = open(filepath_temp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+      return Status::IOError("Could not open index checkpoint file", strerror(errno));
+    }
+
+    // The checkpoint is written by blocks, and its checksum is extended as
+    // the blocks are written
+    std::vector<char> buffer(kSizeBufferIndexCheckpoint);
+    uint64_t offset = 0;
+    uint32_t crc32 = 0;
+    Status s;
+
+    struct IndexCheckpointHeader header;
+    header.fileid_max = GetSequenceFileId();
+    header.timestamp_max = GetSequenceTimestamp();
+    header.num_files = filesizes.size();
+    header.num_entries = index_se.size();
+    offset += IndexCheckpointHeader::EncodeTo(&header, buffer.data());
+
+    for (auto& p: filesizes) {
+      if (offset + IndexCheckpointFileRow::GetFixedSize() > buffer.size()) {
+        s = WriteIndexCheckpointBlock(fd, buffer.data(), offset, &crc32);
+        if (!s.IsOK()) break;
+        offset = 0;
+      }
+      struct IndexCheckpointFileRow row;
+      row.fileid = p.first;
+      row.filesize = p.second;
+      if (file_resource_manager.IsFileLarge(p.first)) {
+        row.filetype = kCompactedLargeType;
+      } else if (file_resource_manager.IsFileCompacted(p.first)) {
+        row.filetype = kCompactedRegularType;
+      } else {
+        row.filetype = kUncompactedRegularType;
+      }
+      offset += IndexCheckpointFileRow::EncodeTo(&row, buffer.data() + offset);
+    }
+
+    for (uint32_t shardid = 0; s.IsOK() && shardid < index_se.num_shards(); shardid++) {
+      for (auto& p: index_se.shard(shardid)) {
+        if (offset + 16 > buffer.size()) {
+          s = WriteIndexCheckpointBlock(fd, buffer.data(), offset, &crc32);
+          if (!s.IsOK()) break;
+          offset = 0;
+        }
+        EncodeFixed64(buffer.data() + offset,     p.hashed_key);
+        EncodeFixed64(buffer.data() + offset + 8, p.location);
+        offset += 16;
+      }
+    }
+
+    if (s.IsOK()) s = WriteIndexCheckpointBlock(fd, buffer.data(), offset, &crc32);
+    if (s.IsOK()) {
+      EncodeFixed32(buffer.data(), crc32);
+      s = WriteIndexCheckpointBlock(fd, buffer.data(), 4, &crc32);
+    }
+    if (s.IsOK() && fdatasync(fd) < 0) {
+      s = Status::IOError("Could not sync index checkpoint file", strerror(errno));
+    }
+    close(fd);
+
+    if (s.IsOK() && std::rename(filepath_temp.c_str(), filepath.c_str()) != 0) {
+      s = Status::IOError("Could not rename index checkpoint file", strerror(errno));
+    }
+    if (!s.IsOK()) {
+      std::remove(filepath_temp.c_str());
+      return s;
+    }
+    log::trace("HSTableManager::WriteIndexCheckpoint()", "files:%" PRIu64 " entries:%" PRIu64, header.num_files, header.num_entries);
+    return Status::OK();
+  }
+
+  Status WriteIndexCheckpointBlock(int fd, const char* buffer, uint64_t size, uint32_t *crc32) {
+    *crc32 = crc32c::Extend(*crc32, buffer, size);
+    uint64_t offset = 0;
+    while (offset < size) {
+      ssize_t ret = write(fd, buffer + offset, size - offset);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        return Status::IOError("Could not write index checkpoint file", strerror(errno));
+      }
+      offset += ret;
+    }
+    return Status::OK();
+  }
+
+  Status ReadIndexCheckpoint(Mmap* mmap,
+                             struct IndexCheckpointHeader* header_out,
+                             std::map<uint32_t, struct IndexCheckpointFileRow>* files_out) {
+    std::string filepath = dbname_ + "/" + GetIndexCheckpointFilename();
+    struct stat info;
+    if (stat(filepath.c_str(), &info) != 0) return Status::NotFound("No index checkpoint");
+    uint64_t filesize = info.st_size;
+    if (filesize < IndexCheckpointHeader::GetFixedSize() + 4) return Status::IOError("Index checkpoint is too small");
+
+    mmap->Open(filepath, filesize);
+    if (!mmap->is_valid()) return Status::IOError("Mmap constructor failed");
+    const char* data = mmap->datafile();
+
+    Status s = IndexCheckpointHeader::DecodeFrom(data, filesize, header_out);
+    if (!s.IsOK()) return s;
+    uint64_t size_expected =   IndexCheckpointHeader::GetFixedSize()
+                             + header_out->num_files * IndexCheckpointFileRow::GetFixedSize()
+                             + header_out->num_entries * 16
+                             + 4;
+    if (filesize != size_expected) return Status::IOError("Index checkpoint has an invalid size");
+
+    uint32_t crc32_stored;
+    GetFixed32(data + filesize - 4, &crc32_stored);
+    uint32_t crc32_computed = crc32c::Value(data, filesize - 4);
+    if (crc32_computed != crc32_stored) return Status::IOError("Index checkpoint has an invalid checksum");
+
+    uint64_t offset = IndexCheckpointHeader::GetFixedSize();
+    for (uint64_t i = 0; i < header_out->num_files; i++) {
+      struct IndexCheckpointFileRow row;
+      IndexCheckpointFileRow::DecodeFrom(data + offset, &row);
+      (*files_out)[row.fileid] = row;
+      offset += IndexCheckpointFileRow::GetFixedSize();
     }
-    closedir(directory);
     return Status::OK();
   }
 
+  void LoadIndexCheckpoint(Mmap& mmap,
+                           struct IndexCheckpointHeader& header,
+                           std::map<uint32_t, struct IndexCheckpointFileRow>& files,
+                           ShardedHashIndex& index_se) {
+    for (auto& p: files) {
+      file_resource_manager.SetFileSize(p.first, p.second.filesize);
+      if (p.second.filetype & kCompactedLargeType) file_resource_manager.SetFileLarge(p.first);
+      if (p.second.filetype & kCompactedRegularType) file_resource_manager.SetFileCompacted(p.first);
+    }
+
+    const char* data = mmap.datafile();
+    uint64_t offset =   IndexCheckpointHeader::GetFixedSize()
+                      + header.num_files * IndexCheckpointFileRow::GetFixedSize();
+    for (uint64_t i = 0; i < header.num_entries; i++) {
+      uint64_t hashed_key, location;
+      GetFixed64(data + offset,     &hashed_key);
+      GetFixed64(data + offset + 8, &location);
+      index_se.Insert(hashed_key, location);
+      offset += 16;
+    }
+  }
+
   static Status LoadFile(Mmap& mmap,
                   uint32_t fileid,
-                  std::multimap<uint64_t, uint64_t>& index_se,
+                  ShardedHashIndex& index_se,
+                  uint64_t *filesize_out=nullptr,
+                  bool *is_file_large_out=nullptr,
+                  bool *is_file_compacted_out=nullptr) {
+    std::vector<struct HashIndexSlot> locations;
+    Status s = LoadFile(mmap, fileid, &locations, filesize_out, is_file_large_out, is_file_compacted_out);
+    for (auto& p: locations) {
+      index_se.Insert(p.hashed_key, p.location);
+    }
+    return s;
+  }
+
+  // Decodes the OffsetArray of a HSTable, and appends its locations to
+  // 'locations_out' in the order in which they need to be inserted into the
+  // index.
+  static Status LoadFile(Mmap& mmap,
+                  uint32_t fileid,
+                  std::vector<struct HashIndexSlot>* locations_out,
                   uint64_t *filesize_out=nullptr,
                   bool *is_file_large_out=nullptr,
                   bool *is_file_compacted_out=nullptr) {
@@ -1075,6 +1755,7 @@ class HSTableManager {
     // The file has a clean footer, load all the offsets in the index
     uint64_t offset_index = footer.offset_indexes;
     struct OffsetArrayRow row;
+    locations_out->reserve(locations_out->size() + footer.num_entries);
     for (uint64_t i = 0; i < footer.num_entries; i++) {
       uint32_t length_row = 0;
       s = OffsetArrayRow::DecodeFrom(mmap.datafile() + offset_index,
@@ -1084,7 +1765,7 @@ class HSTableManager {
       if (!s.IsOK()) return s;
       uint64_t fileid_shifted = fileid;
       fileid_shifted <<= 32;
-      index_se.insert(std::pair<uint64_t, uint64_t>(row.hashed_key, fileid_shifted | row.offset_entry));
+      locations_out->push_back(HashIndexSlot{row.hashed_key, fileid_shifted | row.offset_entry});
       log::trace("LoadFile()",
                 "Add item to index -- hashed_key:[0x%" PRIx64 "] offset:[%u] -- offset_index:[%" PRIu64 "]",
                 row.hashed_key, row.offset_entry, offset_index);
@@ -1100,12 +1781,20 @@ class HSTableManager {
 
   Status RecoverFile(Mmap& mmap,
                      uint32_t fileid,
-                     std::multimap<uint64_t, uint64_t>& index_se) {
+                     std::vector<struct HashIndexSlot>* locations_out) {
     uint32_t offset = db_options_.internal__hstable_header_size;
     std::vector< std::pair<uint64_t, uint32_t> > offarray_current;
     bool has_padding_in_values = false;
     bool has_invalid_entries   = false;
 
+    // The entries of a batch are only recovered once the last entry of the
+    // batch has been found, so that batches are recovered all-or-nothing
+    std::vector< std::pair<uint64_t, uint32_t> > offarray_batch;
+    std::vector<struct HashIndexSlot> locations_batch;
+    bool is_in_batch = false;
+    bool is_batch_valid = true;
+    uint32_t offset_batch = 0;
+
     struct HSTableHeader hstheader;
     Status s = HSTableHeader::DecodeFrom(mmap.datafile(), mmap.filesize(), &hstheader);
     // 1. If the file is a large file, just discard it
@@ -1144,12 +1833,43 @@ class HSTableManager {
         crc32_.stream(mmap.datafile() + offset + 5, size_header + entry_header.size_key + entry_header.size_value_used() - 5);
         is_crc32_valid = (entry_header.checksum_content == crc32_.get());
       }
-      if (!do_checksum_verification || is_crc32_valid) {
+      if (is_in_batch && !entry_header.IsInBatch()) {
+        // The last entry of the previous batch is missing
+        is_in_batch = false;
+        has_invalid_entries = true;
+        offarray_batch.clear();
+        locations_batch.clear();
+      }
+      if (entry_header.IsInBatch() && !is_in_batch) {
+        is_in_batch = true;
+        is_batch_valid = true;
+        offset_batch = offset;
+      }
+
+      uint64_t fileid_shifted = fileid;
+      fileid_shifted <<= 32;
+      if (is_in_batch) {
+        if (!do_checksum_verification || is_crc32_valid) {
+          offarray_batch.push_back(std::pair<uint64_t, uint32_t>(entry_header.hash, offset));
+          locations_batch.push_back(HashIndexSlot{entry_header.hash, fileid_shifted | offset});
+        } else {
+          is_batch_valid = false;
+        }
+        if (entry_header.IsLastInBatch()) {
+          if (is_batch_valid) {
+            offarray_current.insert(offarray_current.end(), offarray_batch.begin(), offarray_batch.end());
+            locations_out->insert(locations_out->end(), locations_batch.begin(), locations_batch.end());
+          } else {
+            has_invalid_entries = true;
+          }
+          is_in_batch = false;
+          offarray_batch.clear();
+          locations_batch.clear();
+        }
+      } else if (!do_checksum_verification || is_crc32_valid) {
         // Valid content, add to index
         offarray_current.push_back(std::pair<uint64_t, uint32_t>(entry_header.hash, offset));
-        uint64_t fileid_shifted = fileid;
-        fileid_shifted <<= 32;
-        index_se.insert(std::pair<uint64_t, uint64_t>(entry_header.hash, fileid_shifted | offset));
+        locations_out->push_back(HashIndexSlot{entry_header.hash, fileid_shifted | offset});
       } else {
         has_invalid_entries = true; 
       }
@@ -1161,8 +1881,16 @@ class HSTableManager {
                  entry_header.hash, offset, do_checksum_verification ? (is_crc32_valid?"OK":"ERROR") : "UNKNOWN", entry_header.checksum_content, crc32_.get());
     }
 
-    // 3. Write a new index at the end of the file with whatever entries could be save
+    // 3. If the file ends with an incomplete batch, the batch is cut out
+    if (is_in_batch) {
+      log::warn("HSTableManager::RecoverFile", "Discarding incomplete batch at offset [%u] in file [%s]", offset_batch, mmap.filepath());
+      offset = offset_batch;
+    }
+
+    // 4. Write a new index at the end of the file with whatever entries could be save
     if (offset > db_options_.internal__hstable_header_size) {
+      // Files can be recovered in parallel, but buffer_index_ is shared
+      std::unique_lock<std::mutex> lock(mutex_recovery_);
       mmap.Close();
       int fd;
       if ((fd = open(mmap.filepath(), O_WRONLY, 0644)) < 0) {
@@ -1202,9 +1930,16 @@ class HSTableManager {
 
     closedir(directory);
 
+    // The directories of the files are not known yet, thus all the
+    // directories are tried
+    struct stat info;
     for (auto& fileid: fileids) {
-      if (std::remove(GetFilepath(fileid).c_str()) != 0) {
-        log::emerg("DeleteAllLockedFiles()", "Could not remove data file [%s]", GetFilepath(fileid).c_str());
+      for (auto& dirpath: dirpaths_) {
+        std::string filepath = dirpath + "/" + prefix_ + HSTableManager::num_to_hex(fileid);
+        if (stat(filepath.c_str(), &info) != 0) continue;
+        if (std::remove(filepath.c_str()) != 0) {
+          log::emerg("DeleteAllLockedFiles()", "Could not remove data file [%s]", filepath.c_str());
+        }
       }
     }
 
@@ -1215,13 +1950,15 @@ class HSTableManager {
   uint64_t static get_magic_number() { return 0x4d454f57; }
 
  private:
+  static const uint64_t kSizeBufferIndexCheckpoint = 1024*1024; // bytes
+
   // Options
   DatabaseOptions db_options_;
-  Hash *hash_;
   bool is_read_only_;
   bool is_closed_;
   FileType filetype_default_;
   std::mutex mutex_close_;
+  std::mutex mutex_recovery_;
 
   uint32_t fileid_;
   uint32_t sequence_fileid_;
@@ -1240,17 +1977,37 @@ class HSTableManager {
   uint64_t offset_start_;
   uint64_t offset_end_;
   std::string dbname_;
+  std::vector<std::string> dirpaths_;
+  int32_t dirid_fixed_;
   char *buffer_raw_;
   char *buffer_index_;
   bool buffer_has_items_;
+
+  // The bytes to write to the current file at the next flush, starting at
+  // offset_start_: headers and small arrays in buffer_raw_, and the larger
+  // keys and chunks where they are in the orders
+  std::vector<struct iovec> iovecs_;
+  static const uint64_t kSizeMinimumZeroCopy = 4096;
+
+  // With direct I/O, all the bytes to write are copied into buffer_raw_, and
+  // the whole blocks are written through this second descriptor of the
+  // current file, opened with O_DIRECT. Equal to -1 if direct I/O is not used.
+  int fd_direct_;
+  IOEngine* io_engine_;
+  uint64_t ticket_last_write_;
+  static const uint64_t kSizeDirectIOAlignment = 4096;
   kdb::CRC32 crc32_;
   std::string prefix_;
   std::string prefix_compaction_;
   std::string dirpath_locks_;
   bool wait_until_can_open_new_files_;
+  HSTableManager* hstable_manager_parent_;
+  FileResourceManager file_resource_manager_own_;
+  uint64_t num_files_loaded_checkpoint_;
+  uint64_t num_files_loaded_scan_;
 
  public:
-  FileResourceManager file_resource_manager;
+  FileResourceManager& file_resource_manager;
 
   // key_to_location is made to be dependent on the id of the thread that
   // originated an order, so that if two writers simultaneously write entries
@@ -51,6 +51,7 @@ class FileResourceManager {
     offarrays_.clear();
     has_padding_in_values_.clear();
     epoch_last_activity_.clear();
+    directories_.clear();
   }
 
   void ClearTemporaryDataForFileId(uint32_t fileid) {
@@ -75,6 +76,7 @@ class FileResourceManager {
     filesizes_.erase(fileid);
     largefiles_.erase(fileid);
     compactedfiles_.erase(fileid);
+    directories_.erase(fileid);
   }
 
   uint64_t GetFileSize(uint32_t fileid) {
@@ -97,6 +99,29 @@ class FileResourceManager {
     filesizes_[fileid] = filesize;
   }
 
+  std::map<uint32_t, uint64_t> GetFileSizes() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return filesizes_;
+  }
+
+  // Only the files that are not in their default directory have an entry
+  uint32_t GetFileDirectory(uint32_t fileid, uint32_t dirid_default) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = directories_.find(fileid);
+    if (it == directories_.end()) return dirid_default;
+    return it->second;
+  }
+
+  void SetFileDirectory(uint32_t fileid, uint32_t dirid) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    directories_[fileid] = dirid;
+  }
+
+  std::map<uint32_t, uint32_t> GetFileDirectories() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return directories_;
+  }
+
   bool IsFileLarge(uint32_t fileid) {
     std::unique_lock<std::mutex> lock(mutex_);
     return (largefiles_.find(fileid) != largefiles_.end());
@@ -163,10 +188,18 @@ class FileResourceManager {
   }
 
   const std::vector< std::pair<uint64_t, uint32_t> > GetOffsetArray(uint32_t fileid) {
+    std::unique_lock<std::mutex> lock(mutex_);
     return offarrays_[fileid];
   }
 
+  std::map<uint32_t, std::vector< std::pair<uint64_t, uint32_t> > > GetOffsetArrays() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return offarrays_;
+  }
+
   void AddOffsetArray(uint32_t fileid, std::pair<uint64_t, uint32_t> p) {
+    // Locked as the writer lanes add to the arrays of their files in parallel
+    std::unique_lock<std::mutex> lock(mutex_);
     offarrays_[fileid].push_back(p);
   }
 
@@ -217,6 +250,7 @@ class FileResourceManager {
   std::map<uint32_t, std::vector< std::pair<uint64_t, uint32_t> > > offarrays_;
   std::set<uint32_t> has_padding_in_values_;
   std::map<uint32_t, uint64_t> epoch_last_activity_;
+  std::map<uint32_t, uint32_t> directories_;
   uint64_t dbsize_total_;
   uint64_t dbsize_uncompacted_;
 };
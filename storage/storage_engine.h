@@ -12,6 +12,8 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <deque>
+#include <limits>
 #include <algorithm>
 #include <cstdio>
 #include <cinttypes>
@@ -31,12 +33,15 @@
 #include "util/filepool.h"
 #include "util/byte_array.h"
 #include "util/file.h"
+#include "util/io_engine.h"
 #include "algorithm/crc32c.h"
 #include "algorithm/hash.h"
 #include "storage/format.h"
+#include "storage/hash_index.h"
 #include "storage/resource_manager.h"
 #include "storage/hstable_manager.h"
 #include "thread/event_manager.h"
+#include "thread/read_write_lock.h"
 
 
 namespace kdb {
@@ -44,24 +49,28 @@ namespace kdb {
 class StorageEngine {
  friend class RegularIterator;
  friend class SequentialIterator;
+ struct WriterLane;
  public:
   StorageEngine(DatabaseOptions db_options,
                 EventManager *event_manager,
                 std::string dbname,
                 bool read_only=false, // TODO: this should be part of db_options -- sure about that? what options are stored on disk?
                 std::set<uint32_t>* fileids_ignore=nullptr,
-                uint32_t fileid_end=0)
+                uint32_t fileid_end=0,
+                StorageEngine *se_live=nullptr)
       : db_options_(db_options),
         event_manager_(event_manager),
         is_read_only_(read_only),
         prefix_compaction_("compaction_"),
         dirpath_locks_(dbname + "/locks"),
         hstable_manager_(db_options, dbname, "", prefix_compaction_, dirpath_locks_, kUncompactedRegularType, read_only),
+        index_(db_options.index__num_shards),
+        index_compaction_(db_options.index__num_shards),
         hstable_manager_compaction_(db_options, dbname, prefix_compaction_, prefix_compaction_, dirpath_locks_, kCompactedRegularType, read_only) {
     log::trace("StorageEngine:StorageEngine()", "dbname: %s", dbname.c_str());
     dbname_ = dbname;
     fileids_ignore_ = fileids_ignore;
-    num_readers_ = 0;
+    locks_index_ = new ReadWriteLock[index_.num_shards()];
     is_compaction_in_progress_ = false;
     force_compaction_ = false;
     sequence_snapshot_ = 0;
@@ -69,26 +78,54 @@ class StorageEngine {
     is_closed_ = false;
     fs_free_space_ = db_options_.storage__minimum_free_space_accept_orders;
     file_manager_ = std::make_shared<FileManager>();
+    lanes_.push_back(new WriterLane(&hstable_manager_));
     if (!is_read_only_) {
+      for (uint64_t i = 1; i < db_options_.storage__num_lanes; i++) {
+        HSTableManager *hstable_manager = new HSTableManager(db_options_, dbname, "", prefix_compaction_, dirpath_locks_, kUncompactedRegularType, false, &hstable_manager_);
+        lanes_.push_back(new WriterLane(hstable_manager));
+      }
+      for (size_t i = 1; i < lanes_.size(); i++) {
+        lanes_[i]->thread = std::thread(&StorageEngine::ProcessingLoopLane, this, lanes_[i]);
+      }
       thread_index_ = std::thread(&StorageEngine::ProcessingLoopIndex, this);
       thread_data_ = std::thread(&StorageEngine::ProcessingLoopData, this);
       thread_compaction_ = std::thread(&StorageEngine::ProcessingLoopCompaction, this);
       thread_statistics_ = std::thread(&StorageEngine::ProcessingLoopStatistics, this);
     }
     hash_ = MakeHash(db_options.hash);
+    // The snapshots read from the memory-mapped files, so that each of them
+    // does not set up a ring of its own
+    io_engine_read_ = nullptr;
+    if (!is_read_only_ && db_options_.storage__io_engine != kIOEngineSyscall) {
+      io_engine_read_ = MakeIOEngine(db_options_.storage__io_engine);
+    }
     if (!is_read_only_) {
       fileids_iterator_ = nullptr;
     } else {
       fileids_iterator_ = new std::vector<uint32_t>();
     }
-    Status s = hstable_manager_.LoadDatabase(dbname, index_, fileids_ignore_, fileid_end, fileids_iterator_);
+    is_index_loaded_ = false;
+    Status s;
+    if (se_live != nullptr) {
+      // Snapshot of a live database: no need to go through the files
+      s = se_live->ShareIndexWithSnapshot(this);
+    } else {
+      s = hstable_manager_.LoadDatabase(dbname, index_, fileids_ignore_, fileid_end, fileids_iterator_);
+    }
+    if (s.IsOK()) is_index_loaded_ = true;
     if (!s.IsOK()) {
       log::emerg("StorageEngine", "Could not load database: [%s]", s.ToString().c_str());
       Close();
     }
   }
 
-  ~StorageEngine() {}
+  ~StorageEngine() {
+    delete[] locks_index_;
+    for (size_t i = 0; i < lanes_.size(); i++) {
+      if (i > 0) delete lanes_[i]->hstable_manager;
+      delete lanes_[i];
+    }
+  }
 
   static std::string GetCompactionFilePrefix() {
     return "compaction_"; 
@@ -100,19 +137,25 @@ class StorageEngine {
     is_closed_ = true;
 
     // Wait for readers to exit
-    AcquireWriteLock();
-    hstable_manager_.Close();
+    AcquireAllIndexWriteLocks();
+    mutex_data_.lock();
+    for (auto lane: lanes_) lane->hstable_manager->Close();
     Stop();
-    ReleaseWriteLock();
+    mutex_data_.unlock();
+    ReleaseAllIndexWriteLocks();
 
     if (!is_read_only_) {
       log::trace("StorageEngine::Close()", "join start");
-      event_manager_->update_index.NotifyWait(); // notifies ProcessingLoopIndex()
-      event_manager_->flush_buffer.NotifyWait(); // notifies ProcessingLoopData()
+      event_manager_->update_index.Close();      // notifies ProcessingLoopIndex()
+      event_manager_->flush_buffer.Close();      // notifies ProcessingLoopData()
       cv_statistics_.notify_all();               // notifies ProcessingLoopStatistics()
       cv_loop_compaction_.notify_all();          // notifies ProcessingLoopCompaction()
       thread_index_.join();
       thread_data_.join();
+      for (size_t i = 1; i < lanes_.size(); i++) {
+        lanes_[i]->orders.Close();               // notifies ProcessingLoopLane()
+        lanes_[i]->thread.join();
+      }
       thread_compaction_.join();
       thread_statistics_.join();
       Status s = ReleaseAllSnapshots();
@@ -120,6 +163,16 @@ class StorageEngine {
         log::emerg("StorageEngine::Close()", s.ToString().c_str());
       }
       log::trace("StorageEngine::Close()", "join end");
+
+      // All the threads are stopped, thus the index can be saved as is. If a
+      // compaction was interrupted, index_compaction_ was not poured into
+      // index_, and the next opening will have to go through all the files.
+      if (is_index_loaded_ && !is_compaction_in_progress_) {
+        s = hstable_manager_.WriteIndexCheckpoint(index_);
+        if (!s.IsOK()) {
+          log::warn("StorageEngine::Close()", "Could not write index checkpoint: %s", s.ToString().c_str());
+        }
+      }
     }
 
     if (fileids_ignore_ != nullptr) {
@@ -131,11 +184,15 @@ class StorageEngine {
     }
 
     delete hash_;
+    delete io_engine_read_;
 
     log::trace("StorageEngine::Close()", "done");
   }
 
   bool IsStopRequested() { return stop_requested_; }
+
+  uint64_t GetNumFilesLoadedFromCheckpoint() { return hstable_manager_.GetNumFilesLoadedFromCheckpoint(); }
+  uint64_t GetNumFilesLoadedFromScan() { return hstable_manager_.GetNumFilesLoadedFromScan(); }
   void Stop() {
     stop_requested_ = true;
   }
@@ -144,7 +201,13 @@ class StorageEngine {
     std::chrono::milliseconds duration(db_options_.storage__statistics_polling_interval);
     while (true) {
       std::unique_lock<std::mutex> lock(mutex_statistics_);
-      fs_free_space_ = FileUtil::fs_free_space(dbname_.c_str());
+      // The new HSTables go to all the directories, thus the free space is
+      // the one of the fullest file system
+      uint64_t fs_free_space = std::numeric_limits<uint64_t>::max();
+      for (auto& dirpath: hstable_manager_.GetDirpaths()) {
+        fs_free_space = std::min(fs_free_space, (uint64_t)FileUtil::fs_free_space(dirpath.c_str()));
+      }
+      fs_free_space_ = fs_free_space;
       cv_statistics_.wait_for(lock, duration);
       if (IsStopRequested()) return;
     }
@@ -155,11 +218,28 @@ class StorageEngine {
     return fs_free_space_;
   }
 
+  uint32_t GetDirectoryIdWithMostFreeSpace() {
+    const std::vector<std::string>& dirpaths = hstable_manager_.GetDirpaths();
+    uint32_t dirid_best = 0;
+    int64_t fs_free_space_best = -1;
+    for (uint32_t dirid = 0; dirid < dirpaths.size(); dirid++) {
+      int64_t fs_free_space = FileUtil::fs_free_space(dirpaths[dirid].c_str());
+      if (fs_free_space > fs_free_space_best) {
+        dirid_best = dirid;
+        fs_free_space_best = fs_free_space;
+      }
+    }
+    return dirid_best;
+  }
+
   Status FileSystemStatus() {
     if (GetFreeSpace() < db_options_.storage__minimum_free_space_accept_orders) {
       return Status::IOError("Not enough free space on the file system");
-    } else if (!hstable_manager_.CanOpenNewFiles()) {
-      return Status::IOError("Cannot open new files");
+    }
+    for (auto lane: lanes_) {
+      if (!lane->hstable_manager->CanOpenNewFiles()) {
+        return Status::IOError("Cannot open new files");
+      }
     }
     return Status::OK();
   }
@@ -207,8 +287,10 @@ class StorageEngine {
         size_compaction = db_options_.compaction__filesystem__survival_batch_size;
       }
  
-      // Only files that are no longer taking incoming updates can be compacted
-      uint32_t fileid_end = hstable_manager_.GetHighestStableFileId(fileid_lastcompacted + 1);
+      // Only files that are no longer taking incoming updates, and whose
+      // entries are all in the index, can be compacted
+      uint32_t fileid_end = hstable_manager_.GetHighestStableFileId(fileid_lastcompacted + 1, GetSequenceFileIdForStableId());
+      fileid_end = std::min(fileid_end, GetHighestIndexedFileId());
       
       uint64_t dbsize_uncompacted = hstable_manager_.file_resource_manager.GetDbSizeUncompacted();
       log::trace("ProcessingLoopCompaction",
@@ -250,7 +332,7 @@ class StorageEngine {
         // Whether the forced compaction worked or not, success is sent to the
         // requesting method so it can be unblocked.
         int has_compacted_all_files = 1;
-        event_manager_->compaction_status.StartAndBlockUntilDone(has_compacted_all_files);
+        event_manager_->compaction_status.StartAndBlockUntilDone(std::move(has_compacted_all_files));
       }
 
       std::unique_lock<std::mutex> lock(mutex_loop_compaction_);
@@ -295,28 +377,221 @@ class StorageEngine {
     while(true) {
       // Wait for orders to process
       log::trace("StorageEngine::ProcessingLoopData()", "start");
-      std::vector<Order> orders = event_manager_->flush_buffer.Wait();
-      if (IsStopRequested()) return;
+      std::vector<Order> orders;
+      if (!event_manager_->flush_buffer.Pop(&orders) || IsStopRequested()) return;
       log::trace("StorageEngine::ProcessingLoopData()", "got %d orders", orders.size());
 
-      // Process orders, and create update map for the index
-      AcquireWriteLock();
-      std::multimap<uint64_t, uint64_t> map_index;
-      hstable_manager_.WriteOrdersAndFlushFile(orders, map_index);
-      ReleaseWriteLock();
+      // Process orders, and create update map for the index.
+      // The readers do not need to be locked out here: the new entries
+      // only become visible once the index is updated.
+      mutex_data_.lock();
+      mutex_flushes_.lock();
+      fileids_start_flushes_.push_back(GetSequenceFileIdForStableId());
+      mutex_flushes_.unlock();
+      std::vector<std::pair<uint64_t, uint64_t>> map_index;
+      if (lanes_.size() == 1) {
+        hstable_manager_.WriteOrdersAndFlushFile(orders, map_index);
+      } else {
+        WriteOrdersWithLanes(orders, map_index);
+      }
+      std::vector<uint64_t> tickets;
+      for (auto lane: lanes_) {
+        tickets.push_back(lane->hstable_manager->GetTicketLastWrite());
+      }
+      mutex_data_.unlock();
+      mutex_flushes_.lock();
+      tickets_flushes_.push_back(tickets);
+      mutex_flushes_.unlock();
+
+      // The writes may still be in flight: ProcessingLoopIndex() waits for
+      // them before applying the index updates, while the next orders are
+      // being written
+      event_manager_->update_index.Push(std::move(map_index));
+    }
+  }
+
+  // Writes the orders with all the writer lanes in parallel. The orders are
+  // assigned to the lanes by hashed key, thus all the entries of a key are
+  // in the HSTables of a single lane, in the order in which they were
+  // written, and the file ids of these HSTables are increasing. The only
+  // exception are the batches: all the entries of a batch must be in the same
+  // HSTable, and when the keys of a batch are spread over multiple lanes, the
+  // batch is written by the lane with the most recent HSTable, after all the
+  // orders that come before it. The other lanes of the batch then hold a
+  // barrier for the keys of the batch: if one of these keys is written again
+  // while the current HSTable of the lane is older than the one of the batch,
+  // the lane first moves on to a new HSTable, so that the file ids keep
+  // following the order in which the entries of every key were written.
+  void WriteOrdersWithLanes(std::vector<Order>& orders,
+                            std::vector<std::pair<uint64_t, uint64_t>>& map_index_out) {
+    uint32_t num_lanes = lanes_.size();
+    std::vector< std::vector<Order> > orders_lanes(num_lanes);
+    std::vector<uint64_t> hashed_keys;
+    std::vector<uint32_t> lanes_group;
+    size_t i = 0;
+    while (i < orders.size()) {
+      // A group is either a single order, or all the orders of a batch
+      size_t size_group = std::max(orders[i].num_batch_orders_left, (uint32_t)1);
+      bool is_single_lane = true;
+      hashed_keys.clear();
+      lanes_group.clear();
+      for (size_t j = i; j < i + size_group; j++) {
+        uint64_t hashed_key = orders[j].hashed_key;
+        hashed_keys.push_back(hashed_key);
+        lanes_group.push_back(hashed_key % num_lanes);
+        if (lanes_group.back() != lanes_group[0]) is_single_lane = false;
+      }
+
+      if (is_single_lane) {
+        uint32_t lane = lanes_group[0];
+        for (size_t j = 0; j < size_group; j++) {
+          CheckBarrier(lanes_[lane], hashed_keys[j]);
+          orders_lanes[lane].push_back(std::move(orders[i + j]));
+        }
+        i += size_group;
+        continue;
+      }
+
+      WriteOrdersInParallel(orders_lanes, map_index_out);
+      std::vector<Order> orders_batch;
+      for (size_t j = i; j < i + size_group; j++) {
+        orders_batch.push_back(std::move(orders[j]));
+      }
+      WriteBatchSpreadOverLanes(orders_batch, hashed_keys, lanes_group, map_index_out);
+      i += size_group;
+    }
+    WriteOrdersInParallel(orders_lanes, map_index_out);
+  }
+
+  void WriteOrdersInParallel(std::vector< std::vector<Order> >& orders_lanes,
+                             std::vector<std::pair<uint64_t, uint64_t>>& map_index_out) {
+    // The lanes are all waiting for orders at this point, thus their files
+    // can be closed from this thread
+    for (uint32_t lane = 0; lane < lanes_.size(); lane++) {
+      if (lanes_[lane]->needs_new_file) MoveToNewFile(lanes_[lane]);
+    }
+    std::vector<bool> has_orders(lanes_.size());
+    for (size_t lane = 1; lane < lanes_.size(); lane++) {
+      has_orders[lane] = !orders_lanes[lane].empty();
+      if (has_orders[lane]) lanes_[lane]->orders.Push(std::move(orders_lanes[lane]));
+      orders_lanes[lane].clear();
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> map_index;
+    if (!orders_lanes[0].empty()) {
+      hstable_manager_.WriteOrdersAndFlushFile(orders_lanes[0], map_index);
+      MergeIndexUpdates(map_index, map_index_out);
+      orders_lanes[0].clear();
+    }
+    for (size_t lane = 1; lane < lanes_.size(); lane++) {
+      if (!has_orders[lane]) continue;
+      map_index.clear();
+      if (!lanes_[lane]->map_index.Pop(&map_index)) continue;
+      MergeIndexUpdates(map_index, map_index_out);
+    }
+  }
+
+  void WriteBatchSpreadOverLanes(std::vector<Order>& orders_batch,
+                                 std::vector<uint64_t>& hashed_keys,
+                                 std::vector<uint32_t>& lanes_group,
+                                 std::vector<std::pair<uint64_t, uint64_t>>& map_index_out) {
+    // The most recent HSTable of all the lanes holds entries more recent than
+    // the ones of the other lanes, unless a large entry has been written since
+    uint32_t lane_batch = 0;
+    for (uint32_t lane = 1; lane < lanes_.size(); lane++) {
+      if (lanes_[lane]->hstable_manager->GetFileId() > lanes_[lane_batch]->hstable_manager->GetFileId()) {
+        lane_batch = lane;
+      }
+    }
+    HSTableManager *hstable_manager = lanes_[lane_batch]->hstable_manager;
+    if (   lanes_[lane_batch]->needs_new_file
+        || hstable_manager->GetFileId() < hstable_manager->GetSequenceFileId()) {
+      MoveToNewFile(lanes_[lane_batch]);
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> map_index;
+    hstable_manager->WriteOrdersAndFlushFile(orders_batch, map_index);
+    if (map_index.empty()) return;
+    uint32_t fileid_batch = map_index[0].second >> 32;
+    MergeIndexUpdates(map_index, map_index_out);
+
+    for (size_t i = 0; i < lanes_group.size(); i++) {
+      if (lanes_group[i] == lane_batch) continue;
+      lanes_[lanes_group[i]]->barriers[hashed_keys[i]] = fileid_batch;
+    }
+  }
+
+  void CheckBarrier(WriterLane *lane, uint64_t hashed_key) {
+    if (lane->barriers.empty()) return;
+    auto it = lane->barriers.find(hashed_key);
+    if (it == lane->barriers.end()) return;
+    // Without a current file, the lane will open a file more recent than the
+    // one of the batch anyway
+    if (   lane->hstable_manager->HasFile()
+        && lane->hstable_manager->GetFileId() < it->second) {
+      lane->needs_new_file = true;
+    }
+    lane->barriers.erase(it);
+  }
+
+  void MoveToNewFile(WriterLane *lane) {
+    lane->hstable_manager->CloseCurrentFile();
+    lane->barriers.clear();
+    lane->needs_new_file = false;
+  }
+
+  // Appends the index updates of a lane, sorted by hashed key, to the ones
+  // already in 'map_index_out' while keeping them sorted. The merge is
+  // stable: the locations of a same hashed key stay in the order in which
+  // they were written.
+  void MergeIndexUpdates(std::vector<std::pair<uint64_t, uint64_t>>& map_index,
+                         std::vector<std::pair<uint64_t, uint64_t>>& map_index_out) {
+    size_t size_initial = map_index_out.size();
+    map_index_out.insert(map_index_out.end(), map_index.begin(), map_index.end());
+    std::inplace_merge(map_index_out.begin(),
+                       map_index_out.begin() + size_initial,
+                       map_index_out.end(),
+                       [](const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) {
+                         return a.first < b.first;
+                       });
+  }
 
-      event_manager_->flush_buffer.Done();
-      event_manager_->update_index.StartAndBlockUntilDone(map_index);
+  void ProcessingLoopLane(WriterLane *lane) {
+    while(true) {
+      std::vector<Order> orders;
+      if (!lane->orders.Pop(&orders)) return;
+      std::vector<std::pair<uint64_t, uint64_t>> map_index;
+      lane->hstable_manager->WriteOrdersAndFlushFile(orders, map_index);
+      lane->map_index.Push(std::move(map_index));
+    }
+  }
+
+  // Returns the lowest file id that any of the writer lanes may still write
+  // to: all the files before it are no longer taking incoming updates.
+  uint32_t GetSequenceFileIdForStableId() {
+    uint32_t fileid = std::numeric_limits<uint32_t>::max();
+    for (auto lane: lanes_) {
+      fileid = std::min(fileid, lane->hstable_manager->GetSequenceFileIdForStableId());
     }
+    return fileid;
   }
 
   void ProcessingLoopIndex() {
     while(true) {
       log::trace("StorageEngine::ProcessingLoopIndex()", "start");
-      std::multimap<uint64_t, uint64_t> index_updates = event_manager_->update_index.Wait();
-      if (IsStopRequested()) return;
+      std::vector<std::pair<uint64_t, uint64_t>> index_updates;
+      if (!event_manager_->update_index.Pop(&index_updates) || IsStopRequested()) return;
       log::trace("StorageEngine::ProcessingLoopIndex()", "got index_updates: %d updates", index_updates.size());
 
+      // The new entries must be on disk before they are visible, and before
+      // the memory of their orders is released by the write buffer
+      mutex_flushes_.lock();
+      std::vector<uint64_t> tickets = tickets_flushes_.front();
+      tickets_flushes_.pop_front();
+      mutex_flushes_.unlock();
+      for (size_t i = 0; i < lanes_.size(); i++) {
+        lanes_[i]->hstable_manager->WaitForWrites(tickets[i]);
+      }
+
       /*
       for (auto& p: index_updates) {
         if (p.second == 0) {
@@ -329,7 +604,10 @@ class StorageEngine {
       }
       */
 
-      std::multimap<uint64_t, uint64_t> *index;
+      // The compaction cannot start or end while a batch of updates is being
+      // applied, so that the batch goes entirely to one index or the other.
+      std::unique_lock<std::mutex> lock_updates(mutex_index_updates_);
+      ShardedHashIndex *index;
       mutex_compaction_.lock();
       if (is_compaction_in_progress_) {
         index = &index_compaction_;
@@ -338,46 +616,70 @@ class StorageEngine {
       }
       mutex_compaction_.unlock();
 
-
+      // The updates are sorted by hashed keys, and therefore grouped by shard:
+      // only the readers of the shard being updated are blocked.
       int num_iterations_per_lock = db_options_.internal__num_iterations_per_lock;
       int counter_iterations = 0;
+      uint32_t shardid_locked = 0;
 
       for (auto& p: index_updates) {
+        uint32_t shardid = index->GetShardId(p.first);
+        if (counter_iterations > 0 && shardid != shardid_locked) {
+          locks_index_[shardid_locked].ReleaseWriteLock();
+          counter_iterations = 0;
+        }
         if (counter_iterations == 0) {
-          AcquireWriteLock();
+          locks_index_[shardid].AcquireWriteLock();
+          shardid_locked = shardid;
         }
         counter_iterations += 1;
 
-        //uint64_t hashed_key = hash_->HashFunction(p.first.c_str(), p.first.size());
         //log::trace("StorageEngine::ProcessingLoopIndex()", "hash [%" PRIu64 "] location [%" PRIu64 "]", p.first, p.second);
-        //mutex_index_.lock();
-        index->insert(std::pair<uint64_t,uint64_t>(p.first, p.second));
-        //mutex_index_.unlock();
+        index->Insert(p.first, p.second);
 
         // Throttling the index updates, and allows other processes
         // to acquire the write lock if they need it
         if (counter_iterations >= num_iterations_per_lock) {
-          ReleaseWriteLock();
+          locks_index_[shardid_locked].ReleaseWriteLock();
           counter_iterations = 0;
         }
       }
-      if (counter_iterations) ReleaseWriteLock();
+      if (counter_iterations) locks_index_[shardid_locked].ReleaseWriteLock();
+      lock_updates.unlock();
 
       /*
       for (auto& p: index_) {
-        log::trace("index_", "hash:[0x%08x] location:[%" PRIu64 "]", p.first, p.second);
+        log::trace("index_", "hash:[0x%08x] location:[%" PRIu64 "]", p.hashed_key, p.location);
       }
       */
 
-      event_manager_->update_index.Done();
+      mutex_flushes_.lock();
+      fileids_start_flushes_.pop_front();
+      mutex_flushes_.unlock();
+
       log::trace("StorageEngine::ProcessingLoopIndex()", "done");
-      int temp = 1;
-      event_manager_->clear_buffer.StartAndBlockUntilDone(temp);
+      event_manager_->clear_buffer.Push(1);
     }
   }
 
+  uint32_t GetHighestIndexedFileId() {
+    // The files from the first one written by the oldest flush still in the
+    // pipeline may have entries that are not yet in the index
+    std::unique_lock<std::mutex> lock(mutex_flushes_);
+    if (fileids_start_flushes_.empty()) return std::numeric_limits<uint32_t>::max();
+    return fileids_start_flushes_.front() - 1;
+  }
+
+  // Computes the hashed key of 'key' with the hash function of the database.
+  // The key of an operation is hashed once when the operation enters the
+  // database, and its hashed key is then passed along.
+  uint64_t HashKey(ByteArray& key) {
+    return hash_->HashFunction(key.data(), key.size());
+  }
+
   Status Get(ReadOptions& read_options,
              ByteArray& key,
+             uint64_t hashed_key,
              ByteArray* value_out,
              uint64_t *location_out=nullptr) {
     // NOTE: There is no monitoring or reference counting for the file used by
@@ -390,11 +692,17 @@ class StorageEngine {
     //       are open: their content will remain available to the file
     //       descriptor holder, and the storage space will be reclaimed when the
     //       file descriptor is closed.
-    mutex_write_.lock();
-    mutex_read_.lock();
-    num_readers_ += 1;
-    mutex_read_.unlock();
-    mutex_write_.unlock();
+
+    // Snapshots first look into the orders that were still in the write
+    // buffer when they were created, which are more recent than the index
+    if (!orders_buffered_.empty()) {
+      uint32_t index_order;
+      Status s = GetFromBufferedOrders(hashed_key, key, value_out, &index_order);
+      if (s.IsOK() || s.IsDeleteOrder()) return s;
+    }
+
+    uint32_t shardid = index_.GetShardId(hashed_key);
+    locks_index_[shardid].AcquireReadLock();
 
     bool has_compaction_index = false;
     mutex_compaction_.lock();
@@ -403,26 +711,246 @@ class StorageEngine {
 
     Status s;
     if (!has_compaction_index) {
-      s = GetWithIndex(read_options, index_, key, value_out, location_out);
+      s = GetWithIndex(read_options, index_, hashed_key, key, value_out, location_out);
     } else {
-      s = GetWithIndex(read_options, index_compaction_, key, value_out, location_out);
+      s = GetWithIndex(read_options, index_compaction_, hashed_key, key, value_out, location_out);
       if (!s.IsOK() && !s.IsDeleteOrder()) {
-        s = GetWithIndex(read_options, index_, key, value_out, location_out);
+        s = GetWithIndex(read_options, index_, hashed_key, key, value_out, location_out);
       }
     }
 
-    mutex_read_.lock();
-    num_readers_ -= 1;
-    log::trace("Get()", "num_readers_: %d", num_readers_);
-    mutex_read_.unlock();
-    cv_read_.notify_one();
-
+    locks_index_[shardid].ReleaseReadLock();
     return s;
   }
 
+  // Looks up a batch of keys. The read locks of the index shards are acquired
+  // once for the whole batch, and the entries are then read in the order of
+  // their locations after their pages have been prefetched, which turns
+  // random lookups into a mostly forward scan of the files. With an
+  // asynchronous I/O engine, the entries are instead read with a single batch
+  // of reads, and the memory-mapped files are only used for what the batch
+  // could not find.
+  void MultiGet(ReadOptions& read_options,
+                std::vector<ByteArray>& keys,
+                std::vector<uint64_t>& hashed_keys,
+                std::vector<ByteArray>* values_out,
+                std::vector<Status>* statuses_out,
+                std::vector<uint64_t>* locations_out) {
+    uint32_t num_keys = keys.size();
+    values_out->assign(num_keys, ByteArray());
+    statuses_out->assign(num_keys, Status::NotFound("Unable to find the entry in the storage engine"));
+    locations_out->assign(num_keys, 0);
+
+    std::vector<bool> is_done(num_keys, false);
+    std::vector<uint32_t> shardids;
+    for (uint32_t i = 0; i < num_keys; i++) {
+      if (!orders_buffered_.empty()) {
+        uint32_t index_order;
+        Status s = GetFromBufferedOrders(hashed_keys[i], keys[i], &(*values_out)[i], &index_order);
+        if (s.IsOK() || s.IsDeleteOrder()) {
+          (*statuses_out)[i] = s;
+          is_done[i] = true;
+          continue;
+        }
+      }
+      shardids.push_back(index_.GetShardId(hashed_keys[i]));
+    }
+
+    // The shard locks are acquired in increasing order of shard id, just like
+    // AcquireAllIndexWriteLocks() does, so that they cannot deadlock.
+    std::sort(shardids.begin(), shardids.end());
+    shardids.erase(std::unique(shardids.begin(), shardids.end()), shardids.end());
+    for (auto shardid: shardids) locks_index_[shardid].AcquireReadLock();
+
+    bool has_compaction_index = false;
+    mutex_compaction_.lock();
+    has_compaction_index = is_compaction_in_progress_;
+    mutex_compaction_.unlock();
+
+    // The candidate locations of each key are tried from the most recent to
+    // the oldest, first in the compaction index if any, like GetWithIndex()
+    // does. The keys are then sorted by the location of their first
+    // candidate, which is the right one unless there is a hash collision.
+    std::vector< std::vector<uint64_t> > candidates(num_keys);
+    std::vector< std::pair<uint64_t, uint32_t> > locations_sorted;
+    for (uint32_t i = 0; i < num_keys; i++) {
+      if (is_done[i]) continue;
+      std::vector<uint64_t> locations;
+      if (has_compaction_index) {
+        index_compaction_.GetLocations(hashed_keys[i], &locations);
+        candidates[i].insert(candidates[i].end(), locations.rbegin(), locations.rend());
+        locations.clear();
+      }
+      index_.GetLocations(hashed_keys[i], &locations);
+      candidates[i].insert(candidates[i].end(), locations.rbegin(), locations.rend());
+      if (!candidates[i].empty()) {
+        locations_sorted.push_back(std::make_pair(candidates[i][0], i));
+      }
+    }
+    std::sort(locations_sorted.begin(), locations_sorted.end());
+
+    std::vector< std::pair<uint32_t, ByteArray> > files;
+    if (io_engine_read_ != nullptr) {
+      ReadLocations(read_options, keys, locations_sorted, values_out, statuses_out, locations_out, &is_done);
+    } else {
+      PrefetchLocations(locations_sorted, &files);
+    }
+
+    auto it_file = files.begin();
+    for (auto& p: locations_sorted) {
+      uint32_t i = p.second;
+      if (is_done[i]) continue;
+      for (auto location: candidates[i]) {
+        ByteArray key_temp;
+        ByteArray value_temp;
+        uint32_t fileid = (location & 0xFFFFFFFF00000000) >> 32;
+        uint32_t offset_file = location & 0x00000000FFFFFFFF;
+        while (it_file != files.end() && it_file->first < fileid) ++it_file;
+        Status s;
+        if (it_file != files.end() && it_file->first == fileid) {
+          s = GetEntryInFile(read_options, it_file->second, offset_file, &key_temp, &value_temp);
+        } else {
+          // Older candidate of a hash collision, in a file that was not
+          // prefetched
+          s = GetEntry(read_options, location, &key_temp, &value_temp);
+        }
+        if ((s.IsOK() || s.IsDeleteOrder()) && key_temp == keys[i]) {
+          (*values_out)[i] = value_temp;
+          (*statuses_out)[i] = s;
+          (*locations_out)[i] = location;
+          break;
+        }
+      }
+    }
+
+    for (auto it = shardids.rbegin(); it != shardids.rend(); ++it) {
+      locks_index_[*it].ReleaseReadLock();
+    }
+  }
+
+  // Reads the entries at the locations, which must be sorted, with one batch
+  // of reads submitted to io_engine_read_. Each read covers the size of a
+  // small entry: the keys whose entry does not fit in its read, or whose
+  // location is a hash collision, are not marked as done in 'is_done', and
+  // must be read from the memory-mapped files by the caller. The file
+  // descriptors are taken from the file pool, which keeps them open across
+  // calls.
+  void ReadLocations(ReadOptions& read_options,
+                     std::vector<ByteArray>& keys,
+                     std::vector< std::pair<uint64_t, uint32_t> >& locations_sorted,
+                     std::vector<ByteArray>* values_out,
+                     std::vector<Status>* statuses_out,
+                     std::vector<uint64_t>* locations_out,
+                     std::vector<bool>* is_done) {
+    static const uint64_t size_read_per_entry = 16 * 1024;
+    std::vector<ReadRequest> requests;
+    std::vector<ByteArray> buffers;
+    std::vector<uint32_t> indexes; // index in locations_sorted of each request
+    std::vector<FileResource> files;
+    bool has_file = false;
+    uint32_t fileid_current = 0;
+    uint64_t filesize = 0;
+    int fd = -1;
+    for (uint32_t k = 0; k < locations_sorted.size(); k++) {
+      uint32_t fileid = (locations_sorted[k].first & 0xFFFFFFFF00000000) >> 32;
+      uint64_t offset_file = locations_sorted[k].first & 0x00000000FFFFFFFF;
+      if (!has_file || fileid != fileid_current) {
+        has_file = true;
+        fileid_current = fileid;
+        filesize = hstable_manager_.file_resource_manager.GetFileSize(fileid);
+        std::string filepath = hstable_manager_.GetFilepath(fileid);
+        FileResource file;
+        fd = -1;
+        if (filesize > 0 && file_manager_->GetFile(fileid, filepath, filesize, &file).IsOK()) {
+          fd = file.fd;
+          files.push_back(file);
+        }
+      }
+      if (fd < 0 || offset_file >= filesize) continue;
+      uint64_t size = std::min(size_read_per_entry, filesize - offset_file);
+      ByteArray buffer = ByteArray::NewAllocatedMemoryByteArray(size);
+      ReadRequest request = { fd, buffer.data(), size, offset_file, 0 };
+      requests.push_back(request);
+      buffers.push_back(buffer);
+      indexes.push_back(k);
+    }
+
+    io_engine_read_->Read(requests);
+
+    for (uint32_t r = 0; r < requests.size(); r++) {
+      if (requests[r].result <= 0) continue;
+      uint64_t location = locations_sorted[indexes[r]].first;
+      uint32_t i = locations_sorted[indexes[r]].second;
+      buffers[r].set_size(requests[r].result);
+      ByteArray key_temp;
+      ByteArray value_temp;
+      Status s = GetEntryInFile(read_options, buffers[r], 0, &key_temp, &value_temp);
+      if ((s.IsOK() || s.IsDeleteOrder()) && key_temp == keys[i]) {
+        (*values_out)[i] = value_temp;
+        (*statuses_out)[i] = s;
+        (*locations_out)[i] = location;
+        (*is_done)[i] = true;
+      }
+    }
+    for (auto& file: files) file_manager_->ReleaseFile(file.fileid, file.filesize);
+  }
+
+  // Asks the kernel to start reading the pages of the entries at the
+  // locations, which must be sorted, so that the reads that follow do not
+  // fault on each page one after the other. The ranges of entries that are
+  // close to each other are merged to save system calls. The files are
+  // returned in 'files_out', sorted by fileid, so that they can be read
+  // without being mapped again.
+  void PrefetchLocations(std::vector< std::pair<uint64_t, uint32_t> >& locations_sorted,
+                         std::vector< std::pair<uint32_t, ByteArray> >* files_out) {
+    static const uint64_t size_page = sysconf(_SC_PAGESIZE);
+    // Covers the header, key and value of small entries, the kernel readahead
+    // takes care of the rest of the larger ones
+    static const uint64_t size_prefetch_per_entry = 16 * 1024;
+    char *mmap = nullptr;
+    uint64_t filesize = 0;
+    uint64_t offset_start = 0; // range to prefetch, not yet sent to the kernel
+    uint64_t offset_end = 0;
+    for (auto& p: locations_sorted) {
+      uint32_t fileid = (p.first & 0xFFFFFFFF00000000) >> 32;
+      uint64_t offset_file = p.first & 0x00000000FFFFFFFF;
+      if (files_out->empty() || fileid != files_out->back().first) {
+        Prefetch(mmap, offset_start, offset_end);
+        mmap = nullptr;
+        offset_start = 0;
+        offset_end = 0;
+        filesize = hstable_manager_.file_resource_manager.GetFileSize(fileid);
+        std::string filepath = hstable_manager_.GetFilepath(fileid);
+        ByteArray file;
+        if (filesize > 0) {
+          file = ByteArray::NewPooledByteArray(file_manager_, fileid, filepath, filesize);
+          mmap = file.data();
+        }
+        files_out->push_back(std::make_pair(fileid, file));
+      }
+      if (mmap == nullptr || offset_file >= filesize) continue;
+      uint64_t offset_start_entry = offset_file - offset_file % size_page;
+      uint64_t offset_end_entry = std::min(offset_file + size_prefetch_per_entry, filesize);
+      if (offset_start_entry > offset_end) {
+        Prefetch(mmap, offset_start, offset_end);
+        offset_start = offset_start_entry;
+      }
+      offset_end = offset_end_entry;
+    }
+    Prefetch(mmap, offset_start, offset_end);
+  }
+
+  void Prefetch(char *mmap, uint64_t offset_start, uint64_t offset_end) {
+    if (mmap == nullptr || offset_start >= offset_end) return;
+    if (madvise(mmap + offset_start, offset_end - offset_start, MADV_WILLNEED) != 0) {
+      log::trace("StorageEngine::Prefetch()", "madvise(): %s", strerror(errno));
+    }
+  }
+
 
   Status GetWithIndex(ReadOptions& read_options,
-                      std::multimap<uint64_t, uint64_t>& index,
+                      ShardedHashIndex& index,
+                      uint64_t hashed_key,
                       ByteArray& key,
                       ByteArray* value_out,
                       uint64_t *location_out=nullptr) {
@@ -431,25 +959,21 @@ class StorageEngine {
     // and location from the index and release the lock right away -- should not
     // be locking while calling GetEntry()
 
-    // NOTE: Since C++11, the relative ordering of elements with equivalent keys
-    //       in a multimap is preserved.
-    uint64_t hashed_key = hash_->HashFunction(key.data(), key.size());
+    // NOTE: The locations for a hashed key are returned in insertion order,
+    //       thus they are tried from the most recent to the oldest.
     //log::trace("StorageEngine::GetWithIndex()", "num entries in index:[%d] content:[%s] size:[%d] hashed_key:[0x%" PRIx64 "]", index.size(), key.ToString().c_str(), key.size(), hashed_key);
 
-    auto range = index.equal_range(hashed_key);
-    if (range.first != range.second) {
-      auto it = --range.second;
-      do {
-        ByteArray key_temp;
-        Status s = GetEntry(read_options, it->second, &key_temp, value_out);
-        //log::trace("StorageEngine::GetWithIndex()", "key:[%s] key_temp:[%s] hashed_key:[0x%" PRIx64 "] hashed_key_temp:[0x%" PRIx64 "] size_key:[%" PRIu64 "] size_key_temp:[%" PRIu64 "]", key.ToString().c_str(), key_temp.ToString().c_str(), hashed_key, it->first, key.size(), key_temp.size());
-        if ((s.IsOK() || s.IsDeleteOrder()) && key_temp == key) {
-          //log::trace("StorageEngine::GetWithIndex()", "Entry [%s] found at location: 0x%08" PRIx64, key.ToString().c_str(), it->second);
-          if (location_out != nullptr) *location_out = it->second;
-          return s;
-        }
-        --it;
-      } while(it != range.first);
+    std::vector<uint64_t> locations;
+    index.GetLocations(hashed_key, &locations);
+    for (auto it = locations.rbegin(); it != locations.rend(); ++it) {
+      ByteArray key_temp;
+      Status s = GetEntry(read_options, *it, &key_temp, value_out);
+      //log::trace("StorageEngine::GetWithIndex()", "key:[%s] key_temp:[%s] hashed_key:[0x%" PRIx64 "] size_key:[%" PRIu64 "] size_key_temp:[%" PRIu64 "]", key.ToString().c_str(), key_temp.ToString().c_str(), hashed_key, key.size(), key_temp.size());
+      if ((s.IsOK() || s.IsDeleteOrder()) && key_temp == key) {
+        //log::trace("StorageEngine::GetWithIndex()", "Entry [%s] found at location: 0x%08" PRIx64, key.ToString().c_str(), *it);
+        if (location_out != nullptr) *location_out = *it;
+        return s;
+      }
     }
     //log::trace("StorageEngine::GetWithIndex()", "%s - not found!", key.ToString().c_str());
     return Status::NotFound("Unable to find the entry in the storage engine");
@@ -459,9 +983,9 @@ class StorageEngine {
   Status GetEntry(ReadOptions& read_options,
                   uint64_t location,
                   ByteArray* key_out,
-                  ByteArray* value_out) {
+                  ByteArray* value_out,
+                  uint64_t* hashed_key_out=nullptr) {
     log::trace("StorageEngine::GetEntry()", "start");
-    Status s = Status::OK();
     // TODO: check that the offset falls into the
     // size of the file, just in case a file was truncated but the index
     // still had a pointer to an entry in at an invalid location --
@@ -472,13 +996,37 @@ class StorageEngine {
     uint32_t offset_file = location & 0x00000000FFFFFFFF;
     uint64_t filesize = 0;
     filesize = hstable_manager_.file_resource_manager.GetFileSize(fileid);
+    if (offset_file >= filesize) {
+      // A snapshot may be iterating over a file that has grown since the
+      // snapshot was created
+      return Status::IOError("Location is beyond the end of the file");
+    }
 
     //log::trace("StorageEngine::GetEntry()", "location:%" PRIu64 " fileid:%u offset_file:%u filesize:%" PRIu64, location, fileid, offset_file, filesize);
     std::string filepath = hstable_manager_.GetFilepath(fileid); // TODO: optimize here
 
     //ByteArray key_temp = NewMmappedByteArray(filepath, filesize);
-    ByteArray key_temp = ByteArray::NewPooledByteArray(file_manager_, fileid, filepath, filesize);
-    ByteArray value_temp = key_temp;
+    ByteArray file = ByteArray::NewPooledByteArray(file_manager_, fileid, filepath, filesize);
+    return GetEntryInFile(read_options, file, offset_file, key_out, value_out, hashed_key_out);
+  }
+
+  // Reads the entry at 'offset_file' in 'file', a pooled byte array over a
+  // whole file, which allows the callers reading many entries from the same
+  // file to map it only once. If 'hashed_key_out' is not null, it receives
+  // the hashed key stored in the header of the entry.
+  Status GetEntryInFile(ReadOptions& read_options,
+                        ByteArray& file,
+                        uint32_t offset_file,
+                        ByteArray* key_out,
+                        ByteArray* value_out,
+                        uint64_t* hashed_key_out=nullptr) {
+    Status s = Status::OK();
+    uint64_t filesize = file.size();
+    if (offset_file >= filesize) {
+      return Status::IOError("Location is beyond the end of the file");
+    }
+    ByteArray key_temp = file;
+    ByteArray value_temp = file;
     // NOTE: verify that value_temp.size() is indeed filesize -- verified and
     // the size was 0: should the size of an mmapped byte array be the size of
     // the file by default?
@@ -517,18 +1065,20 @@ class StorageEngine {
 
     *key_out = key_temp;
     *value_out = value_temp;
+    if (hashed_key_out != nullptr) *hashed_key_out = entry_header.hash;
     return s;
   }
 
-  bool IsLocationLastInIndex(uint64_t location, ByteArray& key) {
+  bool IsLocationLastInIndex(uint64_t location, uint64_t hashed_key) {
     // Only ever called by a Snapshot, thus no need to lock anything with
     // mutexes.
-    uint64_t hashed_key = hash_->HashFunction(key.data(), key.size());
-    bool is_last = false;
-    auto it = index_.upper_bound(hashed_key);
-    --it;
-    if (it->second == location) is_last = true;
-    return is_last;
+    uint64_t location_last;
+    if (   is_compaction_in_progress_
+        && index_compaction_.GetLastLocation(hashed_key, &location_last)) {
+      return location_last == location;
+    }
+    return (   index_.GetLastLocation(hashed_key, &location_last)
+            && location_last == location);
   }
 
 
@@ -560,9 +1110,11 @@ class StorageEngine {
     // TODO-23: replace the change on is_compaction_in_progress_ by a RAII
     //          WARNING: this is not the only part of the code with this issue,
     //          some code digging in all files is required
+    mutex_index_updates_.lock();
     mutex_compaction_.lock();
     is_compaction_in_progress_ = true;
     mutex_compaction_.unlock();
+    mutex_index_updates_.unlock();
     // TODO: If is_compaction_in_progress_ is set to true and then the method
     //       return due to an error, then if it is established that the
     //       compaction process really failed, index_compaction_ needs to be
@@ -571,7 +1123,7 @@ class StorageEngine {
 
     // Before the compaction starts, make sure all compaction-related files are removed
     Status s;
-    s = FileUtil::remove_files_with_prefix(dbname.c_str(), prefix_compaction_);
+    s = hstable_manager_.RemoveFilesWithPrefix(prefix_compaction_);
     if (!s.IsOK()) return Status::IOError("Could not clean up previous compaction", dbname.c_str());
 
     // 1a. Get *all* the files that are candidates for compaction
@@ -579,38 +1131,41 @@ class StorageEngine {
     //       through all the files. Fix that to be only the latest non-handled
     //       uncompacted files
     log::trace("Compaction()", "Step 1: Get files between fileids %u and %u", fileid_start, fileid_end_target);
-    std::multimap<uint64_t, uint64_t> index_compaction;
+    ShardedHashIndex index_compaction;
     DIR *directory;
     struct dirent *entry;
-    if ((directory = opendir(dbname.c_str())) == NULL) {
-      return Status::IOError("Could not open database directory", dbname.c_str());
-    }
     if (IsStopRequested()) return Status::IOError("Stop was requested");
 
     std::map<uint32_t, uint64_t> fileids_to_filesizes;
     char filepath[FileUtil::maximum_path_size()];
     uint32_t fileid = 0;
     struct stat info;
-    while ((entry = readdir(directory)) != NULL) {
-      if (strcmp(entry->d_name, DatabaseOptions::GetFilename().c_str()) == 0) continue;
-      int ret = snprintf(filepath, FileUtil::maximum_path_size(), "%s/%s", dbname.c_str(), entry->d_name);
-      if (ret < 0 || ret >= FileUtil::maximum_path_size()) {
-        log::emerg("Compaction()",
-                  "Filepath buffer is too small, could not build the filepath string for file [%s]", entry->d_name); 
-        continue;
+    for (auto& dirpath: hstable_manager_.GetDirpaths()) {
+      if ((directory = opendir(dirpath.c_str())) == NULL) {
+        return Status::IOError("Could not open database directory", dirpath.c_str());
       }
-      fileid = HSTableManager::hex_to_num(entry->d_name);
-      if (   hstable_manager_.file_resource_manager.IsFileCompacted(fileid)
-          || stat(filepath, &info) != 0
-          || !(info.st_mode & S_IFREG) 
-          || fileid < fileid_start
-          || fileid > fileid_end_target
-          || info.st_size <= (off_t)db_options_.internal__hstable_header_size) {
-        continue;
+      while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, DatabaseOptions::GetFilename().c_str()) == 0) continue;
+        if (HSTableManager::IsIndexCheckpointFile(entry->d_name)) continue;
+        int ret = snprintf(filepath, FileUtil::maximum_path_size(), "%s/%s", dirpath.c_str(), entry->d_name);
+        if (ret < 0 || ret >= FileUtil::maximum_path_size()) {
+          log::emerg("Compaction()",
+                    "Filepath buffer is too small, could not build the filepath string for file [%s]", entry->d_name); 
+          continue;
+        }
+        fileid = HSTableManager::hex_to_num(entry->d_name);
+        if (   hstable_manager_.file_resource_manager.IsFileCompacted(fileid)
+            || stat(filepath, &info) != 0
+            || !(info.st_mode & S_IFREG) 
+            || fileid < fileid_start
+            || fileid > fileid_end_target
+            || info.st_size <= (off_t)db_options_.internal__hstable_header_size) {
+          continue;
+        }
+        fileids_to_filesizes[fileid] = info.st_size;
       }
-      fileids_to_filesizes[fileid] = info.st_size;
+      closedir(directory);
     }
-    closedir(directory);
 
 
     // 1b. Filter to process files only up to a certain total size
@@ -647,14 +1202,26 @@ class StorageEngine {
     // 2. Iterating over all unique hashed keys of index_compaction, and determine which
     // locations of the storage engine index 'index_' with similar hashes will need to be compacted.
     log::trace("Compaction()", "Step 2: Get unique hashed keys");
+    std::vector<uint64_t> hashedkeys_compaction;
+    hashedkeys_compaction.reserve(index_compaction.size());
+    for (auto& p: index_compaction.shard(0)) {
+      hashedkeys_compaction.push_back(p.hashed_key);
+    }
+    index_compaction.clear(); // no longer needed
+    std::sort(hashedkeys_compaction.begin(), hashedkeys_compaction.end());
+    auto it_unique = std::unique(hashedkeys_compaction.begin(), hashedkeys_compaction.end());
+    hashedkeys_compaction.erase(it_unique, hashedkeys_compaction.end());
+
     std::vector<std::pair<uint64_t, uint64_t>> index_compaction_se;
-    for (auto it = index_compaction.begin(); it != index_compaction.end(); it = index_compaction.upper_bound(it->first)) {
-      auto range = index_.equal_range(it->first);
-      for (auto it_se = range.first; it_se != range.second; ++it_se) {
-        index_compaction_se.push_back(*it_se);
+    std::vector<uint64_t> locations_se;
+    for (auto& hashedkey: hashedkeys_compaction) {
+      locations_se.clear();
+      index_.GetLocations(hashedkey, &locations_se);
+      for (auto& location: locations_se) {
+        index_compaction_se.push_back(std::pair<uint64_t, uint64_t>(hashedkey, location));
       }
     }
-    index_compaction.clear(); // no longer needed
+    hashedkeys_compaction.clear(); // no longer needed
     if (IsStopRequested()) return Status::IOError("Stop was requested");
 
 
@@ -754,6 +1321,10 @@ class StorageEngine {
     // 5a. Reserving space in the file system
     // Reserve as much space are the files to compact are using, this is a
     // poor approximation, but should cover most cases. Large files are ignored.
+    // All the compacted files go to the directory with the most free space,
+    // so that they can be renamed in place in step 9.
+    uint32_t dirid_compaction = GetDirectoryIdWithMostFreeSpace();
+    hstable_manager_compaction_.SetFixedDirectory(dirid_compaction);
     uint32_t fileid_compaction = 1;
     for (auto it = fileids_compaction.begin(); it != fileids_compaction.end(); ++it) {
       uint32_t fileid = *it;
@@ -764,7 +1335,7 @@ class StorageEngine {
       if (!s.IsOK()) {
         // TODO: the cleanup of the compaction (removals, etc.) should be
         //       mutualized in the processing loop
-        FileUtil::remove_files_with_prefix(dbname.c_str(), prefix_compaction_);
+        hstable_manager_.RemoveFilesWithPrefix(prefix_compaction_);
         return s;
       }
       fileid_compaction += 1;
@@ -827,13 +1398,13 @@ class StorageEngine {
       // Create a set of what's in the OffsetArray of the HSTable being
       // handled in this iteration
       std::set<uint32_t> offset_array;
-      std::multimap<uint64_t, uint64_t> index_hstable;
+      ShardedHashIndex index_hstable;
       s = hstable_manager_.LoadFile(*mmap, fileid, index_hstable);
       if (!s.IsOK()) {
         log::warn("HSTableManager::Compaction()", "Could not load index in file id [%u]", fileid);
       }
-      for (auto &p: index_hstable) {
-        offset_array.insert(p.second & 0xFFFFFFFF); // insert the offset
+      for (auto &p: index_hstable.shard(0)) {
+        offset_array.insert(p.location & 0xFFFFFFFF); // insert the offset
       }
       index_hstable.clear();
 
@@ -908,6 +1479,7 @@ class StorageEngine {
                                  write_options,
                                  OrderType::Put,
                                  key,
+                                 entry_header.hash,
                                  chunk,
                                  0,
                                  entry_header.size_value,
@@ -923,7 +1495,7 @@ class StorageEngine {
 
     // 7. Write compacted orders on secondary storage
     log::trace("Compaction()", "Step 7: Write compacted files");
-    std::multimap<uint64_t, uint64_t> map_index;
+    std::vector<std::pair<uint64_t, uint64_t>> map_index;
     // All the resulting files will have the same timestamp, which is the
     // maximum of all the timestamps in the set of files that have been
     // compacted. This will allow the resulting files to be properly ordered
@@ -947,6 +1519,9 @@ class StorageEngine {
     // 9. Rename files
     for (uint32_t fileid = 1; fileid <= num_files_compacted; fileid++) {
       uint32_t fileid_new = fileid + offset_fileid;
+      if (hstable_manager_.GetDirpaths().size() > 1) {
+        hstable_manager_.file_resource_manager.SetFileDirectory(fileid_new, dirid_compaction);
+      }
       log::trace("Compaction()", "Renaming [%s] into [%s]", hstable_manager_compaction_.GetFilepath(fileid).c_str(),
                                                            hstable_manager_.GetFilepath(fileid_new).c_str());
       if (std::rename(hstable_manager_compaction_.GetFilepath(fileid).c_str(),
@@ -993,10 +1568,18 @@ class StorageEngine {
     log::trace("Compaction()", "Step 12: Update the storage engine index_");
     int num_iterations_per_lock = db_options_.internal__num_iterations_per_lock;
     int counter_iterations = 0;
+    uint32_t shardid_locked = 0;
     for (auto it = map_index_shifted.begin(); it != map_index_shifted.end(); it = map_index_shifted.upper_bound(it->first)) {
 
+      // The hashed keys are sorted, thus grouped by shard
+      uint32_t shardid = index_.GetShardId(it->first);
+      if (counter_iterations > 0 && shardid != shardid_locked) {
+        locks_index_[shardid_locked].ReleaseWriteLock();
+        counter_iterations = 0;
+      }
       if (counter_iterations == 0) {
-        AcquireWriteLock();
+        locks_index_[shardid].AcquireWriteLock();
+        shardid_locked = shardid;
       }
       counter_iterations += 1;
 
@@ -1004,10 +1587,10 @@ class StorageEngine {
       // in that group have already been handled during the compaction, except for the ones
       // that have fileids larger than the max fileid 'fileid_end_actual' -- call these 'locations_after'.
       const uint64_t& hashedkey = it->first;
-      auto range_index = index_.equal_range(hashedkey);
+      std::vector<uint64_t> locations_index;
+      index_.GetLocations(hashedkey, &locations_index);
       std::vector<uint64_t> locations_after;
-      for (auto it_bucket = range_index.first; it_bucket != range_index.second; ++it_bucket) {
-        const uint64_t& location = it_bucket->second;
+      for (auto& location: locations_index) {
         uint32_t fileid = (location & 0xFFFFFFFF00000000) >> 32;
         if (fileid > fileid_end_actual) {
           // Save all the locations for files with fileid that were not part of
@@ -1019,44 +1602,53 @@ class StorageEngine {
       // Erase the bucket, insert the locations from the compaction process, and
       // then insert the locations from the files that were not part of the
       // compaction process, 'locations_after'
-      index_.erase(hashedkey);
+      index_.Erase(hashedkey);
       auto range_compaction = map_index_shifted.equal_range(hashedkey);
-      index_.insert(range_compaction.first, range_compaction.second);
+      for (auto p = range_compaction.first; p != range_compaction.second; ++p) {
+        index_.Insert(hashedkey, p->second);
+      }
       for (auto p = locations_after.begin(); p != locations_after.end(); ++p) {
-        index_.insert(std::pair<uint64_t, uint64_t>(hashedkey, *p));
+        index_.Insert(hashedkey, *p);
       }
 
       // Throttling the index updates, and allows other processes
       // to acquire the write lock if they need it
       if (counter_iterations >= num_iterations_per_lock) {
-        ReleaseWriteLock();
+        locks_index_[shardid_locked].ReleaseWriteLock();
         counter_iterations = 0;
       }
     }
-    if (counter_iterations) ReleaseWriteLock();
+    if (counter_iterations) locks_index_[shardid_locked].ReleaseWriteLock();
     if (IsStopRequested()) return Status::IOError("Stop was requested");
 
 
     // 13. Put all the locations inserted after the compaction started
     //     stored in 'index_compaction_' into the main index 'index_'
     log::trace("Compaction()", "Step 13: Transfer index_compaction_ into index_");
-    AcquireWriteLock();
-    // TODO-38: The pouring of index_compaction_ needs to be throttled just like the
-    //          update of index_ above. The problem is that if the lock is acquire
-    //          for a limited time only, then another thread could come in and want
-    //          to write to the database as well: to which index should it write
-    //          then, index_ or index_compaction_? More concerning, if it writes to 
-    //          index_compaction_, this would mean that it would be writing to
-    //          index_compaction_ as an iterator is going over index_compaction_,
-    //          which would be just plain wrong. This problem will require more
-    //          thinking, for now, just lock for longer and risk to cause timeouts:
-    //          better be late than buggy.
-    index_.insert(index_compaction_.begin(), index_compaction_.end()); 
+    // The pouring is done one shard at a time, so that only the readers of
+    // that shard are blocked. Holding 'mutex_index_updates_' guarantees that
+    // no index updates are written to index_compaction_ while it is being
+    // poured, and that all subsequent updates go to index_.
+    mutex_index_updates_.lock();
+    for (uint32_t shardid = 0; shardid < index_.num_shards(); shardid++) {
+      locks_index_[shardid].AcquireWriteLock();
+      for (auto& p: index_compaction_.shard(shardid)) {
+        index_.Insert(p.hashed_key, p.location);
+      }
+      locks_index_[shardid].ReleaseWriteLock();
+    }
     mutex_compaction_.lock();
     is_compaction_in_progress_ = false;
     mutex_compaction_.unlock();
-    ReleaseWriteLock();
-    index_compaction_.clear();
+    mutex_index_updates_.unlock();
+
+    // Readers that started before the end of the compaction may still be
+    // going through index_compaction_
+    for (uint32_t shardid = 0; shardid < index_.num_shards(); shardid++) {
+      locks_index_[shardid].AcquireWriteLock();
+      index_compaction_.ClearShard(shardid);
+      locks_index_[shardid].ReleaseWriteLock();
+    }
     if (IsStopRequested()) return Status::IOError("Stop was requested");
 
 
@@ -1100,7 +1692,7 @@ class StorageEngine {
     if (IsStopRequested()) return Status::IOError("Stop was requested");
 
     // Cleanup pre-allocated files
-    FileUtil::remove_files_with_prefix(dbname.c_str(), prefix_compaction_);
+    hstable_manager_.RemoveFilesWithPrefix(prefix_compaction_);
  
     return Status::OK();
   }
@@ -1122,6 +1714,9 @@ class StorageEngine {
   Status GetNewSnapshotData(uint32_t *snapshot_id, std::set<uint32_t> **fileids_ignore) {
     std::unique_lock<std::mutex> lock(mutex_snapshot_);
     *snapshot_id = IncrementSequenceSnapshot(1);
+    // Registering the snapshot makes the compaction keep the files it
+    // removes until the snapshot is released
+    snapshotids_to_fileids_[*snapshot_id];
     *fileids_ignore = new std::set<uint32_t>();
     for (auto& p: num_references_to_unused_files_) {
       (*fileids_ignore)->insert(p.first);
@@ -1156,9 +1751,83 @@ class StorageEngine {
   }
 
   Status ReleaseAllSnapshots() {
+    // ReleaseSnapshot() erases from snapshotids_to_fileids_, thus the ids
+    // cannot be released while iterating over it
+    std::vector<uint32_t> snapshot_ids;
+    mutex_snapshot_.lock();
     for (auto& p: snapshotids_to_fileids_) {
-      Status s = ReleaseSnapshot(p.first);
-      if (!s.IsOK()) return s;
+      snapshot_ids.push_back(p.first);
+    }
+    mutex_snapshot_.unlock();
+    for (auto& snapshot_id: snapshot_ids) {
+      // The snapshot may have been released in the meantime: this is fine
+      ReleaseSnapshot(snapshot_id);
+    }
+    return Status::OK();
+  }
+
+  // Blocks the batches of index updates, and therefore the recycling of the
+  // write buffer generations, which only happens once their orders are
+  // indexed. Also prevents the compaction from starting or ending.
+  void LockIndexUpdates() {
+    mutex_index_updates_.lock();
+  }
+
+  void UnlockIndexUpdates() {
+    mutex_index_updates_.unlock();
+  }
+
+  // Makes the read-only storage engine of a new snapshot share the index of
+  // this storage engine, instead of having it load the index from the
+  // HSTables. GetNewSnapshotData() must have been called before, so that
+  // all the files referenced by the shared index are kept until the snapshot
+  // is released. The caller must hold the lock of LockIndexUpdates(), which
+  // guarantees that no batch of updates is half-applied in the shared index.
+  Status ShareIndexWithSnapshot(StorageEngine *se_snapshot) {
+    se_snapshot->is_compaction_in_progress_ = is_compaction_in_progress_;
+    for (uint32_t shardid = 0; shardid < index_.num_shards(); shardid++) {
+      locks_index_[shardid].AcquireReadLock();
+      se_snapshot->index_.ShareShard(index_, shardid);
+      if (is_compaction_in_progress_) {
+        se_snapshot->index_compaction_.ShareShard(index_compaction_, shardid);
+      }
+      locks_index_[shardid].ReleaseReadLock();
+    }
+
+    // The file sizes are set before the locations are added to the index,
+    // thus reading them after the index has been shared guarantees that
+    // all the shared locations are within the file sizes. The files that were
+    // removed by a compaction before the snapshot are no longer referenced by
+    // the index and are ignored.
+    // The files that are still being written have no OffsetArray on disk
+    // yet: the in-memory ones are copied so that the iterators can find
+    // their entries. Holding 'mutex_data_' guarantees that the file sizes
+    // and OffsetArrays are consistent with each other, and once the writes
+    // in flight are done, with the content of the files.
+    FileResourceManager& frm_live = hstable_manager_.file_resource_manager;
+    FileResourceManager& frm_snapshot = se_snapshot->hstable_manager_.file_resource_manager;
+    std::unique_lock<std::mutex> lock_data(mutex_data_);
+    for (auto lane: lanes_) {
+      lane->hstable_manager->WaitForWrites(lane->hstable_manager->GetTicketLastWrite());
+    }
+    std::map<uint32_t, uint64_t> filesizes = frm_live.GetFileSizes();
+    std::map<uint32_t, uint32_t> directories = frm_live.GetFileDirectories();
+    se_snapshot->offarrays_in_progress_ = frm_live.GetOffsetArrays();
+    lock_data.unlock();
+    for (auto& p: filesizes) {
+      uint32_t fileid = p.first;
+      if (   se_snapshot->fileids_ignore_ != nullptr
+          && se_snapshot->fileids_ignore_->find(fileid) != se_snapshot->fileids_ignore_->end()) {
+        continue;
+      }
+      frm_snapshot.SetFileSize(fileid, p.second);
+      auto it = directories.find(fileid);
+      if (it != directories.end()) frm_snapshot.SetFileDirectory(fileid, it->second);
+      if (frm_live.IsFileLarge(fileid)) frm_snapshot.SetFileLarge(fileid);
+      if (frm_live.IsFileCompacted(fileid)) frm_snapshot.SetFileCompacted(fileid);
+      if (se_snapshot->fileids_iterator_ != nullptr) {
+        se_snapshot->fileids_iterator_->push_back(fileid);
+      }
     }
     return Status::OK();
   }
@@ -1178,17 +1847,107 @@ class StorageEngine {
     return hstable_manager_.GetFilepath(fileid);
   }
 
-  uint32_t FlushCurrentFileForSnapshot() {
-    return hstable_manager_.FlushCurrentFile(1, 0);
-  }
-
   uint32_t FlushCurrentFileForForcedCompaction() {
-    return hstable_manager_.FlushCurrentFile(1, 0);
+    std::unique_lock<std::mutex> lock(mutex_data_);
+    uint32_t fileid_out = 0;
+    for (auto lane: lanes_) {
+      fileid_out = std::max(fileid_out, lane->hstable_manager->FlushCurrentFile(1, 0));
+    }
+    return fileid_out;
   }
 
   std::vector<uint32_t>* GetFileidsIterator() {
     return fileids_iterator_;
   }
+
+  // Appends to 'locations_out' the locations of the entries of a file that
+  // was still being written when the snapshot was created. Returns false if
+  // the file was already complete, in which case its OffsetArray is on disk.
+  bool GetLocationsInProgress(uint32_t fileid, std::vector<uint64_t>* locations_out) {
+    auto it = offarrays_in_progress_.find(fileid);
+    if (it == offarrays_in_progress_.end() || it->second.empty()) return false;
+    uint64_t fileid_shifted = fileid;
+    fileid_shifted <<= 32;
+    for (auto& p: it->second) {
+      locations_out->push_back(fileid_shifted | p.second);
+    }
+    return true;
+  }
+
+  // Takes ownership of the content of 'orders', which must be ordered from
+  // the oldest to the most recent order.
+  void SetBufferedOrdersForSnapshot(std::vector<Order>& orders) {
+    orders_buffered_.swap(orders);
+    index_orders_buffered_.reserve(orders_buffered_.size());
+    for (uint32_t i = 0; i < orders_buffered_.size(); i++) {
+      index_orders_buffered_.push_back(std::pair<uint64_t, uint32_t>(orders_buffered_[i].hashed_key, i));
+    }
+    // Sorting the pairs keeps the orders of a hashed key in insertion order
+    std::sort(index_orders_buffered_.begin(), index_orders_buffered_.end());
+  }
+
+  uint32_t GetNumBufferedOrders() {
+    return orders_buffered_.size();
+  }
+
+  // Same semantics as WriteBuffer::Get(): only the most recent order for the
+  // key is considered, and if it is a part of a multipart entry, the entry is
+  // not found in the buffered orders. The Database flushes the write buffer
+  // before creating a snapshot that would have the last part of an entry,
+  // thus the multipart entries found here are still being written.
+  Status GetFromBufferedOrders(uint64_t hashed_key,
+                               ByteArray& key,
+                               ByteArray* value_out,
+                               uint32_t *index_order_out) {
+    bool found = false;
+    uint32_t index_order = 0;
+    auto it = std::lower_bound(index_orders_buffered_.begin(),
+                               index_orders_buffered_.end(),
+                               std::pair<uint64_t, uint32_t>(hashed_key, 0));
+    for (; it != index_orders_buffered_.end() && it->first == hashed_key; ++it) {
+      if (orders_buffered_[it->second].key == key) {
+        found = true;
+        index_order = it->second;
+      }
+    }
+    if (!found) return Status::NotFound("Unable to find entry");
+
+    Order& order = orders_buffered_[index_order];
+    *index_order_out = index_order;
+    if (order.type == OrderType::Put && order.IsSelfContained()) {
+      // Like for the entries read by GetEntry(), the checksum of the order
+      // covers both the key and the value
+      *value_out = order.chunk;
+      value_out->set_size(order.size_value);
+      value_out->set_size_compressed(order.size_value_compressed);
+      value_out->set_checksum(order.crc32);
+      value_out->set_checksum_initial(crc32c::Value(order.key.data(), order.key.size()));
+      return Status::OK();
+    } else if (order.type == OrderType::Delete) {
+      return Status::DeleteOrder();
+    }
+    return Status::NotFound("Unable to find entry");
+  }
+
+  bool IsKeyInBufferedOrders(ByteArray& key, uint64_t hashed_key) {
+    if (orders_buffered_.empty()) return false;
+    ByteArray value;
+    uint32_t index_order;
+    Status s = GetFromBufferedOrders(hashed_key, key, &value, &index_order);
+    return (s.IsOK() || s.IsDeleteOrder());
+  }
+
+  // Returns true if the buffered order at 'index_order' is the value of its
+  // key as seen by the snapshot, i.e. if it is the most recent order for
+  // that key and that it is a self-contained Put.
+  bool GetBufferedOrder(uint32_t index_order, ByteArray* key_out, ByteArray* value_out) {
+    Order& order = orders_buffered_[index_order];
+    uint32_t index_order_last;
+    Status s = GetFromBufferedOrders(order.hashed_key, order.key, value_out, &index_order_last);
+    if (!s.IsOK() || index_order_last != index_order) return false;
+    *key_out = order.key;
+    return true;
+  }
   // END: Helpers for Snapshots
   
   uint64_t GetDbSizeUncompacted() {
@@ -1196,25 +1955,23 @@ class StorageEngine {
   }
 
  private:
-  void AcquireWriteLock() {
-    // Also waits for readers to finish
-    // NOTE: should this be made its own templated class?
-    mutex_write_.lock();
-    while(true) {
-      std::unique_lock<std::mutex> lock_read(mutex_read_);
-      if (num_readers_ == 0) break;
-      cv_read_.wait(lock_read);
+  void AcquireAllIndexWriteLocks() {
+    for (uint32_t shardid = 0; shardid < index_.num_shards(); shardid++) {
+      locks_index_[shardid].AcquireWriteLock();
     }
   }
 
-  void ReleaseWriteLock() {
-    mutex_write_.unlock();
+  void ReleaseAllIndexWriteLocks() {
+    for (uint32_t shardid = 0; shardid < index_.num_shards(); shardid++) {
+      locks_index_[shardid].ReleaseWriteLock();
+    }
   }
 
   // Options
   DatabaseOptions db_options_;
   EventManager *event_manager_;
   Hash *hash_;
+  IOEngine *io_engine_read_;
   bool is_read_only_;
   std::set<uint32_t>* fileids_ignore_;
   std::string prefix_compaction_;
@@ -1225,17 +1982,43 @@ class StorageEngine {
   HSTableManager hstable_manager_;
   std::map<uint64_t, std::string> data_;
   std::thread thread_data_;
-  std::condition_variable cv_read_;
-  std::mutex mutex_read_;
-  std::mutex mutex_write_;
-  int num_readers_;
+  std::mutex mutex_data_;
   std::shared_ptr<FileManager> file_manager_;
 
   // Index
-  std::multimap<uint64_t, uint64_t> index_;
-  std::multimap<uint64_t, uint64_t> index_compaction_;
+  ShardedHashIndex index_;
+  ShardedHashIndex index_compaction_;
+  bool is_index_loaded_;
+  ReadWriteLock *locks_index_; // one lock per shard, for both indexes
+  std::mutex mutex_index_updates_;
   std::thread thread_index_;
-  //std::mutex mutex_index_;
+
+  // Id of the first file written by each flush whose index updates have not
+  // been applied yet, from the oldest flush to the most recent one
+  std::deque<uint32_t> fileids_start_flushes_;
+  std::deque< std::vector<uint64_t> > tickets_flushes_;
+
+  // The writer lanes: lane 0 is hstable_manager_, run by the data thread, and
+  // the other lanes each have their own HSTableManager and thread
+  struct WriterLane {
+    WriterLane(HSTableManager *hsm)
+        : hstable_manager(hsm),
+          orders(1),
+          map_index(1),
+          needs_new_file(false) {
+    }
+    HSTableManager *hstable_manager;
+    std::thread thread;
+    EventQueue<std::vector<Order>> orders;
+    EventQueue<std::vector<std::pair<uint64_t, uint64_t>>> map_index;
+
+    // Hashed keys of the batches written by other lanes, mapped to the file
+    // id of their batch. Only used by the data thread.
+    std::map<uint64_t, uint32_t> barriers;
+    bool needs_new_file;
+  };
+  std::vector<WriterLane*> lanes_;
+  std::mutex mutex_flushes_;
 
   // Compaction
   HSTableManager hstable_manager_compaction_;
@@ -1259,6 +2042,9 @@ class StorageEngine {
   std::mutex mutex_sequence_snapshot_;
   uint32_t sequence_snapshot_;
   std::vector<uint32_t> *fileids_iterator_;
+  std::map<uint32_t, std::vector< std::pair<uint64_t, uint32_t> > > offarrays_in_progress_;
+  std::vector<Order> orders_buffered_;
+  std::vector< std::pair<uint64_t, uint32_t> > index_orders_buffered_; // sorted
 
   // Stopping and closing
   bool stop_requested_;
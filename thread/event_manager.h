@@ -9,19 +9,22 @@
 #include <thread>
 #include <condition_variable>
 #include <vector>
-#include <map>
+#include <deque>
+#include <utility>
 
 namespace kdb {
 
+// The data passed to an Event or an EventQueue is moved from one thread to
+// the other, never copied: the caller gives up ownership of it.
 template<typename T>
 class Event {
  public:
   Event() { has_data = false; }
 
-  void StartAndBlockUntilDone(T& data) {
+  void StartAndBlockUntilDone(T&& data) {
     std::unique_lock<std::mutex> lock_start(mutex_unique_);
     std::unique_lock<std::mutex> lock(mutex_);
-    data_ = data;
+    data_ = std::move(data);
     has_data = true;
     cv_ready_.notify_one();
     cv_done_.wait(lock);
@@ -32,7 +35,7 @@ class Event {
     if (!has_data) {
       cv_ready_.wait(lock);
     }
-    return data_;
+    return std::move(data_);
   }
 
   void Done() {
@@ -55,12 +58,77 @@ class Event {
 };
 
 
+// EventQueue passes data from one stage of a pipeline to the next one. Items
+// are popped in the order in which they were pushed, and Push() blocks while
+// 'capacity' items are waiting, so that a stage cannot get more than
+// 'capacity' items ahead of the next one.
+template<typename T>
+class EventQueue {
+ public:
+  EventQueue(size_t capacity)
+      : capacity_(capacity),
+        is_closed_(false) {
+  }
+
+  void Push(T&& data) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (items_.size() >= capacity_ && !is_closed_) {
+      cv_pop_.wait(lock);
+    }
+    if (is_closed_) return;
+    items_.push_back(std::move(data));
+    cv_push_.notify_one();
+  }
+
+  // Blocks until an item is available, and returns false if the queue was
+  // closed and has no more items.
+  bool Pop(T* data_out) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (items_.empty() && !is_closed_) {
+      cv_push_.wait(lock);
+    }
+    if (items_.empty()) return false;
+    *data_out = std::move(items_.front());
+    items_.pop_front();
+    cv_pop_.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    is_closed_ = true;
+    cv_push_.notify_all();
+    cv_pop_.notify_all();
+  }
+
+ private:
+  size_t capacity_;
+  bool is_closed_;
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable cv_push_;
+  std::condition_variable cv_pop_;
+};
+
+
+// The write path is a pipeline of three stages, each in its own thread: the
+// storage engine writes the orders of a sealed write buffer to the HSTables,
+// then the index is updated with their locations, and then the write buffer
+// clears the orders. The index updates are pairs of hashed key and location,
+// sorted by hashed key. Up to kNumFlushesInFlight sealed buffers can be in the
+// pipeline at once, so that the next buffer is written while the index
+// updates of the previous one are applied.
 class EventManager {
  public:
-  EventManager() {}
-  Event<std::vector<Order>> flush_buffer;
-  Event<std::multimap<uint64_t, uint64_t>> update_index;
-  Event<int> clear_buffer;
+  static const int kNumFlushesInFlight = 2;
+  EventManager()
+      : flush_buffer(kNumFlushesInFlight),
+        update_index(kNumFlushesInFlight),
+        clear_buffer(kNumFlushesInFlight) {
+  }
+  EventQueue<std::vector<Order>> flush_buffer;
+  EventQueue<std::vector<std::pair<uint64_t, uint64_t>>> update_index;
+  EventQueue<int> clear_buffer;
   Event<int> compaction_status;
 };
 
@@ -0,0 +1,63 @@
+// Copyright (c) 2014, Emmanuel Goossaert. All rights reserved.
+// Use of this source code is governed by the BSD 3-Clause License,
+// that can be found in the LICENSE file.
+
+#ifndef KINGDB_READ_WRITE_LOCK_H_
+#define KINGDB_READ_WRITE_LOCK_H_
+
+#include "util/debug.h"
+#include <mutex>
+#include <condition_variable>
+
+namespace kdb {
+
+// Readers can share the lock, and a writer has exclusive access. Writers have
+// priority: as soon as a writer is waiting, incoming readers are blocked
+// until the writer has released the lock.
+class ReadWriteLock {
+ public:
+  ReadWriteLock()
+      : num_readers_(0) {
+  }
+
+  void AcquireReadLock() {
+    mutex_write_.lock();
+    mutex_read_.lock();
+    num_readers_ += 1;
+    mutex_read_.unlock();
+    mutex_write_.unlock();
+  }
+
+  void ReleaseReadLock() {
+    mutex_read_.lock();
+    num_readers_ -= 1;
+    mutex_read_.unlock();
+    cv_read_.notify_one();
+  }
+
+  void AcquireWriteLock() {
+    // Also waits for readers to finish
+    mutex_write_.lock();
+    std::unique_lock<std::mutex> lock_read(mutex_read_);
+    while (num_readers_ > 0) {
+      cv_read_.wait(lock_read);
+    }
+  }
+
+  void ReleaseWriteLock() {
+    mutex_write_.unlock();
+  }
+
+ private:
+  ReadWriteLock(const ReadWriteLock&);
+  ReadWriteLock& operator=(const ReadWriteLock&);
+
+  std::mutex mutex_write_;
+  std::mutex mutex_read_;
+  std::condition_variable cv_read_;
+  int num_readers_;
+};
+
+} // namespace kdb
+
+#endif // KINGDB_READ_WRITE_LOCK_H_
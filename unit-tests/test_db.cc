@@ -5,6 +5,7 @@
 #include <iostream>
 #include <iomanip>
 #include <thread>
+#include <atomic>
 #include <regex>
 #include <queue>
 #include <vector>
@@ -25,6 +26,7 @@
 #include "util/order.h"
 #include "util/byte_array.h"
 #include "util/file.h"
+#include "algorithm/crc32c.h"
 
 #include "interface/snapshot.h"
 #include "interface/iterator.h"
@@ -201,7 +203,7 @@ class DBTest {
       test_purpose_ = "64-bit MurmurHash3";
       data_generator_ = new CompressibleDataGenerator();
       db_options_.compression.type = kLZ4Compression;
-      db_options_.storage__hashing_algorithm = kMurmurHash3_64;
+      db_options_.hash = kMurmurHash3_64;
     } else if (index_db_options_ == 4) {
       test_purpose_ = "Checksum verification with incompressible data";
       data_generator_ = new IncompressibleDataGenerator();
@@ -256,6 +258,37 @@ class DBTest {
       data_generator_ = new CompressibleDataGenerator();
       db_options_.compression.type = kLZ4Compression;
       db_options_.write_buffer__mode = kWriteBufferModeDirect;
+    } else if (index_db_options_ == 13) {
+      test_purpose_ = "Multiple writer lanes";
+      data_generator_ = new CompressibleDataGenerator();
+      db_options_.compression.type = kLZ4Compression;
+      db_options_.storage__num_lanes = 4;
+    } else if (index_db_options_ == 14) {
+      test_purpose_ = "HSTables striped over multiple directories";
+      data_generator_ = new CompressibleDataGenerator();
+      db_options_.compression.type = kLZ4Compression;
+      db_options_.storage__paths = "db_test_path0,db_test_path1,db_test_path2";
+      db_options_.storage__num_lanes = 2;
+    } else if (index_db_options_ == 15) {
+      test_purpose_ = "64-bit XXH3";
+      data_generator_ = new CompressibleDataGenerator();
+      db_options_.compression.type = kLZ4Compression;
+      db_options_.hash = kxxHash3_64;
+    } else if (index_db_options_ == 16) {
+      test_purpose_ = "Asynchronous writes with io_uring, small-sized HSTables and multiple writer lanes";
+      data_generator_ = new CompressibleDataGenerator();
+      db_options_.compression.type = kLZ4Compression;
+      db_options_.storage__io_engine = kIOEngineUring;
+      db_options_.storage__num_lanes = 2;
+      db_options_.write_buffer__size = 1024 * 256;
+      db_options_.storage__maximum_part_size = 1024 * 8;
+      db_options_.storage__hstable_size = 1024 * 200;
+    } else if (index_db_options_ == 17) {
+      test_purpose_ = "Synced writes with io_uring";
+      data_generator_ = new IncompressibleDataGenerator();
+      db_options_.compression.type = kLZ4Compression;
+      db_options_.storage__io_engine = kIOEngineUring;
+      write_options_.sync = true;
     } else {
       return false;
     }
@@ -271,14 +304,20 @@ class DBTest {
     char filepath[FileUtil::maximum_path_size()];
 
     struct stat info;
-    if (stat(dbname_.c_str(), &info) != 0) return;
-
-    dir = opendir(dbname_.c_str());
-    while ((entry = readdir(dir)) != nullptr) {
-      sprintf(filepath, "%s/%s", dbname_.c_str(), entry->d_name);
-      std::remove(filepath);
+    std::vector<std::string> dirpaths;
+    Status s = kdb::HSTableManager::ParseDirpaths(dbname_, db_options_.storage__paths, &dirpaths);
+    if (!s.IsOK()) dirpaths.assign(1, dbname_);
+    if (dirpaths[0] != dbname_) dirpaths.push_back(dbname_);
+    for (auto& dirpath: dirpaths) {
+      if (stat(dirpath.c_str(), &info) != 0) continue;
+      dir = opendir(dirpath.c_str());
+      while ((entry = readdir(dir)) != nullptr) {
+        sprintf(filepath, "%s/%s", dirpath.c_str(), entry->d_name);
+        std::remove(filepath);
+      }
+      closedir(dir);
+      rmdir(dirpath.c_str());
     }
-    rmdir(dbname_.c_str());
   }
 
   kdb::Status Get(ReadOptions& read_options_, const std::string& key, std::string *value_out) {
@@ -326,6 +365,43 @@ TEST(DBTest, CloseAndReopen) {
 }
 
 
+TEST(DBTest, ReopenKeepsInstanceOptions) {
+  ResetAllOptions();
+  kdb::Logger::set_current_level("emerg");
+  db_options_.hash = kMurmurHash3_64;
+  db_options_.storage__num_lanes = 3;
+  db_options_.storage__direct_io = true;
+  db_options_.storage__io_engine = kIOEngineUring;
+  db_options_.sync__max_delay_us = 7;
+  db_options_.index__num_shards = 8;
+  db_options_.open__parallelism = 3;
+  Open();
+  kdb::Status s = db_->Put(write_options_, "key1", "value1");
+  ASSERT_TRUE(s.IsOK());
+  CloseWithoutErasingDB();
+
+  // The options persisted with the database are loaded from it, and the
+  // instance options are the ones given at each open
+  db_options_.hash = kxxHash3_64;
+  db_options_.storage__num_lanes = 2;
+  OpenWithoutErasingDB();
+  const DatabaseOptions& db_options = db_->GetDatabaseOptions();
+  ASSERT_EQ(db_options.hash, kMurmurHash3_64);
+  ASSERT_EQ(db_options.storage__num_lanes, 2u);
+  ASSERT_TRUE(db_options.storage__direct_io);
+  ASSERT_EQ(db_options.storage__io_engine, kIOEngineUring);
+  ASSERT_EQ(db_options.sync__max_delay_us, 7u);
+  ASSERT_EQ(db_options.index__num_shards, 8u);
+  ASSERT_EQ(db_options.open__parallelism, 3u);
+
+  std::string out_str;
+  s = db_->Get(read_options_, "key1", &out_str);
+  ASSERT_TRUE(s.IsOK());
+  ASSERT_EQ(out_str, "value1");
+  Close();
+}
+
+
 TEST(DBTest, RepairInvalidDatabaseOptionFile) {
   ResetAllOptions();
   kdb::Logger::set_current_level("emerg");
@@ -353,6 +429,203 @@ TEST(DBTest, RepairInvalidDatabaseOptionFile) {
 }
 
 
+TEST(DBTest, IndexCheckpoint) {
+  ResetAllOptions();
+  kdb::Logger::set_current_level("emerg");
+  Open();
+  kdb::Status s;
+
+  int num_count_valid = 0;
+
+  s = db_->Put(write_options_, "key1", "value1");
+  s = db_->Put(write_options_, "key2", "value2");
+
+  // The index is loaded from the checkpoint written by Close(), and none of
+  // the HSTables it covers is read again
+  CloseWithoutErasingDB();
+  OpenWithoutErasingDB();
+  ASSERT_TRUE(db_->GetNumFilesLoadedFromCheckpoint() > 0);
+  ASSERT_EQ(db_->GetNumFilesLoadedFromScan(), 0u);
+  s = db_->Put(write_options_, "key1", "value1b");
+  s = db_->Put(write_options_, "key3", "value3");
+
+  // A corrupted checkpoint must be ignored
+  CloseWithoutErasingDB();
+  std::string filepath = dbname_ + "/" + kdb::HSTableManager::GetIndexCheckpointFilename();
+  FILE* file = fopen(filepath.c_str(), "r+b");
+  ASSERT_TRUE(file != nullptr);
+  fseek(file, 48, SEEK_SET);
+  fputc(0xFF, file);
+  fclose(file);
+  OpenWithoutErasingDB();
+  ASSERT_EQ(db_->GetNumFilesLoadedFromCheckpoint(), 0u);
+  ASSERT_TRUE(db_->GetNumFilesLoadedFromScan() > 0);
+
+  std::string out_str;
+  s = db_->Get(read_options_, "key1", &out_str);
+  if (s.IsOK() && out_str == "value1b") num_count_valid += 1;
+
+  s = db_->Get(read_options_, "key2", &out_str);
+  if (s.IsOK() && out_str == "value2") num_count_valid += 1;
+
+  s = db_->Get(read_options_, "key3", &out_str);
+  if (s.IsOK() && out_str == "value3") num_count_valid += 1;
+
+  ASSERT_EQ(num_count_valid, 3);
+  Close();
+}
+
+
+TEST(DBTest, MultiGet) {
+  // The entries are read from the memory-mapped files with the system call
+  // engine, and with batches of reads with the io_uring engine
+  IOEngineType io_engines[] = { kIOEngineSyscall, kIOEngineUring };
+  for (auto io_engine: io_engines) {
+    ResetAllOptions();
+    kdb::Logger::set_current_level("emerg");
+    db_options_.storage__io_engine = io_engine;
+    Open();
+    kdb::Status s;
+
+    // Entries in the storage engine, in the write buffer, and deleted
+    int num_items = 1000;
+    for (int i = 0; i < num_items; i++) {
+      s = db_->Put(write_options_, "key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    db_->Flush();
+    s = db_->Put(write_options_, "key1", "value1b");
+    kdb::ByteArray key_deleted = kdb::NewDeepCopyByteArray("key2", 4);
+    s = db_->Delete(write_options_, key_deleted);
+
+    std::vector<kdb::ByteArray> keys;
+    std::vector<std::string> keys_str;
+    for (int i = num_items - 1; i >= 0; i -= 7) keys_str.push_back("key" + std::to_string(i));
+    keys_str.push_back("key1");
+    keys_str.push_back("key2");
+    keys_str.push_back("key-missing");
+    for (auto& key_str: keys_str) {
+      keys.push_back(kdb::NewDeepCopyByteArray(key_str.c_str(), key_str.size()));
+    }
+
+    std::vector<kdb::ByteArray> values;
+    std::vector<kdb::Status> statuses;
+    db_->MultiGet(read_options_, keys, &values, &statuses);
+    ASSERT_EQ(values.size(), keys.size());
+    ASSERT_EQ(statuses.size(), keys.size());
+
+    int num_count_valid = 0;
+    for (size_t i = 0; i < keys.size(); i++) {
+      std::string value_expected;
+      s = db_->Get(read_options_, keys_str[i], &value_expected);
+      if (   s.IsOK() == statuses[i].IsOK()
+          && (!s.IsOK() || values[i].ToString() == value_expected)) {
+        num_count_valid += 1;
+      }
+    }
+    ASSERT_EQ(num_count_valid, (int)keys.size());
+    ASSERT_EQ(values[keys.size() - 3].ToString(), std::string("value1b"));
+    ASSERT_TRUE(statuses[keys.size() - 2].IsNotFound());
+    ASSERT_TRUE(statuses[keys.size() - 1].IsNotFound());
+    Close();
+  }
+}
+
+
+TEST(DBTest, GetIntoBuffer) {
+  ResetAllOptions();
+  kdb::Logger::set_current_level("emerg");
+  Open();
+  kdb::Status s;
+
+  std::string value;
+  for (int i = 0; i < 1000; i++) value += "value" + std::to_string(i % 10);
+  s = db_->Put(write_options_, "key1", value);
+  db_->Flush();
+
+  kdb::ReadOptions read_options;
+  read_options.verify_checksums = true;
+  kdb::ByteArray key = kdb::NewDeepCopyByteArray("key1", 4);
+  uint64_t size_value = 0;
+  char buffer_small[16];
+  s = db_->Get(read_options, key, buffer_small, sizeof(buffer_small), &size_value);
+  ASSERT_TRUE(s.IsInvalidArgument());
+  ASSERT_EQ(size_value, value.size());
+
+  std::vector<char> buffer(size_value);
+  s = db_->Get(read_options, key, buffer.data(), buffer.size(), &size_value);
+  ASSERT_TRUE(s.IsOK());
+  ASSERT_EQ(std::string(buffer.data(), size_value), value);
+
+  std::string value_out;
+  s = db_->Get(read_options, key, &value_out);
+  ASSERT_TRUE(s.IsOK());
+  ASSERT_EQ(value_out, value);
+  Close();
+
+  // No memory is allocated for a value that requires a MultipartReader
+  ResetAllOptions();
+  db_options_.internal__size_multipart_required = 1024;
+  Open();
+  s = db_->Put(write_options_, "key1", value);
+  db_->Flush();
+  std::string value_large_out;
+  s = db_->Get(read_options, key, &value_large_out);
+  ASSERT_TRUE(s.IsMultipartRequired());
+  ASSERT_EQ(value_large_out.capacity() < value.size(), true);
+  Close();
+}
+
+
+TEST(DBTest, WriteBatch) {
+  ResetAllOptions();
+  kdb::Logger::set_current_level("emerg");
+  Open();
+  kdb::Status s;
+
+  s = db_->Put(write_options_, "key-deleted", "value");
+  ASSERT_TRUE(s.IsOK());
+
+  kdb::WriteBatch batch;
+  for (int i = 0; i < 1000; i++) {
+    batch.Put("key" + std::to_string(i), "value" + std::to_string(i));
+  }
+  batch.Put("key0", "value-overwritten");
+  batch.Delete("key-deleted");
+  ASSERT_EQ(batch.num_entries(), 1002u);
+  s = db_->Write(write_options_, batch);
+  ASSERT_TRUE(s.IsOK());
+  batch.Clear();
+
+  for (int step = 0; step < 2; step++) {
+    std::string value_out;
+    for (int i = 1; i < 1000; i++) {
+      s = db_->Get(read_options_, "key" + std::to_string(i), &value_out);
+      ASSERT_TRUE(s.IsOK());
+      ASSERT_EQ(value_out, "value" + std::to_string(i));
+    }
+    s = db_->Get(read_options_, "key0", &value_out);
+    ASSERT_TRUE(s.IsOK());
+    ASSERT_EQ(value_out, "value-overwritten");
+    s = db_->Get(read_options_, "key-deleted", &value_out);
+    ASSERT_TRUE(s.IsNotFound());
+    db_->Flush();
+  }
+
+  // A batch that does not fit in an HSTable is rejected as a whole
+  std::string value_large(db_options_.storage__maximum_part_size, 'a');
+  uint64_t num_values = db_options_.storage__hstable_size / value_large.size() + 1;
+  for (uint64_t i = 0; i < num_values; i++) {
+    batch.Put("key-large" + std::to_string(i), value_large);
+  }
+  s = db_->Write(write_options_, batch);
+  ASSERT_TRUE(s.IsInvalidArgument());
+  std::string value_out;
+  s = db_->Get(read_options_, "key-large0", &value_out);
+  ASSERT_TRUE(s.IsNotFound());
+  Close();
+}
+
+
 TEST(DBTest, KeysWithNullBytes) {
   ResetAllOptions();
   kdb::Logger::set_current_level("emerg");
@@ -464,6 +737,62 @@ TEST(DBTest, MultipartReader) {
   }
 }
 
+TEST(DBTest, MultipartReaderParallelChecksum) {
+  // The values are stored uncompressed, so that the checksum of the large one
+  // is computed at once by several threads, even with the small threshold
+  ResetAllOptions();
+  kdb::Logger::set_current_level("emerg");
+  db_options_.compression.type = kNoCompression;
+  Open();
+  kdb::Status s;
+
+  std::seed_seq seq{1, 2, 3, 4, 5, 6, 7};
+  std::mt19937 generator(seq);
+  std::uniform_int_distribution<int> random_dist(0,255);
+
+  uint64_t total_size = 1024*1024 * 3 + 13;
+  uint64_t buffersize = 1024 * 64;
+  std::string value_in(total_size, 0);
+  for (uint64_t i = 0; i < total_size; i++) {
+    value_in[i] = static_cast<char>(random_dist(generator));
+  }
+
+  kdb::ByteArray key = kdb::NewDeepCopyByteArray("myentry", 7);
+  kdb::MultipartWriter mp_writer = db_->NewMultipartWriter(write_options_, key, total_size);
+  for (uint64_t i = 0; i < total_size; i += buffersize) {
+    uint64_t size_current = std::min(buffersize, total_size - i);
+    kdb::ByteArray part = kdb::NewDeepCopyByteArray(value_in.data() + i, size_current);
+    s = mp_writer.PutPart(part);
+    ASSERT_TRUE(s.IsOK());
+  }
+  db_->Flush();
+
+  uint64_t sizes_min[] = { 1024*1024, 64*1024*1024 };
+  for (auto size_min: sizes_min) {
+    kdb::ReadOptions read_options;
+    read_options.verify_checksums = true;
+    read_options.verify_checksums__parallel_min_size = size_min;
+    kdb::MultipartReader mp_reader = db_->NewMultipartReader(read_options, key);
+    ASSERT_TRUE(mp_reader.GetStatus().IsOK());
+
+    std::string value_out;
+    for (mp_reader.Begin(); mp_reader.IsValid(); mp_reader.Next()) {
+      if (value_out.empty()) ASSERT_EQ(mp_reader.is_checksum_done_, size_min <= total_size);
+      kdb::ByteArray part;
+      s = mp_reader.GetPart(&part);
+      ASSERT_TRUE(s.IsOK());
+      value_out.append(part.data(), part.size());
+    }
+    s = mp_reader.GetStatus();
+    if (!s.IsOK()) fprintf(stderr, "Error: %s\n", s.ToString().c_str());
+    ASSERT_TRUE(s.IsOK());
+    ASSERT_TRUE(value_out == value_in);
+  }
+
+  Close();
+}
+
+
 TEST(DBTest, SingleThreadSmallEntries) {
   while (IterateOverOptions()) {
     kdb::Logger::set_current_level("emerg");
@@ -591,6 +920,132 @@ TEST(DBTest, SingleThreadSnapshot) {
 }
 
 
+TEST(DBTest, SnapshotDeletedKey) {
+  ResetAllOptions();
+  kdb::Logger::set_current_level("emerg");
+  Open();
+  kdb::Status s;
+
+  // The delete is still in the write buffer when the snapshot is created,
+  // and hides the version of the key that was flushed
+  s = db_->Put(write_options_, "key1", "value1");
+  ASSERT_TRUE(s.IsOK());
+  db_->Flush();
+  kdb::ByteArray key = kdb::NewDeepCopyByteArray("key1", 4);
+  s = db_->Delete(write_options_, key);
+  ASSERT_TRUE(s.IsOK());
+
+  kdb::Snapshot snapshot = db_->NewSnapshot();
+  kdb::ByteArray value_out;
+  s = snapshot.Get(read_options_, key, &value_out);
+  ASSERT_TRUE(s.IsNotFound());
+  kdb::MultipartReader mp_reader = snapshot.NewMultipartReader(read_options_, key);
+  ASSERT_TRUE(mp_reader.GetStatus().IsNotFound());
+  snapshot.Close();
+  Close();
+}
+
+
+TEST(DBTest, SnapshotMultipartEntryInWriteBuffer) {
+  ResetAllOptions();
+  kdb::Logger::set_current_level("emerg");
+  Open();
+  kdb::Status s;
+
+  // All the parts are still in the write buffer when the snapshot is created
+  std::string value_in;
+  for (int i = 0; i < 4096; i++) value_in += std::to_string(i);
+  uint64_t buffersize = 1024;
+  kdb::ByteArray key = kdb::NewDeepCopyByteArray("key1", 4);
+  kdb::MultipartWriter mp_writer = db_->NewMultipartWriter(write_options_, key, value_in.size());
+  for (uint64_t i = 0; i < value_in.size(); i += buffersize) {
+    uint64_t size_current = std::min(buffersize, value_in.size() - i);
+    kdb::ByteArray part = kdb::NewDeepCopyByteArray(value_in.data() + i, size_current);
+    s = mp_writer.PutPart(part);
+    ASSERT_TRUE(s.IsOK());
+  }
+
+  kdb::Snapshot snapshot = db_->NewSnapshot();
+  kdb::MultipartReader mp_reader = snapshot.NewMultipartReader(read_options_, key);
+  ASSERT_TRUE(mp_reader.GetStatus().IsOK());
+  std::string value_out;
+  for (mp_reader.Begin(); mp_reader.IsValid(); mp_reader.Next()) {
+    kdb::ByteArray part;
+    mp_reader.GetPart(&part);
+    value_out.append(part.data(), part.size());
+  }
+  ASSERT_TRUE(mp_reader.GetStatus().IsOK());
+  ASSERT_TRUE(value_out == value_in);
+
+  int num_items = 0;
+  kdb::Iterator iterator = snapshot.NewIterator(read_options_);
+  for (iterator.Begin(); iterator.IsValid(); iterator.Next()) {
+    if (iterator.GetKey().ToString() == "key1") num_items += 1;
+  }
+  ASSERT_EQ(num_items, 1);
+  snapshot.Close();
+  Close();
+}
+
+
+TEST(DBTest, SnapshotConsistentWithConcurrentWriter) {
+  // The writer sets all the keys to version 1, then all of them to version
+  // 2, and so on. The state of any consistent cut is a prefix of that
+  // sequence: the versions of the keys are decreasing and differ by at most
+  // one, and they never go back from one snapshot to the next. The values
+  // are stored uncompressed, as Snapshot::Get() returns the raw values. The
+  // write buffer is small, so that most of the keys of a snapshot come from
+  // the index and not from the orders copied from the write buffer.
+  ResetAllOptions();
+  kdb::Logger::set_current_level("emerg");
+  db_options_.compression.type = kNoCompression;
+  db_options_.write_buffer__size = 1024;
+  db_options_.storage__num_lanes = 2;
+  Open();
+
+  int num_keys = 500;
+  uint64_t num_versions = 400;
+  std::atomic<bool> is_writer_done(false);
+  std::thread writer([&]() {
+    for (uint64_t version = 1; version <= num_versions; version++) {
+      for (int i = 0; i < num_keys; i++) {
+        db_->Put(write_options_, "key" + std::to_string(i), std::to_string(version));
+      }
+    }
+    is_writer_done = true;
+  });
+
+  uint64_t version_first_previous = 0;
+  bool is_consistent = true;
+  while (!is_writer_done && is_consistent) {
+    kdb::Snapshot snapshot = db_->NewSnapshot();
+    uint64_t version_first = 0;
+    uint64_t version_previous = 0;
+    for (int i = 0; i < num_keys; i++) {
+      std::string key_str = "key" + std::to_string(i);
+      kdb::ByteArray key = kdb::NewDeepCopyByteArray(key_str.c_str(), key_str.size());
+      kdb::ByteArray value_out;
+      kdb::Status s = snapshot.Get(read_options_, key, &value_out);
+      uint64_t version = s.IsOK() ? std::stoull(value_out.ToString()) : 0;
+      if (i == 0) {
+        version_first = version;
+      } else if (version > version_previous || version + 1 < version_first) {
+        fprintf(stderr, "Inconsistent snapshot: key%d has version %" PRIu64 ", key0 has version %" PRIu64 "\n", i, version, version_first);
+        is_consistent = false;
+      }
+      version_previous = version;
+    }
+    if (version_first < version_first_previous) is_consistent = false;
+    version_first_previous = version_first;
+    snapshot.Close();
+  }
+  writer.join();
+
+  ASSERT_TRUE(is_consistent);
+  Close();
+}
+
+
 TEST(DBTest, SingleThreadSmallEntriesCompaction) {
   while (IterateOverOptions()) {
     kdb::Logger::set_current_level("emerg");
@@ -879,6 +1334,109 @@ TEST(DBTest, SingleThreadSingleLargeEntry) {
 }
 
 
+TEST(DBTest, CRC32CCombineAndExtendParallel) {
+  std::seed_seq seq{1, 2, 3, 4, 5, 6, 7};
+  std::mt19937 generator(seq);
+  std::uniform_int_distribution<int> random_dist(0,255);
+
+  size_t size_data = 1024*1024 + 17;
+  std::string data(size_data, 0);
+  for (size_t i = 0; i < size_data; i++) {
+    data[i] = static_cast<char>(random_dist(generator));
+  }
+
+  // Lengths around the block sizes of the zero operators, and random ones
+  std::vector<size_t> sizes = { 0, 1, 2, 3, 7, 255, 256, 257, 8191, 8192, 8193, 65537, size_data };
+  std::uniform_int_distribution<size_t> random_size(0, size_data);
+  for (int i = 0; i < 20; i++) sizes.push_back(random_size(generator));
+
+  for (auto size: sizes) {
+    uint32_t crc_full = kdb::crc32c::Value(data.data(), size);
+
+    std::vector<size_t> splits = { 0, size / 2, size };
+    std::uniform_int_distribution<size_t> random_split(0, size);
+    for (int i = 0; i < 5; i++) splits.push_back(random_split(generator));
+    for (auto split: splits) {
+      uint32_t crc_a = kdb::crc32c::Value(data.data(), split);
+      uint32_t crc_b = kdb::crc32c::Value(data.data() + split, size - split);
+      ASSERT_EQ(kdb::crc32c::Combine(crc_a, crc_b, size - split), crc_full);
+    }
+
+    uint32_t crc_init = kdb::crc32c::Value("myentry", 7);
+    uint32_t crc_extend = kdb::crc32c::Extend(crc_init, data.data(), size);
+    uint32_t nums_threads[] = { 0, 1, 2, 3, 4, 7, 16 };
+    for (auto num_threads: nums_threads) {
+      ASSERT_EQ(kdb::crc32c::ExtendParallel(crc_init, data.data(), size, num_threads), crc_extend);
+    }
+  }
+}
+
+
+TEST(DBTest, HashIndexCopyOnWrite) {
+  // The copy is made while the index is in the middle of a resize, and the
+  // copy then goes through another one: none of the writes to the copy, which
+  // share the pages of the index, must be visible in the index
+  kdb::HashIndex index;
+  uint64_t num_keys = 1600;
+  for (uint64_t i = 0; i < num_keys; i++) index.Insert(i * 7919, i + 2);
+  kdb::HashIndex copy(index);
+  for (uint64_t i = 0; i < num_keys; i += 2) copy.Erase(i * 7919);
+  for (uint64_t i = num_keys; i < 2 * num_keys; i++) copy.Insert(i * 7919, i + 2);
+  copy.Insert(7919, 1000000);
+
+  ASSERT_EQ(index.size(), num_keys);
+  ASSERT_EQ(copy.size(), 2 * num_keys - num_keys / 2 + 1);
+  uint64_t num_count_valid = 0;
+  for (uint64_t i = 0; i < 2 * num_keys; i++) {
+    std::vector<uint64_t> locations_index;
+    std::vector<uint64_t> locations_copy;
+    std::vector<uint64_t> locations_index_expected;
+    std::vector<uint64_t> locations_copy_expected;
+    index.GetLocations(i * 7919, &locations_index);
+    copy.GetLocations(i * 7919, &locations_copy);
+    if (i < num_keys) locations_index_expected.push_back(i + 2);
+    if (i >= num_keys || i % 2 == 1) locations_copy_expected.push_back(i + 2);
+    if (i == 1) locations_copy_expected.push_back(1000000);
+    if (   locations_index == locations_index_expected
+        && locations_copy == locations_copy_expected) {
+      num_count_valid += 1;
+    }
+  }
+  ASSERT_EQ(num_count_valid, 2 * num_keys);
+}
+
+
+TEST(DBTest, ParseDirpaths) {
+  std::vector<std::string> dirpaths;
+  kdb::Status s;
+
+  s = kdb::HSTableManager::ParseDirpaths("db", " ", &dirpaths);
+  ASSERT_TRUE(s.IsOK());
+  ASSERT_TRUE(dirpaths == std::vector<std::string>({ "db" }));
+
+  s = kdb::HSTableManager::ParseDirpaths("db", " path0/ ,\tpath1//,/", &dirpaths);
+  ASSERT_TRUE(s.IsOK());
+  ASSERT_TRUE(dirpaths == std::vector<std::string>({ "path0", "path1", "/" }));
+
+  const char* paths_invalid[] = { ",path0", "path0,", "path0, ,path1", "path0,path0/" };
+  for (auto paths: paths_invalid) {
+    s = kdb::HSTableManager::ParseDirpaths("db", paths, &dirpaths);
+    ASSERT_TRUE(s.IsInvalidArgument());
+  }
+
+  // Nothing is created when the paths are invalid
+  kdb::Logger::set_current_level("emerg");
+  kdb::DatabaseOptions db_options;
+  db_options.storage__paths = "db_test_path0,,db_test_path1";
+  kdb::Database db(db_options, "db_test_invalid_paths");
+  s = db.Open();
+  ASSERT_TRUE(s.IsInvalidArgument());
+  struct stat info;
+  ASSERT_TRUE(stat("db_test_invalid_paths", &info) != 0);
+  ASSERT_TRUE(stat("db_test_path0", &info) != 0);
+}
+
+
 TEST(DBTest, FileUtil) {
   int fd = open("/tmp/allocate", O_WRONLY|O_CREAT, 0644);
   auto start = std::chrono::high_resolution_clock::now();
@@ -0,0 +1,63 @@
+// Copyright (c) 2014, Emmanuel Goossaert. All rights reserved.
+// Use of this source code is governed by the BSD 3-Clause License,
+// that can be found in the LICENSE file.
+
+#ifndef KINGDB_ARENA_H_
+#define KINGDB_ARENA_H_
+
+#include "util/debug.h"
+#include <cinttypes>
+#include <string.h>
+
+#include "util/byte_array.h"
+
+namespace kdb {
+
+// Arena copies small byte arrays into large slabs of memory, so that many
+// keys and values can be copied with a single allocation. The byte arrays it
+// returns are slices of a slab, and share its reference-counted resource: a
+// slab is freed once the arena has moved on to another slab and the last
+// byte array pointing into it is destroyed. Clearing an arena is therefore
+// O(1), and never invalidates the byte arrays it returned.
+//
+// Arena is not thread-safe, the caller must serialize the calls to Copy()
+// and Clear().
+class Arena {
+ public:
+  static const uint64_t kSizeSlab = 64 * 1024;
+
+  // Byte arrays larger than this are not worth copying into a slab, as they
+  // would waste too much of the end of the slabs
+  static const uint64_t kSizeMaximumAllocation = 4 * 1024;
+
+  Arena() : offset_(kSizeSlab) {}
+
+  // 'byte_array' must not be larger than kSizeMaximumAllocation
+  ByteArray Copy(ByteArray& byte_array) {
+    uint64_t size = byte_array.size();
+    if (size == 0) return ByteArray::NewEmptyByteArray();
+    if (offset_ + size > kSizeSlab) {
+      slab_ = ByteArray::NewAllocatedMemoryByteArray(kSizeSlab);
+      offset_ = 0;
+    }
+    ByteArray byte_array_out = slab_;
+    byte_array_out.set_offset(offset_);
+    byte_array_out.set_size(size);
+    memcpy(byte_array_out.data(), byte_array.data(), size);
+    offset_ += size;
+    return byte_array_out;
+  }
+
+  void Clear() {
+    slab_ = ByteArray::NewEmptyByteArray();
+    offset_ = kSizeSlab;
+  }
+
+ private:
+  ByteArray slab_;
+  uint64_t offset_;
+};
+
+} // namespace kdb
+
+#endif // KINGDB_ARENA_H_
@@ -190,6 +190,7 @@ class ByteArray {
  friend class SequentialIterator;
  friend class NetworkTask;
  friend class CompressorLZ4;
+ friend class Arena;
  public:
   ByteArray()
     : size_(0),
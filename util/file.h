@@ -12,14 +12,22 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <errno.h>
+#include <climits>
+#include <algorithm>
 #include <memory>
 
 #include "util/status.h"
 #include "util/logger.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 namespace kdb {
 
 class FileUtil {
@@ -156,6 +164,31 @@ class FileUtil {
     return 4096;
   }
 
+  // Writes all the buffers of 'iov' at 'offset' in the file, with as many
+  // calls to pwritev() as needed, IOV_MAX buffers at a time. The entries of
+  // 'iov' are modified when a write is short. Returns 0 on success, and -1
+  // with errno set otherwise.
+  static int pwritev_all(int fd, struct iovec* iov, int iovcnt, int64_t offset) {
+    while (iovcnt > 0) {
+      ssize_t ret = pwritev(fd, iov, std::min(iovcnt, IOV_MAX), offset);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+      offset += ret;
+      while (iovcnt > 0 && static_cast<size_t>(ret) >= iov->iov_len) {
+        ret -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+      if (iovcnt > 0) {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + ret;
+        iov->iov_len -= ret;
+      }
+    }
+    return 0;
+  }
+
   static int sync_file(int fd) {
     int ret;
 #ifdef F_FULLFSYNC
@@ -0,0 +1,443 @@
+// Copyright (c) 2014, Emmanuel Goossaert. All rights reserved.
+// Use of this source code is governed by the BSD 3-Clause License,
+// that can be found in the LICENSE file.
+
+#include "util/io_engine.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+#include "util/file.h"
+#include "util/logger.h"
+
+#ifdef KINGDB_HAS_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace kdb {
+
+int IOEngineSyscall::Write(int fd, struct iovec* iov, int iovcnt, int64_t offset, bool sync) {
+  if (FileUtil::pwritev_all(fd, iov, iovcnt, offset) < 0) return -1;
+  if (sync) return FileUtil::sync_file(fd);
+  return 0;
+}
+
+int IOEngineSyscall::Sync(int fd) {
+  return FileUtil::sync_file(fd);
+}
+
+void IOEngineSyscall::Read(std::vector<ReadRequest>& requests) {
+  for (auto& request: requests) {
+    ssize_t ret;
+    do {
+      ret = pread(request.fd, request.buffer, request.size, request.offset);
+    } while (ret < 0 && errno == EINTR);
+    request.result = (ret < 0) ? -errno : ret;
+  }
+}
+
+
+#ifdef KINGDB_HAS_IO_URING
+
+IOEngineUring::IOEngineUring()
+    : stop_requested_(false),
+      is_broken_(false),
+      fd_ring_(-1),
+      num_entries_(0),
+      sq_ring_(MAP_FAILED),
+      cq_ring_(MAP_FAILED),
+      size_sq_ring_(0),
+      size_cq_ring_(0),
+      sqes_(static_cast<struct io_uring_sqe*>(MAP_FAILED)),
+      size_sqes_(0),
+      sequence_operation_(0),
+      num_in_flight_(0) {
+}
+
+IOEngineUring::~IOEngineUring() {
+  // The reaper only stops once all the entries in flight are completed
+  std::unique_lock<std::mutex> lock(mutex_);
+  stop_requested_ = true;
+  cv_reaper_.notify_one();
+  lock.unlock();
+  if (thread_reaper_.joinable()) thread_reaper_.join();
+  CloseRing();
+}
+
+Status IOEngineUring::Open() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd_ring_ = syscall(__NR_io_uring_setup, kNumEntries, &params);
+  if (fd_ring_ < 0) return Status::IOError("io_uring_setup()", strerror(errno));
+
+  size_sq_ring_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  size_cq_ring_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool is_single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+  if (is_single_mmap) size_sq_ring_ = size_cq_ring_ = std::max(size_sq_ring_, size_cq_ring_);
+  sq_ring_ = mmap(nullptr, size_sq_ring_, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd_ring_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    Status s = Status::IOError("mmap() of the submission queue", strerror(errno));
+    CloseRing();
+    return s;
+  }
+  if (is_single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(nullptr, size_cq_ring_, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd_ring_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      Status s = Status::IOError("mmap() of the completion queue", strerror(errno));
+      CloseRing();
+      return s;
+    }
+  }
+  size_sqes_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = static_cast<struct io_uring_sqe*>(mmap(nullptr, size_sqes_, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd_ring_, IORING_OFF_SQES));
+  if (sqes_ == MAP_FAILED) {
+    Status s = Status::IOError("mmap() of the submission queue entries", strerror(errno));
+    CloseRing();
+    return s;
+  }
+
+  char* sq = static_cast<char*>(sq_ring_);
+  char* cq = static_cast<char*>(cq_ring_);
+  sq_tail_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+  sq_tail_local_ = *sq_tail_;
+  cq_head_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  // The completion queue is at least as large as the submission queue, thus
+  // it cannot overflow as long as no more than num_entries_ entries are in
+  // flight at any time.
+  num_entries_ = params.sq_entries;
+  entries_.resize(num_entries_);
+  for (uint32_t i = 0; i < num_entries_; i++) {
+    entries_free_.push_back(num_entries_ - 1 - i);
+  }
+  thread_reaper_ = std::thread(&IOEngineUring::ProcessingLoopReaper, this);
+  return Status::OK();
+}
+
+void IOEngineUring::CloseRing() {
+  if (sqes_ != MAP_FAILED) munmap(sqes_, size_sqes_);
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) munmap(cq_ring_, size_cq_ring_);
+  if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, size_sq_ring_);
+  if (fd_ring_ >= 0) close(fd_ring_);
+  sqes_ = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+  cq_ring_ = MAP_FAILED;
+  sq_ring_ = MAP_FAILED;
+  fd_ring_ = -1;
+}
+
+// Waits until 'num_sqes' entries are free, and returns false if the ring
+// broke in the meantime. The entries obtained with GetSqe() and not yet
+// submitted are submitted first, as they may be the ones being waited for.
+bool IOEngineUring::WaitForEntries(std::unique_lock<std::mutex>& lock, uint32_t num_sqes) {
+  while (!is_broken_ && entries_free_.size() < num_sqes) {
+    Submit();
+    if (entries_free_.size() < num_sqes) cv_completed_.wait(lock);
+  }
+  return !is_broken_;
+}
+
+// Once the entry is completed, 'result' is set to its result. WaitForEntries()
+// must have been called before, to make sure that the entry is free.
+struct io_uring_sqe* IOEngineUring::GetSqe(Operation* operation, int64_t* result) {
+  uint32_t index_entry = entries_free_.back();
+  entries_free_.pop_back();
+  entries_[index_entry].operation = operation;
+  entries_[index_entry].result = result;
+  entries_unsubmitted_.push_back(index_entry);
+  operation->num_pending += 1;
+
+  uint32_t index = sq_tail_local_ & sq_mask_;
+  struct io_uring_sqe* sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = index_entry;
+  sq_array_[index] = index;
+  sq_tail_local_ += 1;
+  return sqe;
+}
+
+// Submits the entries obtained with GetSqe() since the last call, without
+// waiting for them. The caller must hold the mutex.
+void IOEngineUring::Submit() {
+  if (entries_unsubmitted_.empty()) return;
+  __atomic_store_n(sq_tail_, sq_tail_local_, __ATOMIC_RELEASE);
+  uint32_t num_submitted = 0;
+  while (num_submitted < entries_unsubmitted_.size()) {
+    uint32_t num_to_submit = entries_unsubmitted_.size() - num_submitted;
+    int ret = syscall(__NR_io_uring_enter, fd_ring_, num_to_submit, 0, 0, nullptr, 0);
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) continue;
+    if (ret <= 0) {
+      // The ring is left in an unknown state, the system calls are used from
+      // now on. The entries that were not submitted will never be completed.
+      int errno_enter = (ret < 0) ? errno : EIO;
+      log::emerg("IOEngineUring::Submit()", "Error io_uring_enter(), using system calls: %s", strerror(errno_enter));
+      is_broken_ = true;
+      for (uint32_t i = num_submitted; i < entries_unsubmitted_.size(); i++) {
+        CompleteEntry(entries_unsubmitted_[i], -ECANCELED);
+      }
+      cv_completed_.notify_all();
+      break;
+    }
+    num_submitted += ret;
+    num_in_flight_ += ret;
+  }
+  entries_unsubmitted_.clear();
+  cv_reaper_.notify_one();
+}
+
+void IOEngineUring::CompleteEntry(uint32_t index, int64_t result) {
+  Entry& entry = entries_[index];
+  *entry.result = result;
+  entry.operation->num_pending -= 1;
+  entries_free_.push_back(index);
+}
+
+// Reaps the completions, so that the threads that submitted entries do not
+// have to wait for them unless they need their results.
+void IOEngineUring::ProcessingLoopReaper() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    while (num_in_flight_ == 0 && !stop_requested_) cv_reaper_.wait(lock);
+    if (num_in_flight_ == 0) return;
+    lock.unlock();
+    // Only the completion queue is used here: the submissions can go on
+    // while the reaper is waiting
+    int ret = syscall(__NR_io_uring_enter, fd_ring_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    int errno_enter = errno;
+    lock.lock();
+    uint32_t head = *cq_head_;
+    uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+      CompleteEntry(cqe->user_data, cqe->res);
+      num_in_flight_ -= 1;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    if (ret < 0 && errno_enter != EINTR && errno_enter != EAGAIN && errno_enter != EBUSY) {
+      // Without completions, the entries in flight would be waited for
+      // forever: they are reported as failed
+      log::emerg("IOEngineUring::ProcessingLoopReaper()", "Error io_uring_enter(), using system calls: %s", strerror(errno_enter));
+      is_broken_ = true;
+      for (uint32_t index = 0; index < num_entries_; index++) {
+        if (std::find(entries_free_.begin(), entries_free_.end(), index) != entries_free_.end()) continue;
+        CompleteEntry(index, -errno_enter);
+      }
+      num_in_flight_ = 0;
+    }
+    cv_completed_.notify_all();
+  }
+}
+
+// The buffers are split into writes of at most IOV_MAX buffers, which are
+// linked into a chain along with the sync if any: the sync only starts once
+// all the writes of the chain are done. The chain has to fit in the ring, and
+// the rare writes that do not are split into multiple chains, each of them
+// waited for before the next one if the file has to be synced.
+int IOEngineUring::WriteAsync(int fd, struct iovec* iov, int iovcnt, int64_t offset, bool sync, uint64_t* ticket_out) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  *ticket_out = sequence_operation_;
+  while (iovcnt > 0 || sync) {
+    int iovcnt_chain = std::min(iovcnt, static_cast<int>(num_entries_ - 1) * IOV_MAX);
+    bool has_sync = (sync && iovcnt_chain == iovcnt);
+    uint32_t num_writes = (iovcnt_chain + IOV_MAX - 1) / IOV_MAX;
+    if (!WaitForEntries(lock, num_writes + (has_sync ? 1 : 0))) {
+      lock.unlock();
+      return IOEngineSyscall::Write(fd, iov, iovcnt, offset, sync);
+    }
+
+    // The buffers are copied, since the entries in the ring point to them
+    // until the writes are done
+    uint64_t id_operation = ++sequence_operation_;
+    Operation& operation = operations_[id_operation];
+    operation.is_write = true;
+    operation.num_pending = 0;
+    operation.fd = fd;
+    operation.sync = has_sync;
+    operation.result_sync = 0;
+    operation.iovecs.assign(iov, iov + iovcnt_chain);
+    struct iovec* iov_chain = operation.iovecs.data();
+    for (uint32_t i = 0; i < num_writes; i++) {
+      WriteOperation write;
+      write.iov = iov_chain;
+      write.iovcnt = std::min(iovcnt_chain, IOV_MAX);
+      write.offset = offset;
+      write.size = 0;
+      write.result = 0;
+      for (int j = 0; j < write.iovcnt; j++) write.size += iov_chain[j].iov_len;
+      operation.writes.push_back(write);
+      iov_chain += write.iovcnt;
+      iov += write.iovcnt;
+      iovcnt_chain -= write.iovcnt;
+      iovcnt -= write.iovcnt;
+      offset += write.size;
+    }
+
+    for (uint32_t i = 0; i < num_writes; i++) {
+      WriteOperation& write = operation.writes[i];
+      struct io_uring_sqe* sqe = GetSqe(&operation, &write.result);
+      sqe->opcode = IORING_OP_WRITEV;
+      sqe->fd = fd;
+      sqe->addr = reinterpret_cast<uint64_t>(write.iov);
+      sqe->len = write.iovcnt;
+      sqe->off = write.offset;
+      if (i + 1 < num_writes || has_sync) sqe->flags = IOSQE_IO_LINK;
+    }
+    if (has_sync) {
+      struct io_uring_sqe* sqe = GetSqe(&operation, &operation.result_sync);
+      sqe->opcode = IORING_OP_FSYNC;
+      sqe->fd = fd;
+      sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+      sync = false;
+    }
+    Submit();
+    *ticket_out = id_operation;
+
+    if (sync && WaitForWritesLocked(lock, id_operation) < 0) return -1;
+  }
+  return 0;
+}
+
+// Waits for the write chains up to 'ticket', and completes them in the order
+// in which they were submitted. The caller must hold the mutex.
+int IOEngineUring::WaitForWritesLocked(std::unique_lock<std::mutex>& lock, uint64_t ticket) {
+  while (true) {
+    bool is_done = true;
+    for (auto it = operations_.begin(); it != operations_.end() && it->first <= ticket; ++it) {
+      if (it->second.is_write && it->second.num_pending > 0) {
+        is_done = false;
+        break;
+      }
+    }
+    if (is_done) break;
+    cv_completed_.wait(lock);
+  }
+
+  int ret = 0;
+  int errno_write = 0;
+  auto it = operations_.begin();
+  while (it != operations_.end() && it->first <= ticket) {
+    if (!it->second.is_write) {
+      ++it;
+      continue;
+    }
+    if (FinishWrite(it->second) < 0) {
+      ret = -1;
+      errno_write = errno;
+    }
+    it = operations_.erase(it);
+  }
+  if (ret < 0) errno = errno_write;
+  return ret;
+}
+
+// A short write cancels the rest of its chain: these rare cases are
+// completed with system calls.
+int IOEngineUring::FinishWrite(Operation& operation) {
+  bool has_short_write = false;
+  for (auto& write: operation.writes) {
+    int64_t ret = write.result;
+    if (ret < 0 && ret != -ECANCELED) {
+      errno = -ret;
+      return -1;
+    }
+    if (static_cast<uint64_t>(ret) == write.size) continue;
+    has_short_write = true;
+    if (ret < 0) ret = 0;
+    while (write.iovcnt > 0 && static_cast<uint64_t>(ret) >= write.iov->iov_len) {
+      ret -= write.iov->iov_len;
+      write.offset += write.iov->iov_len;
+      write.iov++;
+      write.iovcnt--;
+    }
+    if (write.iovcnt == 0) continue;
+    write.iov->iov_base = static_cast<char*>(write.iov->iov_base) + ret;
+    write.iov->iov_len -= ret;
+    if (FileUtil::pwritev_all(operation.fd, write.iov, write.iovcnt, write.offset + ret) < 0) return -1;
+  }
+  if (!operation.sync) return 0;
+  if (has_short_write || operation.result_sync == -ECANCELED) return FileUtil::sync_file(operation.fd);
+  if (operation.result_sync < 0) {
+    errno = -operation.result_sync;
+    return -1;
+  }
+  return 0;
+}
+
+int IOEngineUring::WaitForWrites(uint64_t ticket) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return WaitForWritesLocked(lock, ticket);
+}
+
+int IOEngineUring::Write(int fd, struct iovec* iov, int iovcnt, int64_t offset, bool sync) {
+  uint64_t ticket;
+  if (WriteAsync(fd, iov, iovcnt, offset, sync, &ticket) < 0) return -1;
+  return WaitForWrites(ticket);
+}
+
+int IOEngineUring::Sync(int fd) {
+  // The writes still in flight are not in the chain of the sync, thus they
+  // are waited for first
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (WaitForWritesLocked(lock, sequence_operation_) < 0) return -1;
+  lock.unlock();
+  return Write(fd, nullptr, 0, 0, true);
+}
+
+void IOEngineUring::Read(std::vector<ReadRequest>& requests) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  uint64_t id_operation = ++sequence_operation_;
+  Operation& operation = operations_[id_operation];
+  operation.is_write = false;
+  operation.num_pending = 0;
+  uint32_t num_requests = 0;
+  for (; num_requests < requests.size(); num_requests++) {
+    if (!WaitForEntries(lock, 1)) break;
+    ReadRequest& request = requests[num_requests];
+    struct io_uring_sqe* sqe = GetSqe(&operation, &request.result);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = request.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(request.buffer);
+    sqe->len = request.size;
+    sqe->off = request.offset;
+  }
+  Submit();
+  while (operation.num_pending > 0) cv_completed_.wait(lock);
+  operations_.erase(id_operation);
+  lock.unlock();
+
+  if (num_requests < requests.size()) {
+    std::vector<ReadRequest> requests_left(requests.begin() + num_requests, requests.end());
+    IOEngineSyscall::Read(requests_left);
+    std::copy(requests_left.begin(), requests_left.end(), requests.begin() + num_requests);
+  }
+}
+
+#endif // KINGDB_HAS_IO_URING
+
+
+IOEngine* MakeIOEngine(IOEngineType type) {
+  if (type == kIOEngineUring) {
+#ifdef KINGDB_HAS_IO_URING
+    IOEngineUring* io_engine = new IOEngineUring();
+    Status s = io_engine->Open();
+    if (s.IsOK()) return io_engine;
+    delete io_engine;
+    log::warn("MakeIOEngine()", "Could not set up io_uring, using system calls: %s", s.ToString().c_str());
+#else
+    log::warn("MakeIOEngine()", "io_uring is not supported on this platform, using system calls");
+#endif // KINGDB_HAS_IO_URING
+  }
+  return new IOEngineSyscall();
+}
+
+} // namespace kdb
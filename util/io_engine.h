@@ -0,0 +1,185 @@
+// Copyright (c) 2014, Emmanuel Goossaert. All rights reserved.
+// Use of this source code is governed by the BSD 3-Clause License,
+// that can be found in the LICENSE file.
+
+#ifndef KINGDB_IO_ENGINE_H_
+#define KINGDB_IO_ENGINE_H_
+
+#include "util/debug.h"
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <map>
+#include <vector>
+#include <cinttypes>
+#include <sys/uio.h>
+
+#include "util/options.h"
+#include "util/status.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define KINGDB_HAS_IO_URING
+#endif
+#endif
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace kdb {
+
+// A read of at most 'size' bytes at 'offset' in the file 'fd'. Once the read
+// is done, 'result' is the number of bytes read, or -errno on error.
+struct ReadRequest {
+  int fd;
+  char* buffer;
+  uint64_t size;
+  uint64_t offset;
+  int64_t result;
+};
+
+// IOEngine performs the I/O of the HSTables. The system call engine performs
+// each operation with a blocking system call, and the io_uring engine submits
+// whole batches of operations to the kernel at once. The writes of the
+// io_uring engine can be asynchronous: WriteAsync() returns once the write
+// is submitted, and WaitForWrites() waits for its completion.
+class IOEngine {
+ public:
+  IOEngine() {}
+  virtual ~IOEngine() {}
+
+  // Writes the buffers of 'iov' at 'offset' in the file, and if 'sync' is
+  // true, syncs the data of the file once all the buffers are written. The
+  // entries of 'iov' may be modified. Returns 0 on success, and -1 with errno
+  // set otherwise.
+  virtual int Write(int fd, struct iovec* iov, int iovcnt, int64_t offset, bool sync) = 0;
+
+  // Same as Write(), but may return before the write is done, in which case
+  // the memory of the buffers must stay valid until WaitForWrites() is called
+  // with the ticket stored in 'ticket_out'. The array 'iov' itself can be
+  // released at once. Returns -1 with errno set if the write could not be
+  // submitted, and 0 otherwise. By default, the write is done before
+  // returning.
+  virtual int WriteAsync(int fd, struct iovec* iov, int iovcnt, int64_t offset, bool sync, uint64_t* ticket_out) {
+    *ticket_out = 0;
+    return Write(fd, iov, iovcnt, offset, sync);
+  }
+
+  // Waits until the write of 'ticket', and all the writes submitted before
+  // it, are done. Returns 0 if they all succeeded, and -1 with errno set
+  // otherwise.
+  virtual int WaitForWrites(uint64_t ticket) { return 0; }
+
+  // Syncs the data of the file, once all the writes submitted before are
+  // done. Returns 0 on success, and -1 with errno set otherwise.
+  virtual int Sync(int fd) = 0;
+
+  // Performs all the reads of 'requests'
+  virtual void Read(std::vector<ReadRequest>& requests) = 0;
+};
+
+class IOEngineSyscall: public IOEngine {
+ public:
+  IOEngineSyscall() {}
+  virtual ~IOEngineSyscall() {}
+  virtual int Write(int fd, struct iovec* iov, int iovcnt, int64_t offset, bool sync);
+  virtual int Sync(int fd);
+  virtual void Read(std::vector<ReadRequest>& requests);
+};
+
+#ifdef KINGDB_HAS_IO_URING
+// The io_uring engine uses the system calls directly, so that it does not
+// depend on liburing. The callers only hold the mutex while they submit
+// their operations, and then wait for them on a condition variable: the
+// completions are reaped by a thread of the engine, thus multiple threads
+// can have operations in flight at the same time. No more operations than
+// the size of the ring can be in flight, so that the completion queue
+// cannot overflow. If the ring breaks, the engine falls back on the system
+// calls.
+class IOEngineUring: public IOEngineSyscall {
+ public:
+  static const uint32_t kNumEntries = 128;
+
+  IOEngineUring();
+  virtual ~IOEngineUring();
+  Status Open();
+  virtual int Write(int fd, struct iovec* iov, int iovcnt, int64_t offset, bool sync);
+  virtual int WriteAsync(int fd, struct iovec* iov, int iovcnt, int64_t offset, bool sync, uint64_t* ticket_out);
+  virtual int WaitForWrites(uint64_t ticket);
+  virtual int Sync(int fd);
+  virtual void Read(std::vector<ReadRequest>& requests);
+
+ private:
+  struct WriteOperation {
+    struct iovec* iov;
+    int iovcnt;
+    int64_t offset;
+    uint64_t size;
+    int64_t result;
+  };
+
+  // The entries submitted by a call to Read(), or by a chain of writes, with
+  // the sync of the file at the end of the chain if any
+  struct Operation {
+    bool is_write;
+    uint32_t num_pending;
+    int fd;
+    bool sync;
+    int64_t result_sync;
+    std::vector<struct iovec> iovecs;
+    std::vector<WriteOperation> writes;
+  };
+
+  // An entry in flight, whose user data is its index in entries_
+  struct Entry {
+    Operation* operation;
+    int64_t* result;
+  };
+
+  struct io_uring_sqe* GetSqe(Operation* operation, int64_t* result);
+  bool WaitForEntries(std::unique_lock<std::mutex>& lock, uint32_t num_sqes);
+  void Submit();
+  void CompleteEntry(uint32_t index, int64_t result);
+  int WaitForWritesLocked(std::unique_lock<std::mutex>& lock, uint64_t ticket);
+  int FinishWrite(Operation& operation);
+  void ProcessingLoopReaper();
+  void CloseRing();
+
+  std::mutex mutex_;
+  std::condition_variable cv_completed_;
+  std::condition_variable cv_reaper_;
+  std::thread thread_reaper_;
+  bool stop_requested_;
+  bool is_broken_;
+  int fd_ring_;
+  uint32_t num_entries_;
+  void* sq_ring_;
+  void* cq_ring_;
+  uint64_t size_sq_ring_;
+  uint64_t size_cq_ring_;
+  struct io_uring_sqe* sqes_;
+  uint64_t size_sqes_;
+  uint32_t* sq_tail_;
+  uint32_t sq_mask_;
+  uint32_t* sq_array_;
+  uint32_t sq_tail_local_;
+  uint32_t* cq_head_;
+  uint32_t* cq_tail_;
+  uint32_t cq_mask_;
+  struct io_uring_cqe* cqes_;
+  uint64_t sequence_operation_;
+  std::map<uint64_t, Operation> operations_;
+  std::vector<Entry> entries_;
+  std::vector<uint32_t> entries_free_;
+  std::vector<uint32_t> entries_unsubmitted_;
+  uint32_t num_in_flight_;
+};
+#endif // KINGDB_HAS_IO_URING
+
+// Returns an engine of the requested type, or the system call engine if the
+// requested type is not available.
+IOEngine* MakeIOEngine(IOEngineType type);
+
+} // namespace kdb
+
+#endif // KINGDB_IO_ENGINE_H_
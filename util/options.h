@@ -12,7 +12,8 @@ namespace kdb {
 
 enum HashType {
   kMurmurHash3_64 = 0x0,
-  kxxHash_64      = 0x1
+  kxxHash_64      = 0x1,
+  kxxHash3_64     = 0x2
 };
 
 enum CompressionType {
@@ -30,6 +31,11 @@ enum WriteBufferMode {
   kWriteBufferModeAdaptive = 0x1
 };
 
+enum IOEngineType {
+  kIOEngineSyscall = 0x0,
+  kIOEngineUring   = 0x1
+};
+
 struct CompressionOptions {
   CompressionOptions(CompressionType ct)
       : type(ct) {
@@ -49,7 +55,8 @@ struct DatabaseOptions {
         hash(kxxHash_64),
         compression(kLZ4Compression),
         checksum(kCRC32C),
-        write_buffer__mode(kWriteBufferModeDirect) {
+        write_buffer__mode(kWriteBufferModeDirect),
+        storage__io_engine(kIOEngineSyscall) {
     DatabaseOptions &db_options = *this;
     ConfigParser parser;
     AddParametersToConfigParser(db_options, parser);
@@ -103,10 +110,23 @@ struct DatabaseOptions {
   std::string write_buffer__mode_str;
   WriteBufferMode write_buffer__mode;
 
+  uint64_t read_cache__size;
+
+  uint64_t sync__max_delay_us;
+
   uint64_t storage__inactivity_timeout;
   uint64_t storage__statistics_polling_interval;
   uint64_t storage__minimum_free_space_accept_orders;
   uint64_t storage__maximum_part_size;
+  bool storage__direct_io;
+  std::string storage__io_engine_str;
+  IOEngineType storage__io_engine;
+  uint64_t storage__num_lanes;
+  std::string storage__paths;
+
+  uint64_t index__num_shards;
+
+  uint64_t open__parallelism;
 
   uint64_t compaction__force_interval;
   uint64_t compaction__filesystem__survival_mode_threshold;
@@ -155,6 +175,12 @@ struct DatabaseOptions {
     parser.AddParameter(new kdb::StringParameter(
                          "db.write-buffer.mode", "direct", &db_options.write_buffer__mode_str, false,
                          "The mode with which the write buffer handles incoming traffic, can be 'direct' or 'adaptive'. With the 'direct' mode, once the Write Buffer is full other incoming Write and Delete operations will block until the buffer is persisted to secondary storage. The direct mode should be used when the clients are not subjects to timeouts. When choosing the 'adaptive' mode, incoming orders will be made slower, down to the speed of the writes on the secondary storage, so that they are almost just as fast as when using the direct mode, but are never blocking. The adaptive mode is expected to introduce a small performance decrease, but required for cases where clients timeouts must be avoided, for example when the database is used over a network."));
+    parser.AddParameter(new kdb::UnsignedInt64Parameter(
+                         "db.read-cache.size", "0", &db_options.read_cache__size, false,
+                         "Size of the cache holding the uncompressed values of the entries most recently read. The cache is disabled if equal to 0."));
+    parser.AddParameter(new kdb::UnsignedInt64Parameter(
+                         "db.sync.max-delay-us", "0", &db_options.sync__max_delay_us, false,
+                         "Maximum time in microseconds for which the write buffer waits for more writes before flushing, so that more writes with the sync option can share the same sync to secondary storage. The write buffer only waits when a write with the sync option is pending. If equal to 0, the write buffer is flushed as soon as possible."));
     parser.AddParameter(new kdb::UnsignedInt64Parameter(
                          "db.storage.hstable-size", "32MB", &db_options.storage__hstable_size, false,
                          "Maximum size a HSTable can have. Entries with keys and values beyond that size are considered to be large entries."));
@@ -163,7 +189,7 @@ struct DatabaseOptions {
                          "Compression algorithm used by the storage engine. Can be 'disabled' or 'lz4'."));
     parser.AddParameter(new kdb::StringParameter(
                          "db.storage.hashing", "xxhash-64", &db_options.storage__hashing_algorithm, false,
-                         "Hashing algorithm used by the storage engine. Can be 'xxhash-64' or 'murmurhash3-64'."));
+                         "Hashing algorithm used by the storage engine. Can be 'xxhash-64', 'xxhash3-64' or 'murmurhash3-64'."));
     parser.AddParameter(new kdb::UnsignedInt64Parameter(
                          "db.storage.minimum-free-space-accept-orders", "192MB", &db_options.storage__minimum_free_space_accept_orders, false,
                          "Minimum free disk space required to accept incoming orders. It is recommended that for this value to be at least (2 x 'db.write-buffer.size' + 4 x 'db.hstable.maximum-size'), so that when the file system fills up, the two write buffers can be flushed to secondary storage safely and the survival-mode compaction process can be run."));
@@ -173,9 +199,27 @@ struct DatabaseOptions {
     parser.AddParameter(new kdb::UnsignedInt64Parameter(
                          "db.storage.inactivity-streaming", "60 seconds", &db_options.storage__inactivity_timeout, false,
                          "The time of inactivity after which an entry stored with the streaming API is considered left for dead, and any subsequent incoming parts for that entry are rejected."));
+    parser.AddParameter(new kdb::BooleanParameter(
+                         "db.storage.direct-io", false, &db_options.storage__direct_io, false,
+                         "Write the HSTables with direct I/O (O_DIRECT), so that the data written does not go through the page cache, and does not evict the data that is being read. Only the whole blocks are written with direct I/O, the few bytes at the beginning and the end of each write still go through the page cache. If the file system does not support direct I/O, regular writes are used."));
+    parser.AddParameter(new kdb::StringParameter(
+                         "db.storage.io-engine", "syscall", &db_options.storage__io_engine_str, false,
+                         "The engine with which the HSTables are written, and with which MultiGet() reads the entries, can be 'syscall' or 'io_uring'. With 'syscall', each write and sync is a blocking system call, and MultiGet() reads the entries from memory-mapped files. With 'io_uring', the writes of each flush are chained with the sync of the file and submitted to the kernel at once, without waiting for them: the next flush is written while they are in flight, and the entries become visible once their writes are done. Also, MultiGet() reads its entries with batches of asynchronous reads, which keeps the queues of the storage devices busy. The MultiGet() of the snapshots always reads from memory-mapped files. If io_uring is not available, system calls are used."));
+    parser.AddParameter(new kdb::UnsignedInt64Parameter(
+                         "db.storage.num-lanes", "1", &db_options.storage__num_lanes, false,
+                         "Number of writer lanes with which the storage engine writes the HSTables. Each lane has its own thread and its own current HSTable, and the entries are assigned to the lanes by hashed key, so that the lanes write in parallel. The entries of a WriteBatch whose keys belong to several lanes are written by a single lane, and the other lanes may then have to start new HSTables early."));
+    parser.AddParameter(new kdb::StringParameter(
+                         "db.storage.paths", "", &db_options.storage__paths, false,
+                         "Comma-separated list of directories in which the HSTables are stored, for example one directory per storage device. The new HSTables are spread over the directories in a round-robin fashion, and the output of each compaction goes to the directory with the most free space. If empty, the HSTables are stored in the database directory. The same list of directories must be given every time the database is opened. Opening the database fails if one of the directories in the list is empty, or if a directory is listed more than once."));
     parser.AddParameter(new kdb::UnsignedInt64Parameter(
                          "db.storage.statistics-polling-interval", "5 seconds", &db_options.storage__statistics_polling_interval, false,
                          "The frequency at which statistics are polled in the Storage Engine (free disk space, etc.)."));
+    parser.AddParameter(new kdb::UnsignedInt64Parameter(
+                         "db.index.num-shards", "64", &db_options.index__num_shards, false,
+                         "Number of shards in which the in-memory index is split. Each shard is locked independently, so that an index update only blocks the readers of the shard it is touching. Rounded up to the next power of two."));
+    parser.AddParameter(new kdb::UnsignedInt64Parameter(
+                         "db.open.parallelism", "0", &db_options.open__parallelism, false,
+                         "Number of threads used to load the HSTables when the database is opened. Set to 0 to use as many threads as there are cores."));
 
 
     // Compaction options
@@ -202,8 +246,10 @@ struct DatabaseOptions {
 
 struct ReadOptions {
   bool verify_checksums;
+  uint64_t verify_checksums__parallel_min_size;
   ReadOptions()
-      : verify_checksums(false) {
+      : verify_checksums(false),
+        verify_checksums__parallel_min_size(64*1024*1024) {
   }
 };
 
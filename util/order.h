@@ -34,6 +34,11 @@ struct Order {
   WriteOptions write_options;
   OrderType type;
   ByteArray key;
+
+  // Hashed key computed once by the Database when the order is created, and
+  // used by the write buffer, the writer lanes, the HSTables and the index
+  uint64_t hashed_key;
+
   ByteArray chunk;
   uint64_t offset_chunk;
   uint64_t size_value;
@@ -41,6 +46,11 @@ struct Order {
   uint32_t crc32;
   bool is_large;
 
+  // For the orders of a batch, the number of orders of the batch from this
+  // one to the last one included, and 0 for the orders outside of a batch.
+  // It is only set in the orders that are flushed.
+  uint32_t num_batch_orders_left;
+
   bool IsFirstPart() {
     return (offset_chunk == 0);
   }